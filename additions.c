@@ -4,8 +4,19 @@
 
 #include "private.h"
 #include <assert.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <sys/stat.h>
+#ifndef _WIN32
+#  include <sys/mman.h>
+#  include <sys/uio.h>
+#endif
+
+#if defined(__SSSE3__)
+#  include <tmmintrin.h>
+#elif defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
 
 #include "bstring.h"
 
@@ -13,6 +24,18 @@
 #  include <talloc.h>
 #  define free talloc_free
 #endif
+#ifndef O_BINARY
+#  define O_BINARY 0
+#endif
+#ifndef IOV_MAX
+#  define IOV_MAX 1024
+#endif
+#ifdef _WIN32
+struct iovec {
+        void  *iov_base;
+        size_t iov_len;
+};
+#endif
 
 /*============================================================================*/
 /*============================================================================*/
@@ -126,6 +149,153 @@ BSTRING_warn_(bool print_err, const char *fmt, ...)
 #endif
 
 
+/*============================================================================*/
+/* Scanning kernels */
+/*============================================================================*/
+
+
+void
+BSTRING_charset_init(struct b_charset *cs, const uchar *set, const unsigned len)
+{
+        memset(cs, 0, sizeof(*cs));
+
+        for (unsigned i = 0; i < len; ++i) {
+                const uchar ch = set[i];
+                if (B_CHARSET_TEST(cs, ch))
+                        continue;
+                cs->map[ch >> 5] |= (1U << (ch & 31U));
+                if (ch < 0x80U)
+                        cs->nib_lo[ch & 0x0FU] |= (uint8_t)(1U << (ch >> 4));
+                else
+                        cs->nib_hi[ch & 0x0FU] |= (uint8_t)(1U << ((ch >> 4) & 7U));
+                if (cs->n < 4)
+                        cs->ch[cs->n] = ch;
+                ++cs->n;
+        }
+
+        /* Pad the small set so the SSE2 path can always compare against 4. */
+        for (unsigned i = cs->n; i < 4 && cs->n > 0; ++i)
+                cs->ch[i] = cs->ch[0];
+}
+
+
+/*
+ * Return a pointer to the first byte in [ptr, end) that is a member of cs, or
+ * NULL if there is none.
+ */
+const uchar *
+BSTRING_charset_find(const struct b_charset *cs, const uchar *ptr, const uchar *const end)
+{
+        if (cs->n == 0 || ptr >= end)
+                return NULL;
+        if (cs->n == 1)
+                return memchr(ptr, cs->ch[0], (size_t)(end - ptr));
+
+#if defined(__SSSE3__)
+        {
+                const __m128i tlo   = _mm_loadu_si128((const __m128i *)cs->nib_lo);
+                const __m128i thi   = _mm_loadu_si128((const __m128i *)cs->nib_hi);
+                const __m128i bits  = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                                    1, 2, 4, 8, 16, 32, 64, -128);
+                const __m128i nib   = _mm_set1_epi8(0x0F);
+                const __m128i eight = _mm_set1_epi8(8);
+                const __m128i zero  = _mm_setzero_si128();
+
+                for (; end - ptr >= 16; ptr += 16) {
+                        const __m128i x   = _mm_loadu_si128((const __m128i *)ptr);
+                        const __m128i lo  = _mm_and_si128(x, nib);
+                        const __m128i hi  = _mm_and_si128(_mm_srli_epi16(x, 4), nib);
+                        const __m128i sel = _mm_cmplt_epi8(hi, eight);
+                        const __m128i row = _mm_or_si128(
+                            _mm_and_si128(sel, _mm_shuffle_epi8(tlo, lo)),
+                            _mm_andnot_si128(sel, _mm_shuffle_epi8(thi, lo)));
+                        const __m128i hit = _mm_and_si128(row, _mm_shuffle_epi8(bits, hi));
+                        const unsigned mask =
+                            (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(hit, zero)) ^ 0xFFFFU;
+                        if (mask)
+                                return ptr + __builtin_ctz(mask);
+                }
+        }
+#elif defined(__SSE2__)
+        if (cs->n <= 4) {
+                const __m128i c0 = _mm_set1_epi8((char)cs->ch[0]);
+                const __m128i c1 = _mm_set1_epi8((char)cs->ch[1]);
+                const __m128i c2 = _mm_set1_epi8((char)cs->ch[2]);
+                const __m128i c3 = _mm_set1_epi8((char)cs->ch[3]);
+
+                for (; end - ptr >= 16; ptr += 16) {
+                        const __m128i x = _mm_loadu_si128((const __m128i *)ptr);
+                        const __m128i r = _mm_or_si128(
+                            _mm_or_si128(_mm_cmpeq_epi8(x, c0), _mm_cmpeq_epi8(x, c1)),
+                            _mm_or_si128(_mm_cmpeq_epi8(x, c2), _mm_cmpeq_epi8(x, c3)));
+                        const unsigned mask = (unsigned)_mm_movemask_epi8(r);
+                        if (mask)
+                                return ptr + __builtin_ctz(mask);
+                }
+        }
+#endif
+
+        for (; ptr < end; ++ptr)
+                if (B_CHARSET_TEST(cs, *ptr))
+                        return ptr;
+
+        return NULL;
+}
+
+
+/*
+ * Binary safe memmem. The vectorized path filters candidate positions by
+ * comparing the first and last bytes of the needle 16 positions at a time and
+ * only then falls back to memcmp for the middle.
+ */
+const uchar *
+BSTRING_memmem(const uchar *const hay, const size_t hlen,
+               const uchar *const needle, const size_t nlen)
+{
+        if (nlen == 0)
+                return hay;
+        if (nlen > hlen)
+                return NULL;
+        if (nlen == 1)
+                return memchr(hay, needle[0], hlen);
+
+        const uchar *ptr  = hay;
+        const uchar *last = hay + (hlen - nlen);
+
+#ifdef __SSE2__
+        {
+                const __m128i first = _mm_set1_epi8((char)needle[0]);
+                const __m128i final = _mm_set1_epi8((char)needle[nlen - 1]);
+
+                for (; (size_t)(last - ptr) >= 16; ptr += 16) {
+                        const __m128i a = _mm_loadu_si128((const __m128i *)ptr);
+                        const __m128i b = _mm_loadu_si128((const __m128i *)(ptr + nlen - 1));
+                        unsigned mask   = (unsigned)_mm_movemask_epi8(
+                            _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, final)));
+
+                        while (mask) {
+                                const unsigned bit = (unsigned)__builtin_ctz(mask);
+                                if (memcmp(ptr + bit + 1, needle + 1, nlen - 2) == 0)
+                                        return ptr + bit;
+                                mask &= mask - 1;
+                        }
+                }
+        }
+#endif
+
+        while (ptr <= last) {
+                ptr = memchr(ptr, needle[0], (size_t)(last - ptr) + 1U);
+                if (!ptr)
+                        break;
+                if (memcmp(ptr + 1, needle + 1, nlen - 1) == 0)
+                        return ptr;
+                ++ptr;
+        }
+
+        return NULL;
+}
+
+
 static int
 do_b_memsep(bstring *dest, bstring *stringp, const char delim, const bool chomp_cr)
 {
@@ -196,17 +366,274 @@ b_split_lines(bstring *tosplit, const bool destroy)
 }
 
 
+/*============================================================================*/
+/* Parallel split */
+/*============================================================================*/
+
+unsigned
+BSTRING_ncpus(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+        const long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        return (ncpu > 0) ? (unsigned)ncpu : 1U;
+#else
+        return 1U;
+#endif
+}
+
+
+/* Don't bother handing a thread less than this much to scan. */
+#define SPLIT_MT_MIN_CHUNK (1U << 20)
+
+struct split_chunk {
+        const uchar *data;
+        unsigned     start;
+        unsigned     end;
+        uchar        delim;
+        unsigned     flags;
+        bstring    **out;
+        unsigned     qty;
+        unsigned     mlen;
+};
+
+
+static bstring *
+split_mt_piece(const uchar *data, const unsigned len, const unsigned flags)
+{
+        if (!(flags & B_SPLIT_REF))
+                return b_fromblk(data, len);
+
+#ifdef BSTR_USE_TALLOC
+        bstring *ret = talloc(NULL, bstring);
+        talloc_set_destructor(ret, b_free);
+#else
+        bstring *ret = malloc(sizeof *ret);
+#endif
+        /* Same flags as b_clone(): header freeable, data neither writable nor freeable. */
+        *ret = (bstring){
+            .data  = (uchar *)data,
+            .slen  = len,
+            .mlen  = 0,
+            .flags = BSTR_FREEABLE | BSTR_CLONE,
+        };
+        return ret;
+}
+
+
+static void
+split_mt_push(struct split_chunk *ck, const uchar *data, unsigned len)
+{
+        if ((ck->flags & B_SPLIT_CHOMP_CR) && len > 0 && data[len - 1] == '\r')
+                --len;
+
+        if (ck->qty >= ck->mlen) {
+                ck->mlen = (ck->mlen) ? ck->mlen * 2 : 256;
+#ifdef BSTR_USE_TALLOC
+                ck->out = talloc_realloc(NULL, ck->out, bstring *, ck->mlen);
+#else
+                ck->out = nrealloc(ck->out, ck->mlen, sizeof(bstring *));
+#endif
+        }
+        ck->out[ck->qty++] = split_mt_piece(data, len, ck->flags);
+}
+
+
+static void *
+split_mt_worker(void *vdata)
+{
+        struct split_chunk *ck  = vdata;
+        const uchar        *ptr = ck->data + ck->start;
+        const uchar *const  end = ck->data + ck->end;
+
+        while (ptr < end) {
+                const uchar *next = memchr(ptr, ck->delim, (size_t)(end - ptr));
+                if (!next) {
+                        /* Only the final chunk can end without a delimiter. */
+                        split_mt_push(ck, ptr, (unsigned)PTRSUB(end, ptr));
+                        break;
+                }
+                split_mt_push(ck, ptr, (unsigned)PTRSUB(next, ptr));
+                ptr = next + 1;
+        }
+
+        return NULL;
+}
+
+
+b_list *
+b_split_mt(const bstring *str, const int delim, const unsigned flags, unsigned nthreads)
+{
+        if (INVALID(str))
+                RETURN_NULL();
+
+        if (nthreads == 0)
+                nthreads = BSTRING_ncpus();
+        if (nthreads > str->slen / SPLIT_MT_MIN_CHUNK)
+                nthreads = MAX(str->slen / SPLIT_MT_MIN_CHUNK, 1U);
+
+        struct split_chunk *chunks = nalloca(nthreads, sizeof(struct split_chunk));
+        pthread_t          *tids   = nalloca(nthreads, sizeof(pthread_t));
+        bool               *live   = nalloca(nthreads, sizeof(bool));
+        unsigned            start  = 0;
+
+        /* Cut at even intervals, then push every cut just past the next
+         * delimiter so no piece straddles two chunks. */
+        for (unsigned i = 0; i < nthreads; ++i) {
+                unsigned end = (i == nthreads - 1)
+                                   ? str->slen
+                                   : (unsigned)(((uint64_t)str->slen * (i + 1)) / nthreads);
+                if (end < start) {
+                        end = start;
+                } else if (end < str->slen && i < nthreads - 1) {
+                        const uchar *next = memchr(str->data + end, delim, str->slen - end);
+                        end = next ? (unsigned)PTRSUB(next, str->data) + 1U : str->slen;
+                }
+
+                chunks[i] = (struct split_chunk){
+                    .data  = str->data,
+                    .start = start,
+                    .end   = end,
+                    .delim = (uchar)delim,
+                    .flags = flags,
+                    .out   = NULL,
+                    .qty   = 0,
+                    .mlen  = 0,
+                };
+                start = end;
+        }
+
+        for (unsigned i = 1; i < nthreads; ++i)
+                live[i] = pthread_create(&tids[i], NULL, &split_mt_worker, &chunks[i]) == 0;
+        split_mt_worker(&chunks[0]);
+
+        unsigned total = 0;
+        for (unsigned i = 0; i < nthreads; ++i) {
+                if (i > 0) {
+                        if (live[i])
+                                pthread_join(tids[i], NULL);
+                        else
+                                split_mt_worker(&chunks[i]);
+                }
+                total += chunks[i].qty;
+        }
+
+        /* Stitch the per thread results together in order. */
+        b_list *ret = b_list_create_alloc(total);
+
+        for (unsigned i = 0; i < nthreads; ++i) {
+                for (unsigned x = 0; x < chunks[i].qty; ++x) {
+                        ret->lst[ret->qty++] = chunks[i].out[x];
+#ifdef BSTR_USE_TALLOC
+                        talloc_steal(ret, chunks[i].out[x]);
+#endif
+                }
+                if (chunks[i].out)
+                        free(chunks[i].out);
+        }
+
+        return ret;
+}
+
+
 /*============================================================================*/
 /* SOME CRAPPY ADDITIONS! */
 /*============================================================================*/
 
 
+/*
+ * Write all of iov, resuming after short writes and retrying interrupted ones.
+ * The array is modified along the way. Returns the number of bytes written or
+ * BSTR_ERR with errno set.
+ */
+int64_t
+BSTRING_writev(const int fd, struct iovec *iov, int cnt)
+{
+        int64_t total = 0;
+
+        while (cnt > 0 && iov->iov_len == 0)
+                ++iov, --cnt;
+
+        while (cnt > 0) {
+#ifdef _WIN32
+                const int n = write(fd, iov->iov_base, (unsigned)iov->iov_len);
+#else
+                const ssize_t n = writev(fd, iov, cnt);
+#endif
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return BSTR_ERR;
+                }
+                total += n;
+
+                size_t done = (size_t)n;
+                while (cnt > 0 && done >= iov->iov_len) {
+                        done -= iov->iov_len;
+                        ++iov;
+                        --cnt;
+                }
+                if (cnt > 0) {
+                        iov->iov_base = (char *)iov->iov_base + done;
+                        iov->iov_len -= done;
+                }
+        }
+
+        return total;
+}
+
+
+/*
+ * Gather the arguments into batches of up to IOV_MAX buffers so that each
+ * batch is one writev call.
+ */
+static int64_t
+write_varargs(const int fd, bstring *bstr, va_list ap)
+{
+        struct iovec iov[IOV_MAX];
+        int          cnt   = 0;
+        int64_t      total = 0;
+
+        for (;; bstr = va_arg(ap, bstring *)) {
+                if (bstr && (bstr->flags & BSTR_LIST_END))
+                        break;
+                if (!bstr || !bstr->data || bstr->slen == 0)
+                        continue;
+
+                iov[cnt].iov_base = bstr->data;
+                iov[cnt].iov_len  = bstr->slen;
+                if (++cnt == IOV_MAX) {
+                        const int64_t n = BSTRING_writev(fd, iov, cnt);
+                        if (n < 0)
+                                return BSTR_ERR;
+                        total += n;
+                        cnt    = 0;
+                }
+        }
+
+        const int64_t n = BSTRING_writev(fd, iov, cnt);
+        return (n < 0) ? BSTR_ERR : total + n;
+}
+
+
+/*
+ * Streams backed by a descriptor are flushed and then written with writev, so
+ * the output still lands in order. Anything else (memory and cookie streams)
+ * goes through fwrite.
+ */
 void
 _b_fwrite(FILE *fp, bstring *bstr, ...)
 {
         va_list va;
         va_start(va, bstr);
-        for (;;bstr = va_arg(va, bstring *)) {
+
+        const int fd = fileno(fp);
+        if (fd >= 0 && fflush(fp) == 0) {
+                (void)write_varargs(fd, bstr, va);
+                va_end(va);
+                return;
+        }
+
+        for (;; bstr = va_arg(va, bstring *)) {
                 if (bstr) {
                         if (bstr->flags & BSTR_LIST_END)
                                 break;
@@ -223,27 +650,58 @@ _b_write(const int fd, bstring *bstr, ...)
 {
         va_list ap;
         va_start(ap, bstr);
-        for (;;bstr = va_arg(ap, bstring *)) {
-                if (bstr) {
-                        if (bstr->flags & BSTR_LIST_END)
-                                break;
-                        if (bstr->data && bstr->slen > 0) {
-                                ssize_t n, total = 0;
-                                int tmp;
-                                errno = 0;
-                                do {
-                                        n = write(fd, bstr->data, bstr->slen);
-                                } while (n > 0 && (unsigned)(total += n) < bstr->slen);
-                                if ((tmp = errno)) {
-                                        va_end(ap);
-                                        return tmp;
-                                }
-                        }
+        errno = 0;
+        const int64_t n = write_varargs(fd, bstr, ap);
+        va_end(ap);
+
+        return (n < 0) ? (errno ? errno : BSTR_ERR) : BSTR_OK;
+}
+
+
+/*
+ * Each element is followed by sep, so a list of lines written with "\n" comes
+ * out as a text file. NULL elements are skipped.
+ */
+int64_t
+b_list_write(const int fd, const b_list *list, const bstring *sep)
+{
+        if (fd < 0 || !list)
+                RUNTIME_ERROR();
+
+        const bool   use_sep = sep && sep->data && sep->slen > 0;
+        struct iovec iov[IOV_MAX];
+        int          cnt   = 0;
+        int64_t      total = 0;
+
+        for (unsigned i = 0; i < list->qty; ++i) {
+                const bstring *bstr = list->lst[i];
+                if (!bstr || !bstr->data)
+                        continue;
+
+                if (bstr->slen > 0) {
+                        iov[cnt].iov_base = bstr->data;
+                        iov[cnt].iov_len  = bstr->slen;
+                        ++cnt;
+                }
+                if (use_sep) {
+                        iov[cnt].iov_base = sep->data;
+                        iov[cnt].iov_len  = sep->slen;
+                        ++cnt;
+                }
+                if (cnt >= IOV_MAX - 1) {
+                        const int64_t n = BSTRING_writev(fd, iov, cnt);
+                        if (n < 0)
+                                RUNTIME_ERROR();
+                        total += n;
+                        cnt    = 0;
                 }
         }
-        va_end(ap);
 
-        return BSTR_OK;
+        const int64_t n = BSTRING_writev(fd, iov, cnt);
+        if (n < 0)
+                RUNTIME_ERROR();
+
+        return total + n;
 }
 
 
@@ -460,7 +918,7 @@ b_clone(const bstring *const src)
         bstring *ret = malloc(sizeof *ret);
 #endif
         memcpy(ret, src, sizeof(bstring));
-        ret->flags &= (~((uint8_t)BSTR_DATA_FREEABLE));
+        ret->flags &= (~((uint16_t)(BSTR_DATA_FREEABLE | BSTR_MAPPED)));
         ret->flags |= BSTR_CLONE;
         b_writeprotect(ret);
 
@@ -522,6 +980,30 @@ b_strsep(bstring *ostr, const char *const delim, const int refonly)
         bstring str[] = {{.data = ostr->data, .slen = ostr->slen,
                           .mlen = 0, .flags = ostr->flags}};
 
+        /* Honor every character of delim, not just the first. */
+        if (delim[0] && delim[1]) {
+                struct b_charset cs;
+                BSTRING_charset_init(&cs, (const uchar *)delim, strlen(delim));
+                uchar *ptr = str->data;
+                uchar *end = str->data + str->slen;
+
+                while (ptr < end) {
+                        uchar *next = (uchar *)BSTRING_charset_find(&cs, ptr, end);
+                        if (next)
+                                *next = '\0';
+                        else
+                                next = end;
+                        const unsigned len = (unsigned)PTRSUB(next, ptr);
+                        if (refonly)
+                                b_list_append(ret, b_refblk(ptr, len));
+                        else
+                                b_list_append(ret, b_fromblk(ptr, len));
+                        ptr = next + 1;
+                }
+
+                return ret;
+        }
+
         if (refonly)
                 while (b_memsep(tok, str, delim[0]))
                         b_list_append(ret, b_refblk(tok->data, tok->slen));
@@ -665,55 +1147,20 @@ b_quickread(const char *const __restrict fmt, ...)
         vsnprintf(buf, PATH_MAX + 1, fmt, ap);
         va_end(ap);
 
-        struct stat st;
-        FILE       *fp = fopen(buf, "rb");
-        if (!fp)
+        const int fd = open(buf, O_RDONLY | O_BINARY);
+        if (fd < 0)
                 RETURN_NULL();
-        fstat(fileno(fp), &st);
-        if (st.st_size == 0) {
-                fclose(fp);
-                return NULL;
-        }
+        bstring *ret = b_read_fd(fd);
+        close(fd);
 
-        bstring      *ret   = b_alloc_null(st.st_size + 1);
-        const ssize_t nread = fread(ret->data, 1, st.st_size, fp);
-        fclose(fp);
-        if (nread < 0) {
+        if (ret && ret->slen == 0) {
                 b_free(ret);
-                RETURN_NULL();
+                return NULL;
         }
-
-        ret->slen        = (unsigned)nread;
-        ret->data[nread] = '\0';
         return ret;
 }
 
 
-#define INIT_READ ((size_t)(8192LLU))
-
-bstring *
-b_read_stdin(void)
-{
-        bstring *buf = b_create(INIT_READ + 1LLU);
-
-        for (;;) {
-                size_t nread = fread(buf->data + buf->slen, 1, INIT_READ, stdin);
-                if (nread > 0) {
-                        buf->slen += nread;
-                        if (feof(stdin))
-                                break;
-                        /* buf = xrealloc(buf, total + INIT_READ); */
-                        b_alloc(buf, buf->slen + INIT_READ);
-                } else {
-                        break;
-                }
-        }
-
-        buf->data[buf->slen] = '\0';
-        return buf;
-}
-
-
 #if 0
 #define INIT_READ ((size_t)(1 << 20))
 
@@ -755,41 +1202,166 @@ b_read_fd(const int fd)
 }
 #endif
 
-#define INIT_READ ((size_t)(8192LLU))
+#define INIT_READ  ((size_t)(8192LLU))
+#define READ_PROBE (512U)
 #ifdef DOSISH
 #  define SSIZE_T size_t
 #else
 #  define SSIZE_T ssize_t
 #endif
 
-bstring *
-b_read_fd(const int fd)
+/*
+ * The number of bytes left to read if fd is a regular file, otherwise 0.
+ */
+static uint64_t
+read_size_hint(const int fd)
+{
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+                return 0;
+
+        const off_t pos = lseek(fd, 0, SEEK_CUR);
+        if (pos < 0 || pos >= st.st_size)
+                return (pos < 0) ? (uint64_t)st.st_size : 0;
+
+        return (uint64_t)(st.st_size - pos);
+}
+
+
+/*
+ * Make room for extra more bytes and the terminator. When growing blind the
+ * capacity at least doubles, so reading n bytes costs O(log n) reallocations
+ * rather than one per INIT_READ.
+ */
+static int
+read_reserve(bstring *dest, const uint64_t extra, const bool exact)
+{
+        uint64_t want = (uint64_t)dest->slen + extra + 1U;
+        if (!exact)
+                want = MAX(want, (uint64_t)dest->mlen * 2U);
+        if (want >= UINT32_MAX) {
+                errno = EFBIG;
+                RUNTIME_ERROR();
+        }
+        if (want <= dest->mlen)
+                return BSTR_OK;
+
+        return b_alloc(dest, (unsigned)want);
+}
+
+
+/*
+ * Read fd (or fp, if not NULL) until EOF, retrying interrupted calls. Each read
+ * asks for all of the spare room, so a correct size hint means one read and
+ * one probe. The probe goes to the stack, so when the buffer is exactly full
+ * the EOF check doesn't force a reallocation. Whatever was read is kept and
+ * terminated, even on error.
+ */
+static int
+read_to_eof(bstring *dest, const int fd, FILE *fp)
 {
-        bstring *ret = b_alloc_null(INIT_READ + 1U);
+        int ret = BSTR_OK;
 
         for (;;) {
-                SSIZE_T nread = read(fd, (ret->data + ret->slen), INIT_READ);
-                if (nread > 0) {
-                        ret->slen += nread;
-                        if ((size_t)nread < INIT_READ) {
-                                /* eprintf("breaking\n"); */
+                const unsigned room = dest->mlen - dest->slen - 1U;
+                uchar          probe[READ_PROBE];
+                uchar         *buf  = room ? dest->data + dest->slen : probe;
+                const size_t   want = room ? MIN(room, (unsigned)INT_MAX) : sizeof probe;
+                SSIZE_T        nread;
+
+                if (fp) {
+                        nread = (SSIZE_T)fread(buf, 1, want, fp);
+                        if (nread == 0 && ferror(fp))
+                                nread = -1;
+                } else {
+                        do
+                                nread = read(fd, buf, want);
+                        while (nread < 0 && errno == EINTR);
+                }
+
+                if (nread == 0)
+                        break;
+                if (nread < 0) {
+                        ret = BSTR_ERR;
+                        break;
+                }
+                if (buf == probe) {
+                        if (read_reserve(dest, INIT_READ, false) != BSTR_OK) {
+                                ret = BSTR_ERR;
                                 break;
                         }
-                        b_growby(ret, INIT_READ);
-                } else if (nread == 0) {
-                        break;
-                } else {
-                        err(1, "read()");  
+                        memcpy(dest->data + dest->slen, probe, (size_t)nread);
                 }
+                dest->slen += (unsigned)nread;
         }
 
-        ret->data[ret->slen] = '\0';
+        dest->data[dest->slen] = (uchar)'\0';
         return ret;
 }
 
 
+int
+b_reada_fd(bstring *dest, const int fd)
+{
+        if (INVALID(dest) || NO_WRITE(dest) || fd < 0)
+                RUNTIME_ERROR();
+
+        const uint64_t hint = read_size_hint(fd);
+        if (read_reserve(dest, hint ? hint : INIT_READ, hint != 0) != BSTR_OK)
+                RUNTIME_ERROR();
+
+        return read_to_eof(dest, fd, NULL);
+}
+
 
-#if 0
+bstring *
+b_read_fd(const int fd)
+{
+        if (fd < 0)
+                RETURN_NULL();
+
+        /* Size a fresh buffer exactly rather than letting b_alloc round it. */
+        const uint64_t hint = read_size_hint(fd);
+        if (hint >= UINT32_MAX - 1U) {
+                errno = EFBIG;
+                RETURN_NULL();
+        }
+
+        bstring *ret = b_create(hint ? (unsigned)hint : (unsigned)INIT_READ);
+        if (read_to_eof(ret, fd, NULL) != BSTR_OK) {
+                b_free(ret);
+                RETURN_NULL();
+        }
+
+        return ret;
+}
+
+
+/*
+ * Goes through stdio rather than the descriptor so that anything already
+ * buffered in stdin is not lost. Large freads bypass the stdio buffer anyway.
+ */
+bstring *
+b_read_stdin(void)
+{
+        const uint64_t hint = read_size_hint(fileno(stdin));
+        if (hint >= UINT32_MAX - 1U) {
+                errno = EFBIG;
+                RETURN_NULL();
+        }
+
+        bstring *ret = b_create(hint ? (unsigned)hint : (unsigned)INIT_READ);
+        if (read_to_eof(ret, -1, stdin) != BSTR_OK) {
+                b_free(ret);
+                RETURN_NULL();
+        }
+
+        return ret;
+}
+
+
+
+#if 0
 bstring *
 b_read_fd(const int fd)
 {
@@ -825,6 +1397,124 @@ b_read_fd(const int fd)
 #endif
 
 
+/*============================================================================*/
+/* Memory mapped files */
+/*============================================================================*/
+
+/*
+ * Read size bytes from offset 0 of a regular file into a fresh bstring,
+ * independent of the fd's file position.
+ */
+static bstring *
+mmap_copy(const int fd, const unsigned size)
+{
+        bstring *ret = b_create(size);
+
+        while (ret->slen < size) {
+#ifdef _WIN32
+                const int n = read(fd, ret->data + ret->slen, size - ret->slen);
+#else
+                const ssize_t n = pread(fd, ret->data + ret->slen, size - ret->slen, ret->slen);
+#endif
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n < 0) {
+                        b_free(ret);
+                        RETURN_NULL();
+                }
+                if (n == 0)
+                        break;
+                ret->slen += (unsigned)n;
+        }
+
+        ret->data[ret->slen] = (uchar)'\0';
+        return ret;
+}
+
+
+/*
+ * A mapping is write protected and owns only its header; b_free unmaps it. Bytes
+ * between the end of the file and the end of its last page read as zero, so the
+ * mapping is terminated for free unless the size is an exact multiple of the
+ * page size. That case, and anything that can't be mapped (pipes, empty or
+ * special files), is read into an ordinary bstring instead.
+ */
+bstring *
+b_mmap_fd(const int fd, const unsigned flags)
+{
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0)
+                RETURN_NULL();
+        if (!S_ISREG(st.st_mode) || st.st_size == 0)
+                return b_read_fd(fd);
+        if ((uint64_t)st.st_size >= UINT32_MAX) {
+                errno = EFBIG;
+                RETURN_NULL();
+        }
+
+        const unsigned size = (unsigned)st.st_size;
+
+#ifdef _WIN32
+        (void)flags;
+        return mmap_copy(fd, size);
+#else
+        const long pagesize = sysconf(_SC_PAGESIZE);
+        if ((flags & B_MMAP_NUL) && pagesize > 0 && size % (unsigned long)pagesize == 0)
+                return mmap_copy(fd, size);
+
+        int mflags = MAP_PRIVATE;
+#  ifdef MAP_POPULATE
+        if (flags & B_MMAP_POPULATE)
+                mflags |= MAP_POPULATE;
+#  endif
+        void *data = mmap(NULL, size, PROT_READ, mflags, fd, 0);
+        if (data == MAP_FAILED)
+                return mmap_copy(fd, size);
+
+#  ifdef POSIX_MADV_SEQUENTIAL
+        if (flags & B_MMAP_SEQUENTIAL)
+                (void)posix_madvise(data, size, POSIX_MADV_SEQUENTIAL);
+        if (flags & B_MMAP_WILLNEED)
+                (void)posix_madvise(data, size, POSIX_MADV_WILLNEED);
+#  endif
+
+#  ifdef BSTR_USE_TALLOC
+        bstring *ret = talloc(NULL, bstring);
+        talloc_set_destructor(ret, b_free);
+#  else
+        bstring *ret = malloc(sizeof *ret);
+#  endif
+        *ret = (bstring){
+            .data  = data,
+            .slen  = size,
+            .mlen  = 0,
+            .flags = BSTR_FREEABLE | BSTR_MAPPED,
+        };
+        return ret;
+#endif
+}
+
+
+bstring *
+b_mmap_file(const char *path, const unsigned flags)
+{
+        if (!path)
+                RETURN_NULL();
+
+        const int fd = open(path, O_RDONLY | O_BINARY);
+        if (fd < 0)
+                RETURN_NULL();
+
+        /* The mapping outlives the descriptor. */
+        bstring  *ret = b_mmap_fd(fd, flags);
+        const int e   = errno;
+        close(fd);
+        errno = e;
+
+        return ret;
+}
+
+
 /*============================================================================*/
 /* String Modiying  */
 /*============================================================================*/
@@ -853,91 +1543,22 @@ b_insert_char(bstring *str, const unsigned location, const int ch)
 /*============================================================================*/
 
 
-/* A 64 bit integer is at most 19 decimal digits long. That, plus one for the
- * null byte and plus one for a '+' or '-' sign gives a max size of 21. */
-#define INT64_MAX_CHARS 21
-
 bstring *
 b_ll2str(const long long value)
 {
-        /* Generate the (reversed) string representation. */
-        uchar *rev, *fwd;
-        uint64_t inv = (value < 0) ? (-value) : (value);
-        bstring *ret = b_alloc_null(INT64_MAX_CHARS + 1);
-        rev = fwd = ret->data;
-
-        do {
-                *rev++ = (uchar)('0' + (inv % 10));
-                inv    = (inv / 10);
-        } while (inv);
+        const uint64_t mag = (value < 0) ? -(uint64_t)value : (uint64_t)value;
+        const unsigned neg = (value < 0);
+        const unsigned n   = BSTRING_udigits(mag);
+        bstring       *ret = b_alloc_null(n + neg);
 
-        if (value < 0)
-                *rev++ = (uchar)'-';
-
-        /* Compute length and add null term. */
-        *rev--    = (uchar)'\0';
-        ret->slen = PTRSUB(rev, ret->data) + 1U;
-
-        /* Reverse the string. */
-        while (fwd < rev) {
-                const uchar swap = *fwd;
-                *fwd++           = *rev;
-                *rev--           = swap;
-        }
+        if (neg)
+                ret->data[0] = (uchar)'-';
+        BSTRING_utoa(ret->data + neg, mag, n);
+        ret->data[(ret->slen = n + neg)] = (uchar)'\0';
 
         return ret;
 }
 
-
-static unsigned
-_tmp_ll2bstr(bstring *bstr, const long long value)
-{
-        uchar *rev, *fwd;
-        unsigned long long inv = (value < 0) ? (-value) : (value);
-        rev = fwd = bstr->data;
-
-        do {
-                *rev++ = (uchar)('0' + (inv % 10LLU));
-                inv    = (inv / 10LLU);
-        } while (inv);
-        if (value < 0)
-                *rev++ = (uchar)'-';
-
-        *rev--     = (uchar)'\0';
-        bstr->slen = PTRSUB(rev, bstr->data) + 1U;
-        while (fwd < rev) {
-                const uchar swap = *fwd;
-                *fwd++           = *rev;
-                *rev--           = swap;
-        }
-
-        return bstr->slen;
-}
-
-
-static unsigned
-_tmp_ull2bstr(bstring *bstr, const unsigned long long value)
-{
-        uchar *rev, *fwd;
-        unsigned long long inv = value;
-        rev = fwd = bstr->data;
-
-        do {
-                *rev++ = (uchar)('0' + (inv % 10LLU));
-                inv    = (inv / 10LLU);
-        } while (inv);
-
-        *rev--     = (uchar)'\0';
-        bstr->slen = PTRSUB(rev, bstr->data) + 1U;
-        while (fwd < rev) {
-                const uchar swap = *fwd;
-                *fwd++           = *rev;
-                *rev--           = swap;
-        }
-
-        return bstr->slen;
-}
-
 /*============================================================================*/
 /* Simple string manipulation.. */
 /*============================================================================*/
@@ -971,7 +1592,7 @@ b_replace_ch(bstring *bstr, const int find, const int replacement)
 
         while ((ptr = memchr(dat, find, len))) {
                 *ptr = replacement;
-                len -= (unsigned)PTRSUB(dat, ptr);
+                len -= (unsigned)PTRSUB(ptr, dat) + 1U;
                 dat  = ptr + 1;
         }
 
@@ -1037,379 +1658,337 @@ b_strip_trailing_ws(bstring *bstr)
 
 
 /*============================================================================*/
-/* Simple printf analogues. */
+/* Find and replace */
 /*============================================================================*/
 
 
-bstring *
-_b_sprintf(const bstring *fmt, ...)
-{
-        va_list ap;
-        va_start(ap, fmt);
-        bstring *ret = _b_vsprintf(fmt, ap);
-        va_end(ap);
-        return ret;
-}
+struct repl_match {
+        unsigned pos;
+        unsigned idx;
+};
 
+struct repl_vec {
+        struct repl_match *m;
+        unsigned           qty;
+        unsigned           mlen;
+        struct repl_match  stack[64];
+};
 
-bstring *
-_b_vsprintf(const bstring *fmt, va_list args)
+
+static void
+repl_push(struct repl_vec *vec, const unsigned pos, const unsigned idx)
 {
-        static bstring nullstring = bt_init("(null)");
-        if (INVALID(fmt))
-                RETURN_NULL();
+        if (vec->qty == vec->mlen) {
+                vec->mlen *= 2;
+                if (vec->m == vec->stack) {
+#ifdef BSTR_USE_TALLOC
+                        vec->m = talloc_array(NULL, struct repl_match, vec->mlen);
+#else
+                        vec->m = nmalloc(vec->mlen, sizeof(struct repl_match));
+#endif
+                        if (vec->m)
+                                memcpy(vec->m, vec->stack, sizeof(vec->stack));
+                } else {
+#ifdef BSTR_USE_TALLOC
+                        vec->m = talloc_realloc(NULL, vec->m, struct repl_match, vec->mlen);
+#else
+                        vec->m = nrealloc(vec->m, vec->mlen, sizeof(struct repl_match));
+#endif
+                }
+                if (!vec->m)
+                        FATAL_ERROR("Out of memory");
+        }
+        vec->m[vec->qty++] = (struct repl_match){pos, idx};
+}
 
-        b_list  *c_strings = NULL;
-        unsigned c_str_ctr = 0;
-
-        va_list  cpy;
-        int64_t  pos[2048];
-        unsigned len  = fmt->slen;
-        int64_t  pcnt = 0;
-        int64_t  i    = 0;
-        memset(pos, 0, sizeof(pos));
-        va_copy(cpy, args);
-
-        for (; i < fmt->slen; ++pcnt) {
-                int     islong = 0;
-                pos[pcnt] = b_strchrp(fmt, '%', i) + 1LL;
-                if (pos[pcnt] == 0)
-                        break;
 
-                int ch = fmt->data[pos[pcnt]];
+static void
+repl_scan_one(struct repl_vec *vec, const bstring *src, const unsigned pos,
+              const bstring *find)
+{
+        const uchar *ptr = src->data + pos;
+        const uchar *end = src->data + src->slen;
 
-        len_restart:
-                switch (ch) {
-                case 's': {
-                        bstring *next = va_arg(cpy, bstring *);
-                        if (!next || !next->data)
-                                len = (len - 2U) + (sizeof("(null)") - 1U);
-                        else
-                                len = (len - 2U) + next->slen;
-                        i   = pos[pcnt] + 2LL;
+        while ((ptr = BSTRING_memmem(ptr, (size_t)(end - ptr), find->data, find->slen))) {
+                repl_push(vec, (unsigned)PTRSUB(ptr, src->data), 0);
+                ptr += find->slen;
+        }
+}
 
-                        break;
-                }
-                case 'n': {
-                        if (!c_strings)
-                                c_strings = b_list_create();
-                        const char *next = va_arg(cpy, const char *);
-                        bstring    *tmp;
-                        if (next)
-                                tmp = b_fromcstr(next);
-                        else
-                                tmp = b_fromlit("(null)");
-                        b_list_append(c_strings, tmp);
 
-                        len = (len - 2U) + tmp->slen;
-                        i   = pos[pcnt] + 2;
-                        break;
-                }
-                case 'd':
-                case 'u':
-                        switch (islong) {
-                        case 0:
-                                (void)va_arg(cpy, int);
-                                len = (len - 2U) + 11U;
-                                i   = pos[pcnt] + 2;
-                                break;
-                        case 1: (void)va_arg(cpy, long);
-#if INT_MAX == LONG_MAX
-                                len = (len - 3U) + 11U;
+/*
+ * Candidates are located with the charset scanner on the set of first bytes.
+ * The needles are bucketed by first byte and sorted longest first within each
+ * bucket, so every position takes the leftmost-longest match.
+ */
+static void
+repl_scan_multi(struct repl_vec *vec, const bstring *src, const unsigned pos,
+                const bstring *const *find, const unsigned n)
+{
+        unsigned         bucket[257] = {0};
+#ifdef BSTR_USE_TALLOC
+        unsigned        *order       = talloc_array(NULL, unsigned, n);
 #else
-                                len = (len - 3U) + 21U;
+        unsigned        *order       = nmalloc(n, sizeof(unsigned));
 #endif
-                                i   = pos[pcnt] + 3;
-                                break;
-                        case 2:
-                                (void)va_arg(cpy, long long);
-                                len = (len - 4U) + 21U;
-                                i   = pos[pcnt] + 4;
-                                break;
-                        case 3:
-                                (void)va_arg(cpy, size_t);
-                                len = (len - 3U) + 21U;
-                                i   = pos[pcnt] + 3;
-                                break;
-                        default:
-                                abort();
+        uchar            firsts[256];
+        unsigned         nfirsts = 0;
+        struct b_charset cs;
+
+        for (unsigned i = 0; i < n; ++i)
+                if (bucket[find[i]->data[0] + 1]++ == 0)
+                        firsts[nfirsts++] = find[i]->data[0];
+        for (unsigned i = 1; i < 257; ++i)
+                bucket[i] += bucket[i - 1];
+        {
+                unsigned fill[256];
+                memcpy(fill, bucket, sizeof(fill));
+                for (unsigned i = 0; i < n; ++i) {
+                        const unsigned b = find[i]->data[0];
+                        unsigned       x = fill[b]++;
+                        while (x > bucket[b] && find[order[x - 1]]->slen < find[i]->slen) {
+                                order[x] = order[x - 1];
+                                --x;
                         }
-
-                        break;
-                case 'l':
-                        ++islong;
-                        ch = fmt->data[pos[pcnt] + islong];
-                        goto len_restart;
-                case 'z':
-                        islong = 3;
-                        ch = fmt->data[pos[pcnt] + 1];
-                        goto len_restart;
-                case 'c':
-                        (void)va_arg(cpy, int);
-                        --len;
-                        i = pos[pcnt] + 2;
-                        break;
-                case '%':
-                        --len;
-                        i = pos[pcnt] + 2;
-                        break;
-                default:
-                        errx(1, "Value '%c' is not legal.", ch);
+                        order[x] = i;
                 }
         }
+        BSTRING_charset_init(&cs, firsts, nfirsts);
 
-        va_end(cpy);
-        bstring *ret = b_alloc_null(snapUpSize(len + 1U));
-        int64_t  x;
-        pcnt = i = x = 0;
+        const uchar *ptr = src->data + pos;
+        const uchar *end = src->data + src->slen;
 
-        for (; ; ++pcnt) {
-                const int64_t diff = (pos[pcnt] == 0) ? (int64_t)fmt->slen - x
-                                                      : pos[pcnt] - x - 1LL;
-                if (diff >= 0)
-                        memcpy(ret->data + i, fmt->data + x, diff);
-                
-                int islong = 0;
-                int ch     = fmt->data[pos[pcnt]];
-                i += diff;
-                x += diff;
+        while (ptr < end && (ptr = BSTRING_charset_find(&cs, ptr, end))) {
+                const unsigned b   = *ptr;
+                bool           hit = false;
 
-                if (pos[pcnt] == 0)
-                        break;
-
-        str_restart:
-                switch (ch) {
-                case 's':
-                case 'n': {
-                        bstring *next;
-
-                        if (ch == 's') {
-                                next = va_arg(args, bstring *);
-                                if (!next || !next->data)
-                                        next = &nullstring;
-                        } else {
-                                if (!c_strings)
-                                        abort();
-                                (void)va_arg(args, const char *);
-                                next = c_strings->lst[c_str_ctr++];
-                        }
-
-                        memcpy(ret->data + i, next->data, next->slen);
-                        i += next->slen;
-                        x = pos[pcnt] + 1;
-                        break;
-                }
-                case 'd': {
-                        uchar buf[INT64_MAX_CHARS + 1];
-                        int n = 0;
-                        bstring tmp = {.data = buf, .slen = 0, .mlen = 0, .flags = 0};
-
-                        switch (islong) {
-                        case 0: {
-                                const int next = va_arg(args, int);
-                                n = _tmp_ll2bstr(&tmp, (long long)next);
-                                x = pos[pcnt] + 1;
-                                break;
-                        }
-                        case 1: {
-                                const long next = va_arg(args, long);
-                                n = _tmp_ll2bstr(&tmp, (long long)next);
-                                x = pos[pcnt] + 2;
-                                break;
-                        }
-                        case 2: {
-                                const long long next = va_arg(args, long long);
-                                n = _tmp_ll2bstr(&tmp, next);
-                                x = pos[pcnt] + 3;
+                for (unsigned i = bucket[b]; i < bucket[b + 1]; ++i) {
+                        const bstring *f = find[order[i]];
+                        if (f->slen <= (size_t)(end - ptr) && memcmp(ptr, f->data, f->slen) == 0) {
+                                repl_push(vec, (unsigned)PTRSUB(ptr, src->data), order[i]);
+                                ptr += f->slen;
+                                hit  = true;
                                 break;
                         }
-                        case 3: {
-                                const ssize_t next = va_arg(args, ssize_t);
-                                n = _tmp_ll2bstr(&tmp, next);
-                                x = pos[pcnt] + 2;
-                                break;
-                        }
-                        default:
-                                abort();
-                        }
-
-                        memcpy(ret->data + i, buf, n);
-                        i += n;
-                        break;
-                }
-                case 'u': {
-                        uchar buf[INT64_MAX_CHARS + 1];
-                        int n = 0;
-                        bstring tmp[] = {{.data = buf, .slen = 0, .mlen = 0, .flags = 0}};
-
-                        switch (islong) {
-                        case 0: {
-                                const unsigned next = va_arg(args, unsigned);
-                                n = _tmp_ull2bstr(tmp, (long long unsigned)next);
-                                x = pos[pcnt] + 1;
-                                break;
-                        }
-                        case 1: {
-                                const long unsigned next = va_arg(args, long unsigned);
-                                n = _tmp_ull2bstr(tmp, (long long unsigned)next);
-                                x = pos[pcnt] + 2;
-                                break;
-                        }
-                        case 2: {
-                                const long long unsigned next = va_arg(args, long long unsigned);
-                                n = _tmp_ull2bstr(tmp, next);
-                                x = pos[pcnt] + 3;
-                                break;
-                        }
-                        case 3: {
-                                const size_t next = va_arg(args, size_t);
-                                n = _tmp_ull2bstr(tmp, next);
-                                x = pos[pcnt] + 2;
-                                break;
-                        }
-                        default:
-                                abort();
-                        }
-
-                        memcpy(ret->data + i, buf, n);
-                        i += n;
-                        break;
-                }
-                case 'c': {
-                        const int next = va_arg(args, int);
-                        ret->data[i++] = (uchar)next;
-                        x += 2;
-                        break;
-                }
-                case 'l':
-                        ++islong;
-                        ch = fmt->data[pos[pcnt] + islong];
-                        goto str_restart;
-                case 'z':
-                        islong = 3;
-                        ch = fmt->data[pos[pcnt] + 1];
-                        goto str_restart;
-                case '%':
-                        ret->data[i++] = '%';
-                        x += 2;
-                        break;
-                default:
-                        errx(1, "Value '%c' is not legal.", ch);
                 }
+                if (!hit)
+                        ++ptr;
         }
 
-        if (c_strings)
-                b_list_destroy(c_strings);
-
-        ret->data[(ret->slen = i)] = '\0';
-        return ret;
+        free(order);
 }
 
 
-int
-_b_fprintf(FILE *out_fp, const bstring *fmt, ...)
+static void
+repl_emit_forward(uchar *out, const uchar *in, const unsigned inlen,
+                  const struct repl_vec *vec, const bstring *const *find,
+                  const bstring *const *repl)
 {
-        va_list ap;
-        va_start(ap, fmt);
-        const int ret = _b_vfprintf(out_fp, fmt, ap);
-        va_end(ap);
+        unsigned rd = 0;
+        unsigned wr = 0;
 
-        return ret;
+        for (unsigned i = 0; i < vec->qty; ++i) {
+                const struct repl_match *m = &vec->m[i];
+                const bstring           *r = repl[m->idx];
+
+                memmove(out + wr, in + rd, m->pos - rd);
+                wr += m->pos - rd;
+                memcpy(out + wr, r->data, r->slen);
+                wr += r->slen;
+                rd  = m->pos + find[m->idx]->slen;
+        }
+        memmove(out + wr, in + rd, inlen - rd);
 }
 
 
-int
-_b_vfprintf(FILE *out_fp, const bstring *fmt, va_list args)
+/* Work back from the end of a buffer already grown to the final size. */
+static void
+repl_emit_backward(uchar *data, const unsigned inlen, const unsigned outlen,
+                   const struct repl_vec *vec, const bstring *const *find,
+                   const bstring *const *repl)
 {
-        if (INVALID(fmt) || !out_fp)
-                RUNTIME_ERROR();
+        unsigned rd = inlen;
+        unsigned wr = outlen;
 
-        bstring *toprint = _b_vsprintf(fmt, args);
-        if (!toprint)
-                RUNTIME_ERROR();
+        for (unsigned i = vec->qty; i-- > 0; ) {
+                const struct repl_match *m    = &vec->m[i];
+                const bstring           *r    = repl[m->idx];
+                const unsigned           stop = m->pos + find[m->idx]->slen;
 
-        const int ret = fwrite(toprint->data, 1, toprint->slen, out_fp);
-        b_free(toprint);
-        return ret;
+                wr -= rd - stop;
+                memmove(data + wr, data + stop, rd - stop);
+                wr -= r->slen;
+                memcpy(data + wr, r->data, r->slen);
+                rd  = m->pos;
+        }
 }
 
 
-int
-_b_dprintf(const int out_fd, const bstring *fmt, ...)
+#define ALIASES(BSTR, OTHER)                                 \
+        ((OTHER)->data >= (BSTR)->data &&                    \
+         (OTHER)->data < (BSTR)->data + MAX((BSTR)->mlen, (BSTR)->slen + 1U))
+
+/*
+ * Shared engine. Matches are found in one pass, which also yields the exact
+ * size of the output. If no replacement is longer than its needle the result
+ * is written forward in place; if none is shorter the buffer is grown once
+ * and filled from the back. Only a mix of both needs a second buffer. When
+ * dest is non-NULL the source is left alone and the result is built there.
+ */
+static int
+replace_engine(bstring *bstr, bstring **dest, const unsigned pos,
+               const bstring *const *find, const bstring *const *repl, const unsigned n)
 {
-        va_list ap;
-        va_start(ap, fmt);
-        const int ret = _b_vdprintf(out_fd, fmt, ap);
-        va_end(ap);
+        struct repl_vec vec = {.qty = 0, .mlen = 64};
+        vec.m = vec.stack;
 
-        return ret;
-}
+        bool     shrink = true;
+        bool     grow   = true;
+        unsigned ret;
 
+        for (unsigned i = 0; i < n; ++i) {
+                shrink &= repl[i]->slen <= find[i]->slen;
+                grow   &= repl[i]->slen >= find[i]->slen;
+        }
 
-int
-_b_vdprintf(const int out_fd, const bstring *fmt, va_list args)
-{
-        if (INVALID(fmt) || out_fd < 0)
-                RUNTIME_ERROR();
+        if (n == 1)
+                repl_scan_one(&vec, bstr, pos, find[0]);
+        else
+                repl_scan_multi(&vec, bstr, pos, find, n);
+
+        int64_t outlen = bstr->slen;
+        for (unsigned i = 0; i < vec.qty; ++i)
+                outlen += (int64_t)repl[vec.m[i].idx]->slen - (int64_t)find[vec.m[i].idx]->slen;
+        if (outlen >= UINT32_MAX || vec.qty > INT_MAX)
+                goto error;
+
+        if (dest) {
+                *dest = b_create((unsigned)outlen);
+                repl_emit_forward((*dest)->data, bstr->data, bstr->slen, &vec, find, repl);
+                bstr = *dest;
+        } else if (vec.qty == 0) {
+                /* Nothing to do. */
+        } else if (shrink) {
+                repl_emit_forward(bstr->data, bstr->data, bstr->slen, &vec, find, repl);
+        } else if (grow) {
+                if (b_alloc(bstr, (unsigned)outlen + 1U) != BSTR_OK)
+                        goto error;
+                repl_emit_backward(bstr->data, bstr->slen, (unsigned)outlen, &vec, find, repl);
+        } else {
+#ifdef BSTR_USE_TALLOC
+                uchar *buf = talloc_size(bstr, (size_t)outlen + 1U);
+#else
+                uchar *buf = malloc((size_t)outlen + 1U);
+#endif
+                repl_emit_forward(buf, bstr->data, bstr->slen, &vec, find, repl);
+                free(bstr->data);
+                bstr->data = buf;
+                bstr->mlen = (unsigned)outlen + 1U;
+        }
 
-        bstring *toprint = _b_vsprintf(fmt, args);
-        if (!toprint)
-                RUNTIME_ERROR();
+        bstr->slen = (unsigned)outlen;
+        bstr->data[bstr->slen] = (uchar)'\0';
+        ret = vec.qty;
+        if (vec.m != vec.stack)
+                free(vec.m);
+        return (int)ret;
 
-        const int ret = write(out_fd, toprint->data, toprint->slen);
-        b_free(toprint);
-        return ret;
+error:
+        if (vec.m != vec.stack)
+                free(vec.m);
+        RUNTIME_ERROR();
 }
 
 
 int
-_b_sprintfa(bstring *dest, const bstring *fmt, ...)
+b_findreplace(bstring *bstr, const bstring *find, const bstring *repl, const unsigned pos)
 {
-        if (INVALID(dest) || NO_WRITE(dest) || INVALID(fmt))
+        if (INVALID(bstr) || INVALID(find) || INVALID(repl) || NO_WRITE(bstr) ||
+            find->slen == 0 || pos > bstr->slen)
                 RUNTIME_ERROR();
-        va_list ap;
-        va_start(ap, fmt);
-        const int ret = _b_vsprintfa(dest, fmt, ap);
-        va_end(ap);
 
+        /* Growing in place needs a buffer we may reallocate. */
+        if (repl->slen > find->slen && NO_ALLOC(bstr))
+                RUNTIME_ERROR();
+
+        bstring       *fcpy = ALIASES(bstr, find) ? b_strcpy(find) : NULL;
+        bstring       *rcpy = ALIASES(bstr, repl) ? b_strcpy(repl) : NULL;
+        const bstring *f    = fcpy ? fcpy : find;
+        const bstring *r    = rcpy ? rcpy : repl;
+
+        const int ret = replace_engine(bstr, NULL, pos, &f, &r, 1);
+
+        if (fcpy)
+                b_free(fcpy);
+        if (rcpy)
+                b_free(rcpy);
         return ret;
 }
 
 
 int
-_b_vsprintfa(bstring *dest, const bstring *fmt, va_list args)
+b_findreplace_multi(bstring *bstr, const b_list *find, const b_list *repl, const unsigned pos)
 {
-        if (INVALID(dest) || NO_WRITE(dest) || INVALID(fmt))
-                RUNTIME_ERROR();
-
-        bstring *app = _b_vsprintf(fmt, args);
-        if (INVALID(app))
+        if (INVALID(bstr) || NO_WRITE(bstr) || !find || !repl || find->qty == 0 ||
+            find->qty != repl->qty || pos > bstr->slen)
                 RUNTIME_ERROR();
 
-        const unsigned newlen = snapUpSize(dest->slen + app->slen + 1U);
-
-        if (dest->mlen >= newlen) {
-                memcpy(dest->data + dest->slen, app->data, app->slen);
-        } else {
+        const unsigned n   = find->qty;
+        b_list        *tmp = b_list_create();
+        int            ret = BSTR_ERR;
 #ifdef BSTR_USE_TALLOC
-                uchar *buf = talloc_size(dest, newlen);
+        const bstring **f = talloc_array(tmp, const bstring *, n);
+        const bstring **r = talloc_array(tmp, const bstring *, n);
 #else
-                uchar *buf = malloc(newlen);
+        const bstring **f = nmalloc(n, sizeof(bstring *));
+        const bstring **r = nmalloc(n, sizeof(bstring *));
 #endif
-                memcpy(buf, dest->data, dest->slen);
-                memcpy(buf + dest->slen, app->data, app->slen);
-                free(dest->data);
-                dest->data = buf;
+        bool grow = false;
+
+        for (unsigned i = 0; i < n; ++i) {
+                f[i] = find->lst[i];
+                r[i] = repl->lst[i];
+                if (INVALID(f[i]) || INVALID(r[i]) || f[i]->slen == 0)
+                        goto out;
+                grow |= r[i]->slen > f[i]->slen;
+        }
+        if (grow && NO_ALLOC(bstr))
+                goto out;
+
+        for (unsigned i = 0; i < n; ++i) {
+                if (ALIASES(bstr, f[i]))
+                        b_list_append(tmp, (bstring *)(f[i] = b_strcpy(f[i])));
+                if (ALIASES(bstr, r[i]))
+                        b_list_append(tmp, (bstring *)(r[i] = b_strcpy(r[i])));
         }
 
-        dest->slen += app->slen;
-        dest->data[dest->slen] = '\0';
-        dest->mlen = newlen;
-        b_free(app);
+        ret = replace_engine(bstr, NULL, pos, f, r, n);
+out:
+#ifndef BSTR_USE_TALLOC
+        free(f);
+        free(r);
+#endif
+        b_list_destroy(tmp);
+        return ret;
+}
+
 
-        return BSTR_OK;
+bstring *
+b_replace_all(const bstring *src, const bstring *find, const bstring *repl)
+{
+        if (INVALID(src) || INVALID(find) || INVALID(repl) || find->slen == 0)
+                RETURN_NULL();
+
+        bstring *ret = NULL;
+        if (replace_engine((bstring *)src, &ret, 0, &find, &repl, 1) == BSTR_ERR)
+                RETURN_NULL();
+
+        return ret;
 }
 
+#undef ALIASES
+
+
 /*============================================================================*/
 /* General b_list operations */
 /*============================================================================*/
@@ -1532,94 +2111,434 @@ b_list_allocmin(b_list *sl, uint msz)
 }
 
 
-bstring *
-b_join(const b_list *bl, const bstring *sep)
+/*============================================================================*/
+/* Split functions */
+/*============================================================================*/
+
+
+int
+b_splitcb(const bstring *str, const uchar splitChar, const unsigned pos,
+          const b_cbfunc cb, void *parm)
 {
-        if (!bl || INVALID(sep))
+        if (INVALID(str) || !cb || pos > str->slen)
+                RUNTIME_ERROR();
+
+        const uchar *const base = str->data;
+        const uchar *const end  = base + str->slen;
+        const uchar       *ptr  = base + pos;
+
+        for (;;) {
+                const uchar *next = memchr(ptr, splitChar, (size_t)(end - ptr));
+                if (!next)
+                        next = end;
+
+                const int ret = cb(parm, (unsigned)PTRSUB(ptr, base),
+                                   (unsigned)PTRSUB(next, ptr));
+                if (ret < 0)
+                        return ret;
+                if (next == end)
+                        break;
+                ptr = next + 1;
+        }
+
+        return BSTR_OK;
+}
+
+
+int
+b_splitscb(const bstring *str, const bstring *splitStr, const unsigned pos,
+           const b_cbfunc cb, void *parm)
+{
+        if (INVALID(str) || INVALID(splitStr) || !cb || pos > str->slen)
+                RUNTIME_ERROR();
+        if (splitStr->slen == 0) {
+                const int ret = cb(parm, pos, str->slen - pos);
+                return (ret < 0) ? ret : BSTR_OK;
+        }
+        if (splitStr->slen == 1)
+                return b_splitcb(str, splitStr->data[0], pos, cb, parm);
+
+        struct b_charset cs;
+        BSTRING_charset_init(&cs, splitStr->data, splitStr->slen);
+
+        const uchar *const base = str->data;
+        const uchar *const end  = base + str->slen;
+        const uchar       *ptr  = base + pos;
+
+        for (;;) {
+                const uchar *next = BSTRING_charset_find(&cs, ptr, end);
+                if (!next)
+                        next = end;
+
+                const int ret = cb(parm, (unsigned)PTRSUB(ptr, base),
+                                   (unsigned)PTRSUB(next, ptr));
+                if (ret < 0)
+                        return ret;
+                if (next == end)
+                        break;
+                ptr = next + 1;
+        }
+
+        return BSTR_OK;
+}
+
+
+int
+b_splitstrcb(const bstring *str, const bstring *splitStr, const unsigned pos,
+             const b_cbfunc cb, void *parm)
+{
+        if (INVALID(str) || INVALID(splitStr) || !cb || pos > str->slen)
+                RUNTIME_ERROR();
+        if (splitStr->slen == 0) {
+                const int ret = cb(parm, pos, str->slen - pos);
+                return (ret < 0) ? ret : BSTR_OK;
+        }
+        if (splitStr->slen == 1)
+                return b_splitcb(str, splitStr->data[0], pos, cb, parm);
+
+        const uchar *const base = str->data;
+        const uchar *const end  = base + str->slen;
+        const uchar       *ptr  = base + pos;
+
+        for (;;) {
+                const uchar *next = BSTRING_memmem(ptr, (size_t)(end - ptr),
+                                                   splitStr->data, splitStr->slen);
+                if (!next)
+                        next = end;
+
+                const int ret = cb(parm, (unsigned)PTRSUB(ptr, base),
+                                   (unsigned)PTRSUB(next, ptr));
+                if (ret < 0)
+                        return ret;
+                if (next == end)
+                        break;
+                ptr = next + splitStr->slen;
+        }
+
+        return BSTR_OK;
+}
+
+
+static int
+b_scb(void *parm, const unsigned ofs, const unsigned len)
+{
+        struct gen_b_list *g = parm;
+        return b_list_append(g->bl, b_fromblk(g->bstr->data + ofs, len));
+}
+
+
+b_list *
+b_split(const bstring *str, const uchar splitChar)
+{
+        if (INVALID(str))
                 RETURN_NULL();
-        int64_t total = 1;
 
-        for (uint i = 0; i < bl->qty; ++i) {
-                const uint v = bl->lst[i]->slen;
-                total += v;
-                if (total > UINT32_MAX)
-                        RETURN_NULL();
+        struct gen_b_list g = {.bstr = (bstring *)str, .bl = b_list_create()};
+
+        if (b_splitcb(str, splitChar, 0, &b_scb, &g) < 0) {
+                b_list_destroy(g.bl);
+                RETURN_NULL();
         }
 
-        if (sep)
-                total += (bl->qty - 1) * sep->slen;
+        return g.bl;
+}
 
-#ifdef BSTR_USE_TALLOC
-        bstring *bstr = talloc(NULL, bstring);
-        bstr->data    = talloc_size(bstr, total);
-        talloc_set_destructor(bstr, b_free);
-#else
-        bstring *bstr = malloc(sizeof(bstring));
-        bstr->data    = malloc(total);
-#endif
-        bstr->slen    = total - 1;
-        bstr->mlen    = total;
-        bstr->flags   = BSTR_STANDARD;
-        total         = 0;
-
-        for (uint i = 0; i < bl->qty; ++i) {
-                if (i > 0 && sep) {
-                        memcpy(bstr->data + total, sep->data, sep->slen);
-                        total += sep->slen;
-                }
-                const uint v = bl->lst[i]->slen;
-                memcpy(bstr->data + total, bl->lst[i]->data, v);
-                total += v;
+
+b_list *
+b_splits(const bstring *str, const bstring *splitStr)
+{
+        if (INVALID(str) || INVALID(splitStr))
+                RETURN_NULL();
+
+        struct gen_b_list g = {.bstr = (bstring *)str, .bl = b_list_create()};
+
+        if (b_splitscb(str, splitStr, 0, &b_scb, &g) < 0) {
+                b_list_destroy(g.bl);
+                RETURN_NULL();
         }
-        bstr->data[total] = (uchar)'\0';
 
-        return bstr;
+        return g.bl;
 }
 
 
-bstring *
-b_join_quote(const b_list *bl, const bstring *sep, const int ch)
+b_list *
+b_splitstr(const bstring *str, const bstring *splitStr)
 {
-        if (!bl || INVALID(sep) || !ch)
+        if (INVALID(str) || INVALID(splitStr))
                 RETURN_NULL();
-        const uint sepsize = (sep) ? sep->slen : 0;
-        int64_t    total   = 1;
 
-        B_LIST_FOREACH(bl, bstr, i)
-                total += bstr->slen + sepsize + 2u;
-        if (total > UINT32_MAX)
+        struct gen_b_list g = {.bstr = (bstring *)str, .bl = b_list_create()};
+
+        if (b_splitstrcb(str, splitStr, 0, &b_scb, &g) < 0) {
+                b_list_destroy(g.bl);
                 RETURN_NULL();
+        }
 
-#ifdef BSTR_USE_TALLOC
-        bstring *bstr = talloc(NULL, bstring);
-        bstr->data    = talloc_size(bstr, total);
-        talloc_set_destructor(bstr, b_free);
-#else
-        bstring *bstr = malloc(sizeof(bstring));
-        bstr->data    = malloc(total);
-#endif
-        bstr->slen    = 0;
-        bstr->mlen    = total - (2 * sepsize);
-        bstr->flags   = BSTR_STANDARD;
-
-        B_LIST_FOREACH(bl, cur, i) {
-                if (sep && i > 0) {
-                        memcpy(bstr->data + bstr->slen, sep->data, sep->slen);
-                        bstr->slen += sep->slen;
+        return g.bl;
+}
+
+
+/*============================================================================*/
+/* Join functions */
+/*============================================================================*/
+
+/* Lists whose output is at least this large are copied by several threads. */
+#define JOIN_MT_MIN_SIZE (UINT32_C(1) << 25)
+
+struct join_parts {
+        const b_list *bl;
+        const uchar  *sep, *prefix, *suffix;
+        unsigned      seplen, prelen, suflen;
+        uchar         quote;
+        bool          trailing;
+        unsigned      fixed;
+};
+
+struct join_job {
+        const struct join_parts *jp;
+        unsigned                 first;
+        unsigned                 last;
+        uchar                   *out;
+};
+
+
+/*
+ * Most list elements are short, where a call to memcpy costs more than the
+ * copy itself. Up to 16 bytes are moved with (at most) two overlapping
+ * unaligned word stores instead.
+ */
+static inline void
+join_copy(uchar *dst, const uchar *src, const unsigned len)
+{
+        if (len > 16) {
+                memcpy(dst, src, len);
+        } else if (len >= 8) {
+                uint64_t a, b;
+                memcpy(&a, src, 8);
+                memcpy(&b, src + len - 8, 8);
+                memcpy(dst, &a, 8);
+                memcpy(dst + len - 8, &b, 8);
+        } else if (len >= 4) {
+                uint32_t a, b;
+                memcpy(&a, src, 4);
+                memcpy(&b, src + len - 4, 4);
+                memcpy(dst, &a, 4);
+                memcpy(dst + len - 4, &b, 4);
+        } else if (len > 0) {
+                dst[0]         = src[0];
+                dst[len / 2]   = src[len / 2];
+                dst[len - 1]   = src[len - 1];
+        }
+}
+
+
+static inline unsigned
+join_elem_len(const bstring *el)
+{
+        return INVALID(el) ? 0 : el->slen;
+}
+
+
+static int
+join_prepare(struct join_parts *jp, const b_list *bl, const struct b_join_opts *opts,
+             uint64_t *size)
+{
+        static const struct b_join_opts defaults = {NULL, NULL, NULL, 0, 0};
+        if (!opts)
+                opts = &defaults;
+        if ((opts->sep && INVALID(opts->sep)) || (opts->prefix && INVALID(opts->prefix)) ||
+            (opts->suffix && INVALID(opts->suffix)))
+                RUNTIME_ERROR();
+
+        *jp = (struct join_parts){
+            .bl       = bl,
+            .sep      = opts->sep    ? opts->sep->data    : NULL,
+            .prefix   = opts->prefix ? opts->prefix->data : NULL,
+            .suffix   = opts->suffix ? opts->suffix->data : NULL,
+            .seplen   = opts->sep    ? opts->sep->slen    : 0,
+            .prelen   = opts->prefix ? opts->prefix->slen : 0,
+            .suflen   = opts->suffix ? opts->suffix->slen : 0,
+            .quote    = (uchar)opts->quote,
+            .trailing = (opts->flags & B_JOIN_TRAILING_SEP) != 0,
+        };
+        jp->fixed = jp->prelen + jp->suflen + jp->seplen + (opts->quote ? 2U : 0U);
+
+        uint64_t total = (uint64_t)bl->qty * jp->fixed;
+        for (unsigned i = 0; i < bl->qty; ++i)
+                total += join_elem_len(bl->lst[i]);
+        if (bl->qty > 0 && !jp->trailing)
+                total -= jp->seplen;
+
+        *size = total;
+        return BSTR_OK;
+}
+
+
+static uchar *
+join_range(const struct join_parts *jp, const unsigned first, const unsigned last, uchar *out)
+{
+        const unsigned qty = jp->bl->qty;
+
+        for (unsigned i = first; i < last; ++i) {
+                const bstring *el = jp->bl->lst[i];
+                const unsigned len = join_elem_len(el);
+
+                join_copy(out, jp->prefix, jp->prelen);
+                out += jp->prelen;
+                if (jp->quote)
+                        *out++ = jp->quote;
+                if (len)
+                        join_copy(out, el->data, len);
+                out += len;
+                if (jp->quote)
+                        *out++ = jp->quote;
+                join_copy(out, jp->suffix, jp->suflen);
+                out += jp->suflen;
+                if (i + 1 < qty || jp->trailing) {
+                        join_copy(out, jp->sep, jp->seplen);
+                        out += jp->seplen;
                 }
+        }
+
+        return out;
+}
 
-                bstr->data[bstr->slen++] = (uchar)ch;
-                memcpy((bstr->data + bstr->slen), cur->data, cur->slen);
-                bstr->slen += cur->slen;
-                bstr->data[bstr->slen++] = (uchar)ch;
+
+static void *
+join_worker(void *vdata)
+{
+        struct join_job *job = vdata;
+        join_range(job->jp, job->first, job->last, job->out);
+        return NULL;
+}
+
+
+/*
+ * Cut the list into ranges of roughly equal output size and copy each on its
+ * own thread. Every range knows its output offset in advance, so nothing needs
+ * to be stitched back together afterwards.
+ */
+static void
+join_parallel(const struct join_parts *jp, uchar *out, const uint64_t size)
+{
+        const b_list *bl       = jp->bl;
+        unsigned      nthreads = BSTRING_ncpus();
+
+        if (nthreads > size / (JOIN_MT_MIN_SIZE / 4U))
+                nthreads = (unsigned)(size / (JOIN_MT_MIN_SIZE / 4U));
+        if (nthreads > bl->qty)
+                nthreads = bl->qty;
+        if (nthreads < 2) {
+                join_range(jp, 0, bl->qty, out);
+                return;
         }
 
-        bstr->data[bstr->slen] = (uchar)'\0';
+        struct join_job *jobs = nalloca(nthreads, sizeof(struct join_job));
+        pthread_t       *tids = nalloca(nthreads, sizeof(pthread_t));
+        bool            *live = nalloca(nthreads, sizeof(bool));
+        uint64_t         ofs  = 0;
+        unsigned         n    = 0;
+        unsigned         i    = 0;
+
+        for (unsigned t = 0; t < nthreads; ++t) {
+                const uint64_t target = (t == nthreads - 1) ? UINT64_MAX
+                                                            : (size * (t + 1)) / nthreads;
+                jobs[t] = (struct join_job){.jp = jp, .first = i, .out = out + ofs};
+                for (; i < bl->qty && ofs < target; ++i) {
+                        ofs += join_elem_len(bl->lst[i]) + jp->fixed;
+                        if (i + 1 == bl->qty && !jp->trailing)
+                                ofs -= jp->seplen;
+                }
+                jobs[t].last = i;
+                ++n;
+        }
+
+        for (unsigned t = 1; t < n; ++t)
+                live[t] = pthread_create(&tids[t], NULL, &join_worker, &jobs[t]) == 0;
+        join_worker(&jobs[0]);
+        for (unsigned t = 1; t < n; ++t) {
+                if (live[t])
+                        pthread_join(tids[t], NULL);
+                else
+                        join_worker(&jobs[t]);
+        }
+}
+
+
+static void
+join_write(const struct join_parts *jp, bstring *dest, const uint64_t size)
+{
+        uchar *out = dest->data + dest->slen;
 
-        if (bstr->slen != bstr->mlen)
-                warnx("Failed operation, %u is smaller than %"PRId64"!", bstr->slen, total);
+        if (size >= JOIN_MT_MIN_SIZE)
+                join_parallel(jp, out, size);
+        else
+                join_range(jp, 0, jp->bl->qty, out);
 
-        return bstr;
+        dest->slen += (unsigned)size;
+        dest->data[dest->slen] = (uchar)'\0';
+}
+
+
+static bstring *
+join_new(const b_list *bl, const struct b_join_opts *opts)
+{
+        struct join_parts jp;
+        uint64_t          size;
+
+        if (!bl || !bl->lst || join_prepare(&jp, bl, opts, &size) != BSTR_OK)
+                RETURN_NULL();
+        if (size >= UINT32_MAX)
+                RETURN_NULL();
+
+        bstring *ret = b_create((unsigned)size);
+        join_write(&jp, ret, size);
+        return ret;
+}
+
+
+int
+b_list_join_append(bstring *dest, const b_list *bl, const struct b_join_opts *opts)
+{
+        struct join_parts jp;
+        uint64_t          size;
+
+        if (INVALID(dest) || NO_WRITE(dest) || !bl || !bl->lst)
+                RUNTIME_ERROR();
+        if (join_prepare(&jp, bl, opts, &size) != BSTR_OK)
+                RUNTIME_ERROR();
+        if (size + dest->slen >= UINT32_MAX)
+                RUNTIME_ERROR();
+        if (dest->mlen <= dest->slen + size && b_alloc(dest, dest->slen + (unsigned)size + 1U) != BSTR_OK)
+                RUNTIME_ERROR();
+
+        /* Any element that is dest itself is read through the updated header,
+         * and only its old contents are read, so the copy cannot overlap. */
+        join_write(&jp, dest, size);
+        return BSTR_OK;
+}
+
+
+bstring *
+b_list_join_opts(const b_list *bl, const struct b_join_opts *opts)
+{
+        return join_new(bl, opts);
+}
+
+
+bstring *
+b_join(const b_list *bl, const bstring *sep)
+{
+        return join_new(bl, &(struct b_join_opts){.sep = sep});
+}
+
+
+bstring *
+b_join_quote(const b_list *bl, const bstring *sep, const int ch)
+{
+        if (!ch)
+                RETURN_NULL();
+        return join_new(bl, &(struct b_join_opts){.sep = sep, .quote = ch});
 }
 
 
@@ -1668,7 +2587,7 @@ b_list_append(b_list *list, bstring *bstr)
         list->lst[list->qty++] = bstr;
 
 #ifdef BSTR_USE_TALLOC
-        if (bstr->flags & BSTR_FREEABLE)
+        if (bstr && (bstr->flags & BSTR_FREEABLE))
                 talloc_steal(list, bstr);
 #endif
 
@@ -1881,23 +2800,6 @@ b_list_join(const b_list *list, const bstring *sep)
 {
         if (!list || !list->lst || list->qty == 0)
                 RETURN_NULL();
-        unsigned total = 1;
-        unsigned seplen = (sep != NULL) ? sep->slen : 0;
-
-        B_LIST_FOREACH (list, str, i)
-                total += str->slen + seplen;
-        
-        bstring *ret = b_alloc_null(total);
-
-        B_LIST_FOREACH (list, str, i) {
-                memcpy(ret->data + ret->slen, str->data, str->slen);
-                ret->slen += str->slen;
-                if (sep != NULL) {
-                        memcpy(ret->data + ret->slen, sep->data, sep->slen);
-                        ret->slen += sep->slen;
-                }
-        }
 
-        ret->data[ret->slen] = '\0';
-        return ret;
+        return join_new(list, &(struct b_join_opts){.sep = sep, .flags = B_JOIN_TRAILING_SEP});
 }
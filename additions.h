@@ -199,10 +199,34 @@ b_fread(void *buf, const size_t size, const size_t nelem, void *param)
 #define B_GETS(PARAM, TERM, END_) b_gets(&b_fgetc, (PARAM), (TERM), (END_))
 #define B_READ(PARAM, END_)       b_fread(&b_fread, (PARAM), (END_))
 
+/**
+ * Read a whole file, descriptor or stdin until EOF. Regular files are sized
+ * from fstat up front; anything else grows geometrically. b_reada_fd appends
+ * to an existing bstring so that its buffer can be reused; on a read error it
+ * returns BSTR_ERR but keeps what was read. b_quickread returns NULL for an
+ * empty file.
+ */
 __attribute__((__format__(__printf__, 1, 2)))
 BSTR_PUBLIC bstring *b_quickread(const char *__restrict fmt, ...);
 BSTR_PUBLIC bstring *b_read_fd(const int fd);
 BSTR_PUBLIC bstring *b_read_stdin(void);
+BSTR_PUBLIC int      b_reada_fd(bstring *dest, int fd);
+
+#define B_MMAP_NUL        0x01 /* The result must be '\0' terminated. */
+#define B_MMAP_SEQUENTIAL 0x02 /* Advise the kernel of front to back access. */
+#define B_MMAP_WILLNEED   0x04 /* Start reading the whole file in now. */
+#define B_MMAP_POPULATE   0x08 /* Fault every page in before returning (Linux). */
+
+/**
+ * Return a write protected bstring backed directly by a read-only mapping of
+ * the file, which b_free unmaps. The data is only '\0' terminated if
+ * B_MMAP_NUL is given; when the mapping can't guarantee that, or the file
+ * can't be mapped at all (pipes, empty or special files), an ordinary copy is
+ * returned instead. Either way it is released with b_free. b_mmap_fd maps from
+ * offset 0 and does not close fd.
+ */
+BSTR_PUBLIC bstring *b_mmap_file(const char *path, unsigned flags);
+BSTR_PUBLIC bstring *b_mmap_fd(int fd, unsigned flags);
 
 
 /*--------------------------------------------------------------------------------------*/
@@ -238,14 +262,15 @@ BSTR_PUBLIC void _b_free_all(bstring **bstr, ...);
 
 /**
  * Write bstrings to files/stdout/stderr without the calls to strlen that the
- * standard c library would make. These call fwrite on the supplied stream,
- * passing the slen of the bstring as the length.
+ * standard c library would make. The stream is flushed and all of the bstrings
+ * are then handed to writev(2) together, up to IOV_MAX at a time. Streams
+ * without a file descriptor fall back to fwrite.
  */
 BSTR_PUBLIC void _b_fwrite(FILE *fp, bstring *bstr, ...);
 
 /**
- * Same as _b_fputs but writes to a file descriptor using the write(2) function
- * rather than a FILE * object and fwrite(3);
+ * Same as _b_fwrite but writes to a file descriptor. Returns BSTR_OK, or the
+ * errno value of a failed write.
  */
 BSTR_PUBLIC int  _b_write(int fd, bstring *bstr, ...);
 BSTR_PUBLIC void _b_list_dump(FILE *fp, const b_list *list, const char *listname);
@@ -259,6 +284,13 @@ BSTR_PUBLIC void _b_list_dump_fd(int fd, const b_list *list, const char *listnam
 #define b_list_dump(FP, LST)    _b_list_dump((FP), (LST), #LST)
 #define b_list_dump_fd(FD, LST) _b_list_dump_fd((FD), (LST), #LST)
 
+/**
+ * Write every element of list to fd, each followed by sep (which may be NULL),
+ * with as few writev calls as possible. Short writes are resumed. Returns the
+ * number of bytes written or BSTR_ERR.
+ */
+BSTR_PUBLIC int64_t b_list_write(int fd, const b_list *list, const bstring *sep);
+
 #ifdef BSTR_USE_P99
 #  define B_LIST_FOREACH(LIST, VAR, ...)                                                 \
         B_LIST_FOREACH_EXPLICIT_(LIST, VAR,                                              \
@@ -331,11 +363,50 @@ BSTR_PUBLIC int b_list_writeallow(b_list *list);
 
 BSTR_PUBLIC bstring  *b_join_quote(const b_list *bl, const bstring *sep, int ch);
 
+#define B_JOIN_TRAILING_SEP 0x01 /* Also emit sep after the last element. */
+
+/**
+ * Options for the general join engine. Every element is emitted as
+ * prefix, quote, element, quote, suffix, with sep between elements. Any
+ * member may be NULL/0. Invalid (NULL) list entries are treated as empty.
+ */
+struct b_join_opts {
+        const bstring *sep;
+        const bstring *prefix;
+        const bstring *suffix;
+        int            quote;
+        unsigned       flags;
+};
+
+/**
+ * Join bl according to opts. The exact output size is computed up front, so
+ * the result (or dest) is allocated at most once; very large outputs are copied
+ * by several threads. b_list_join_append appends to dest in place.
+ */
+BSTR_PUBLIC bstring  *b_list_join_opts(const b_list *bl, const struct b_join_opts *opts);
+BSTR_PUBLIC int       b_list_join_append(bstring *dest, const b_list *bl,
+                                         const struct b_join_opts *opts);
+
 BSTR_PUBLIC int     b_memsep(bstring *dest, bstring *stringp, char delim);
 BSTR_PUBLIC b_list *b_strsep(bstring *ostr, const char *delim, int refonly);
 BSTR_PUBLIC b_list *b_split_char(bstring *split, int delim, bool destroy);
 BSTR_PUBLIC b_list *b_split_lines(bstring *split, bool destroy);
 
+#define B_SPLIT_REF      0x01 /* Elements reference str's data instead of copying it. */
+#define B_SPLIT_CHOMP_CR 0x02 /* Drop a '\r' ending any element. */
+
+/**
+ * Split str on delim using up to nthreads threads (0 means one per online CPU).
+ * The buffer is cut into chunks aligned to delimiter boundaries which are split
+ * independently and stitched back together in order. The result matches
+ * b_split_char: no empty element follows a trailing delimiter. With B_SPLIT_REF
+ * the elements are write protected clones, so str must outlive the list.
+ */
+BSTR_PUBLIC b_list *b_split_mt(const bstring *str, int delim, unsigned flags, unsigned nthreads);
+
+#define b_split_char_mt(STR, DELIM, NTHREADS) b_split_mt((STR), (DELIM), 0, (NTHREADS))
+#define b_split_lines_mt(STR, NTHREADS)       b_split_mt((STR), '\n', B_SPLIT_CHOMP_CR, (NTHREADS))
+
 BSTR_PUBLIC int b_advance(bstring *bstr, unsigned n);
 
 /*--------------------------------------------------------------------------------------*/
@@ -362,6 +433,22 @@ BSTR_PUBLIC int        b_replace_ch(bstring *bstr, int find, int replacement);
 BSTR_PUBLIC int        b_catblk_nonul(bstring *bstr, void *blk, unsigned len);
 BSTR_PUBLIC int        b_insert_char(bstring *str, unsigned location, int ch);
 
+/**
+ * Replace every non-overlapping occurrence of find at or after pos with repl.
+ * Returns the number of replacements or BSTR_ERR. The work is done in place
+ * when repl is not longer than find; otherwise the buffer is grown exactly
+ * once. b_findreplace_multi takes parallel lists of needles and replacements
+ * and at each position replaces the longest needle that matches there.
+ * b_replace_all leaves src alone and returns the result as a new bstring.
+ */
+BSTR_PUBLIC int        b_findreplace(bstring *bstr, const bstring *find, const bstring *repl, unsigned pos);
+BSTR_PUBLIC int        b_findreplace_multi(bstring *bstr, const b_list *find, const b_list *repl, unsigned pos);
+BSTR_PUBLIC bstring   *b_replace_all(const bstring *src, const bstring *find, const bstring *repl);
+
+/**
+ * The fprintf and dprintf analogues render through a fixed per-thread buffer
+ * that is flushed to the file as it fills, so no temporary string is built.
+ */
 BSTR_PUBLIC bstring   *_b_sprintf  (const bstring *fmt, ...);
 BSTR_PUBLIC bstring   *_b_vsprintf (const bstring *fmt, va_list args);
 BSTR_PUBLIC int        _b_fprintf  (FILE *out_fp, const bstring *fmt, ...);
@@ -384,11 +471,611 @@ BSTR_PUBLIC int        _b_vsprintfa(bstring *dest, const bstring *fmt, va_list a
 #define b_printf(...)  b_fprintf(stdout, __VA_ARGS__)
 #define b_eprintf(...) b_fprintf(stderr, __VA_ARGS__)
 
+typedef struct b_fmt b_fmt;
+
+/**
+ * Compile a format for the functions above into a reusable program, so that
+ * running it skips parsing entirely. Returns NULL if the format contains an
+ * illegal conversion. The format is copied and need not outlive the program.
+ */
+BSTR_PUBLIC b_fmt   *b_fmt_compile(const bstring *fmt);
+BSTR_PUBLIC void     b_fmt_destroy(b_fmt *prog);
+BSTR_PUBLIC bstring *b_fmt_sprintf(const b_fmt *prog, ...);
+BSTR_PUBLIC bstring *b_fmt_vsprintf(const b_fmt *prog, va_list args);
+BSTR_PUBLIC int      b_fmt_sprintfa(bstring *dest, const b_fmt *prog, ...);
+BSTR_PUBLIC int      b_fmt_vsprintfa(bstring *dest, const b_fmt *prog, va_list args);
+BSTR_PUBLIC int64_t  b_fmt_fprintf(FILE *out_fp, const b_fmt *prog, ...);
+BSTR_PUBLIC int64_t  b_fmt_vfprintf(FILE *out_fp, const b_fmt *prog, va_list args);
+BSTR_PUBLIC int64_t  b_fmt_dprintf(int out_fd, const b_fmt *prog, ...);
+BSTR_PUBLIC int64_t  b_fmt_vdprintf(int out_fd, const b_fmt *prog, va_list args);
+
 BSTR_PUBLIC bstring *b_ll2str(const long long value);
+
+/**
+ * Append the decimal, hexadecimal (lower case) or octal representation of an
+ * integer to bstr.
+ */
+BSTR_PUBLIC int      b_cat_int(bstring *bstr, int64_t val);
+BSTR_PUBLIC int      b_cat_uint(bstring *bstr, uint64_t val);
+BSTR_PUBLIC int      b_cat_hex(bstring *bstr, uint64_t val);
+BSTR_PUBLIC int      b_cat_oct(bstring *bstr, uint64_t val);
+
+/**
+ * Append the shortest decimal representation of val that reads back as the
+ * same double, in the style of "%g".
+ */
+BSTR_PUBLIC int      b_cat_double(bstring *bstr, double val);
 BSTR_PUBLIC int      b_strcmp_fast(const bstring *a, const bstring *b) __attribute__((pure));
 BSTR_PUBLIC int      b_strcmp_fast_wrap(const void *vA, const void *vB) __attribute__((pure));
 BSTR_PUBLIC int      b_strcmp_wrap(const void *vA, const void *vB) __attribute__((pure));
 
+/*--------------------------------------------------------------------------------------*/
+/* Type-checked formatting */
+
+/**
+ * b_sprint and b_sprinta take a list of values and format each one according
+ * to its type, with no format string at all: strings and bstrings are copied,
+ * integers printed in decimal, doubles in their shortest round-trip form and
+ * a char as a character (in C a character constant is an int, so it needs
+ * b_arg_char). A value of any other type is a compile time error. Other
+ * formats are requested with the b_arg_* wrappers below:
+ *
+ * \code
+ * b_sprinta(line, "id=", id, " mask=", b_arg_hex(mask), " load=", b_arg_fixed(load, 2), "\n");
+ * \endcode
+ *
+ * In C the arguments are classified with _Generic, and at most 32 are taken.
+ * In C++ b_sprint and b_sprinta are variadic templates. Either way the
+ * lengths of string literals are computed at compile time, and the output is
+ * reserved in one step before being written by the typed kernels.
+ */
+enum b_arg_type {
+        B_ARG_BLK,
+        B_ARG_INT,
+        B_ARG_UINT,
+        B_ARG_HEX,
+        B_ARG_OCT,
+        B_ARG_CHAR,
+        B_ARG_DBL,
+};
+
+typedef struct b_arg {
+        union {
+                const void *ptr;
+                int64_t     i;
+                uint64_t    u;
+                double      d;
+        };
+        unsigned len;  /* Length of a block. */
+        int      prec; /* Precision of a double, or -1 for the shortest form. */
+        uint8_t  type;
+        uchar    conv; /* 'e', 'f' or 'g' for doubles. */
+} b_arg;
+
+BSTR_PUBLIC bstring *_b_sprint(const b_arg *argv, unsigned argc);
+BSTR_PUBLIC int      _b_sprinta(bstring *dest, const b_arg *argv, unsigned argc);
+
+static inline b_arg
+b_arg_blk(const void *blk, const unsigned len)
+{
+        b_arg arg;
+        arg.ptr  = blk ? blk : "(null)";
+        arg.len  = blk ? len : 6U;
+        arg.prec = -1;
+        arg.type = B_ARG_BLK;
+        arg.conv = 0;
+        return arg;
+}
+
+static inline b_arg
+b_arg_num_(const uint64_t val, const int type)
+{
+        b_arg arg;
+        arg.u    = val;
+        arg.len  = 0;
+        arg.prec = -1;
+        arg.type = (uint8_t)type;
+        arg.conv = 0;
+        return arg;
+}
+
+static inline b_arg
+b_arg_dbl_(const double val, const int conv, const int prec)
+{
+        b_arg arg;
+        arg.d    = val;
+        arg.len  = 0;
+        arg.prec = prec;
+        arg.type = B_ARG_DBL;
+        arg.conv = (uchar)conv;
+        return arg;
+}
+
+static inline b_arg b_arg_cstr_(const char *str)     { return b_arg_blk(str, str ? (unsigned)strlen(str) : 0); }
+static inline b_arg b_arg_bstr_(const bstring *bstr) { return bstr && bstr->data ? b_arg_blk(bstr->data, bstr->slen) : b_arg_blk(NULL, 0); }
+static inline b_arg b_arg_int_(const long long val)  { return b_arg_num_((uint64_t)val, B_ARG_INT); }
+static inline b_arg b_arg_uint_(const unsigned long long val) { return b_arg_num_(val, B_ARG_UINT); }
+static inline b_arg b_arg_self_(const b_arg arg)     { return arg; }
+
+/** Print an unsigned integer in hexadecimal (lower case) or octal. */
+static inline b_arg b_arg_hex(const uint64_t val) { return b_arg_num_(val, B_ARG_HEX); }
+static inline b_arg b_arg_oct(const uint64_t val) { return b_arg_num_(val, B_ARG_OCT); }
+
+/** Print an integer as the character it encodes. */
+static inline b_arg b_arg_char(const int ch) { return b_arg_num_((uint64_t)(uchar)ch, B_ARG_CHAR); }
+
+/** Print a double as "%.*f", "%.*e" or "%.*g" would. */
+static inline b_arg b_arg_fixed(const double val, const int prec) { return b_arg_dbl_(val, 'f', prec); }
+static inline b_arg b_arg_exp(const double val, const int prec)   { return b_arg_dbl_(val, 'e', prec); }
+static inline b_arg b_arg_gen(const double val, const int prec)   { return b_arg_dbl_(val, 'g', prec); }
+static inline b_arg b_arg_gen_(const double val)                  { return b_arg_dbl_(val, 'g', -1); }
+
+#ifndef __cplusplus
+#  define B_ARG(X) _Generic((X),                                                         \
+        b_arg:              b_arg_self_,                                                 \
+        char *:             b_arg_cstr_,  const char *:       b_arg_cstr_,               \
+        bstring *:          b_arg_bstr_,  const bstring *:    b_arg_bstr_,               \
+        char:               b_arg_char,                                                  \
+        signed char:        b_arg_int_,   short:              b_arg_int_,                \
+        int:                b_arg_int_,   long:               b_arg_int_,                \
+        long long:          b_arg_int_,                                                  \
+        _Bool:              b_arg_uint_,  unsigned char:      b_arg_uint_,               \
+        unsigned short:     b_arg_uint_,  unsigned:           b_arg_uint_,               \
+        unsigned long:      b_arg_uint_,  unsigned long long: b_arg_uint_,               \
+        float:              b_arg_gen_,   double:             b_arg_gen_)(X)
+
+#  define B_NARGS_(...)  B_NARGS_N_(__VA_ARGS__, 32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, \
+                                    21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7,  \
+                                    6, 5, 4, 3, 2, 1, 0)
+#  define B_NARGS_N_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16,   \
+                     _17, _18, _19, _20, _21, _22, _23, _24, _25, _26, _27, _28, _29, _30,    \
+                     _31, _32, N, ...) N
+#  define B_PASTE_(A, B)  B_PASTE2_(A, B)
+#  define B_PASTE2_(A, B) A##B
+#  define B_ARGV_(...) B_PASTE_(B_ARGV_, B_NARGS_(__VA_ARGS__))(__VA_ARGS__)
+#  define B_ARGV_1(X)       B_ARG(X)
+#  define B_ARGV_2(X, ...)  B_ARG(X), B_ARGV_1(__VA_ARGS__)
+#  define B_ARGV_3(X, ...)  B_ARG(X), B_ARGV_2(__VA_ARGS__)
+#  define B_ARGV_4(X, ...)  B_ARG(X), B_ARGV_3(__VA_ARGS__)
+#  define B_ARGV_5(X, ...)  B_ARG(X), B_ARGV_4(__VA_ARGS__)
+#  define B_ARGV_6(X, ...)  B_ARG(X), B_ARGV_5(__VA_ARGS__)
+#  define B_ARGV_7(X, ...)  B_ARG(X), B_ARGV_6(__VA_ARGS__)
+#  define B_ARGV_8(X, ...)  B_ARG(X), B_ARGV_7(__VA_ARGS__)
+#  define B_ARGV_9(X, ...)  B_ARG(X), B_ARGV_8(__VA_ARGS__)
+#  define B_ARGV_10(X, ...) B_ARG(X), B_ARGV_9(__VA_ARGS__)
+#  define B_ARGV_11(X, ...) B_ARG(X), B_ARGV_10(__VA_ARGS__)
+#  define B_ARGV_12(X, ...) B_ARG(X), B_ARGV_11(__VA_ARGS__)
+#  define B_ARGV_13(X, ...) B_ARG(X), B_ARGV_12(__VA_ARGS__)
+#  define B_ARGV_14(X, ...) B_ARG(X), B_ARGV_13(__VA_ARGS__)
+#  define B_ARGV_15(X, ...) B_ARG(X), B_ARGV_14(__VA_ARGS__)
+#  define B_ARGV_16(X, ...) B_ARG(X), B_ARGV_15(__VA_ARGS__)
+#  define B_ARGV_17(X, ...) B_ARG(X), B_ARGV_16(__VA_ARGS__)
+#  define B_ARGV_18(X, ...) B_ARG(X), B_ARGV_17(__VA_ARGS__)
+#  define B_ARGV_19(X, ...) B_ARG(X), B_ARGV_18(__VA_ARGS__)
+#  define B_ARGV_20(X, ...) B_ARG(X), B_ARGV_19(__VA_ARGS__)
+#  define B_ARGV_21(X, ...) B_ARG(X), B_ARGV_20(__VA_ARGS__)
+#  define B_ARGV_22(X, ...) B_ARG(X), B_ARGV_21(__VA_ARGS__)
+#  define B_ARGV_23(X, ...) B_ARG(X), B_ARGV_22(__VA_ARGS__)
+#  define B_ARGV_24(X, ...) B_ARG(X), B_ARGV_23(__VA_ARGS__)
+#  define B_ARGV_25(X, ...) B_ARG(X), B_ARGV_24(__VA_ARGS__)
+#  define B_ARGV_26(X, ...) B_ARG(X), B_ARGV_25(__VA_ARGS__)
+#  define B_ARGV_27(X, ...) B_ARG(X), B_ARGV_26(__VA_ARGS__)
+#  define B_ARGV_28(X, ...) B_ARG(X), B_ARGV_27(__VA_ARGS__)
+#  define B_ARGV_29(X, ...) B_ARG(X), B_ARGV_28(__VA_ARGS__)
+#  define B_ARGV_30(X, ...) B_ARG(X), B_ARGV_29(__VA_ARGS__)
+#  define B_ARGV_31(X, ...) B_ARG(X), B_ARGV_30(__VA_ARGS__)
+#  define B_ARGV_32(X, ...) B_ARG(X), B_ARGV_31(__VA_ARGS__)
+
+#  define b_sprint(...) \
+        _b_sprint((const b_arg[]){B_ARGV_(__VA_ARGS__)}, B_NARGS_(__VA_ARGS__))
+#  define b_sprinta(DEST, ...) \
+        _b_sprinta((DEST), (const b_arg[]){B_ARGV_(__VA_ARGS__)}, B_NARGS_(__VA_ARGS__))
+#endif
+
+/*--------------------------------------------------------------------------------------*/
+/* Delimited text (CSV/TSV) parsing */
+
+#define B_CSV_STRICT  0x01 /* Reject unterminated quotes and text after a closing quote. */
+#define B_CSV_NOQUOTE 0x02 /* Treat '"' as ordinary data, as in plain TSV. */
+
+typedef struct b_csv b_csv;
+
+/**
+ * Create an RFC 4180 parser over an existing bstring or a file descriptor.
+ * Records end at "\n", "\r\n" or a lone '\r'. The source bstring must outlive
+ * the parser; the fd is not closed by b_csv_close.
+ */
+BSTR_PUBLIC b_csv   *b_csv_open(const bstring *src, int delim, unsigned flags);
+BSTR_PUBLIC b_csv   *b_csv_open_fd(int fd, int delim, unsigned flags);
+BSTR_PUBLIC void     b_csv_close(b_csv *csv);
+
+/**
+ * Parse the next record. On success the number of fields is returned and
+ * *fields is pointed at an array of static bstring views. These point into the
+ * source (or an internal buffer for unescaped fields), are NOT '\0' terminated
+ * and are only valid until the next call. Returns 0 at end of input and
+ * BSTR_ERR on a read error or, with B_CSV_STRICT, malformed input.
+ */
+BSTR_PUBLIC int      b_csv_next(b_csv *csv, bstring **fields);
+BSTR_PUBLIC uint64_t b_csv_recno(const b_csv *csv);
+
+#define b_tsv_open(SRC)    b_csv_open((SRC), '\t', 0)
+#define b_tsv_open_fd(FD)  b_csv_open_fd((FD), '\t', 0)
+
+/*--------------------------------------------------------------------------------------*/
+/* Buffered line reader */
+
+#define B_READER_KEEP_TERM 0x01 /* Include the terminator in each line. */
+#define B_READER_CRLF      0x02 /* Strip a '\r' just before the terminator. */
+
+typedef struct b_reader b_reader;
+
+/**
+ * Read lines from an fd or FILE * in large blocks. term may be any non-empty
+ * string; NULL means "\n". A FILE * is read with fread, which waits for a full
+ * block, so use the fd form for interactive input. Neither is closed by
+ * b_reader_close.
+ */
+BSTR_PUBLIC b_reader *b_reader_open_fd(int fd, const bstring *term, unsigned flags);
+BSTR_PUBLIC b_reader *b_reader_open_fp(FILE *fp, const bstring *term, unsigned flags);
+BSTR_PUBLIC void      b_reader_close(b_reader *rd);
+BSTR_PUBLIC uint64_t  b_reader_lineno(const b_reader *rd);
+
+/**
+ * b_reader_next stores a static view of the next line in *line, valid until
+ * the next call. b_reader_geta appends the line to dest instead. The last line
+ * needn't be terminated. Both return 1 for a line, 0 at EOF or BSTR_ERR.
+ */
+BSTR_PUBLIC int       b_reader_next(b_reader *rd, bstring *line);
+BSTR_PUBLIC int       b_reader_geta(b_reader *rd, bstring *dest);
+
+/**
+ * Copy the next len bytes of input (UINT64_MAX for all of it) straight to
+ * out_fd, starting with whatever the reader has buffered. Reading lines may
+ * continue afterwards. Returns the number of bytes moved or BSTR_ERR.
+ */
+BSTR_PUBLIC int64_t   b_reader_transfer(b_reader *rd, int out_fd, uint64_t len);
+
+/*--------------------------------------------------------------------------------------*/
+/* Descriptor transfers */
+
+/**
+ * Move up to len bytes (UINT64_MAX for everything up to EOF) from in_fd's
+ * current position to out_fd without passing them through a bstring. Uses
+ * copy_file_range, sendfile or splice where the descriptors allow it, and a
+ * per-thread buffer otherwise. Returns the number of bytes moved, which is
+ * less than len only at EOF, or BSTR_ERR. b_file_transfer sends all of the
+ * named file.
+ */
+BSTR_PUBLIC int64_t b_fd_transfer(int out_fd, int in_fd, uint64_t len);
+BSTR_PUBLIC int64_t b_file_transfer(int out_fd, const char *path);
+
+/*--------------------------------------------------------------------------------------*/
+/* Buffered writer */
+
+#define B_WRITER_PER_THREAD 0x01 /* Give each thread its own buffer. */
+
+typedef struct b_writer b_writer;
+
+/**
+ * Create a thread safe writer that collects output in a buffer of about
+ * bufsize bytes (0 selects 64 KiB) and writes it to fd in large blocks. With
+ * B_WRITER_PER_THREAD every thread appends to a buffer of its own without
+ * contending with the others. Buffers are written out only up to their last
+ * newline until flushed, so lines from different threads never interleave.
+ * A thread's buffer is written out when the thread exits. b_writer_flush
+ * writes out every buffer; b_writer_close flushes and frees the writer but
+ * doesn't close fd. No thread may use the writer during b_writer_close.
+ */
+BSTR_PUBLIC b_writer *b_writer_open(int fd, unsigned bufsize, unsigned flags);
+BSTR_PUBLIC int       b_writer_flush(b_writer *wr);
+BSTR_PUBLIC int       b_writer_close(b_writer *wr);
+
+BSTR_PUBLIC int       b_writer_put(b_writer *wr, const bstring *bstr);
+BSTR_PUBLIC int       b_writer_put_blk(b_writer *wr, const void *blk, unsigned len);
+BSTR_PUBLIC int       b_writer_put_char(b_writer *wr, int ch);
+BSTR_PUBLIC int       b_writer_put_int(b_writer *wr, int64_t val);
+BSTR_PUBLIC int       b_writer_put_uint(b_writer *wr, uint64_t val);
+BSTR_PUBLIC int       _b_writer_printf(b_writer *wr, const bstring *fmt, ...);
+BSTR_PUBLIC int       _b_writer_vprintf(b_writer *wr, const bstring *fmt, va_list args);
+
+#define b_writer_puts(WR, LIT)         b_writer_put_blk((WR), ("" LIT ""), sizeof(LIT) - 1U)
+#define b_writer_printf(WR, FMT, ...)  _b_writer_printf((WR), B(FMT), ##__VA_ARGS__)
+#define b_writer_vprintf(WR, FMT, ...) _b_writer_vprintf((WR), B(FMT), ##__VA_ARGS__)
+
+/**
+ * Append the arguments as b_sprinta would format them. One call's output is
+ * never split between two writes unless it is larger than the buffer.
+ */
+BSTR_PUBLIC int       _b_writer_print(b_writer *wr, const b_arg *argv, unsigned argc);
+
+#ifndef __cplusplus
+#  define b_writer_print(WR, ...) \
+        _b_writer_print((WR), (const b_arg[]){B_ARGV_(__VA_ARGS__)}, B_NARGS_(__VA_ARGS__))
+#endif
+
+/**
+ * Write out the calling thread's buffer, then move len bytes (UINT64_MAX for
+ * all of them) from in_fd to the writer's descriptor with b_fd_transfer.
+ */
+BSTR_PUBLIC int64_t   b_writer_transfer(b_writer *wr, int in_fd, uint64_t len);
+
+/*--------------------------------------------------------------------------------------*/
+/* Batch file loading */
+
+#define B_LOAD_NO_URING 0x01 /* Use the thread pool even where io_uring works. */
+
+/**
+ * Read every file named in paths, keeping many in flight at once, and return
+ * their contents in the same order. Entries for files that couldn't be read
+ * are NULL. io_uring is used where it was built in and the kernel allows it;
+ * otherwise nthreads threads (0 for a default based on the CPU count) do
+ * blocking reads.
+ */
+BSTR_PUBLIC b_list *b_load_files(const b_list *paths, unsigned flags, unsigned nthreads);
+
+#define B_TREE_MMAP   0x01 /* Map files of 64 KiB or more with b_mmap_fd instead of reading them. */
+#define B_TREE_HIDDEN 0x02 /* Include files and directories whose names start with '.'. */
+#define B_TREE_FOLLOW 0x04 /* Load symbolic links to files. Links to directories are never followed. */
+
+/**
+ * Walk the directory tree under root with nthreads threads (0 for one per
+ * CPU) and load every regular file whose name matches the glob pattern (NULL
+ * matches all), e.g. "*.c". A pattern containing '/' is matched against the
+ * whole path below root instead. Returns the paths, sorted, and stores the
+ * contents in the same order in *contents. Contents are '\0' terminated, even
+ * when mapped; those of files that couldn't be read are NULL. Returns NULL if
+ * root isn't a directory.
+ */
+BSTR_PUBLIC b_list *b_load_tree(const char *root, const char *pattern, unsigned flags,
+                                unsigned nthreads, b_list **contents);
+
+/*--------------------------------------------------------------------------------------*/
+/* Compression */
+
+/**
+ * Compress with a fast LZ codec (the LZ4 block format behind a four byte
+ * length header). b_decompress returns NULL with errno set to EINVAL if src
+ * isn't something b_compress produced.
+ */
+BSTR_PUBLIC bstring *b_compress(const bstring *src);
+BSTR_PUBLIC bstring *b_decompress(const bstring *src);
+
+typedef struct b_packed b_packed;
+
+/**
+ * Keep a compressed copy of src that is inflated on first access, for cold
+ * data; free src afterwards to get the memory back. Short strings and those
+ * that don't shrink are kept uncompressed. b_packed_get returns the plain
+ * string, inflating it once (safely from several threads); it belongs to the
+ * packed string and stays valid until b_packed_evict or b_packed_destroy.
+ * b_unpack hands the plain string over and destroys the packed one.
+ * b_packed_evict drops the inflated copy again; no thread may be using it.
+ * b_packed_len is the uncompressed length, and b_packed_size the memory held.
+ */
+BSTR_PUBLIC b_packed      *b_pack(const bstring *src);
+BSTR_PUBLIC const bstring *b_packed_get(b_packed *pk);
+BSTR_PUBLIC bstring       *b_unpack(b_packed *pk);
+BSTR_PUBLIC void           b_packed_evict(b_packed *pk);
+BSTR_PUBLIC void           b_packed_destroy(b_packed *pk);
+BSTR_PUBLIC unsigned       b_packed_len(const b_packed *pk) __attribute__((pure));
+BSTR_PUBLIC uint64_t       b_packed_size(const b_packed *pk);
+
+/**
+ * Pack a whole list as one compressed block, which suits many short strings.
+ * b_unpack_list inflates it into a new list each time it is called. NULL
+ * elements are preserved. Release the result with b_packed_destroy.
+ */
+BSTR_PUBLIC b_packed      *b_pack_list(const b_list *list);
+BSTR_PUBLIC b_list        *b_unpack_list(const b_packed *pk);
+
+/*--------------------------------------------------------------------------------------*/
+/* Line offset index */
+
+#define B_LINEIDX_KEEP_CR 0x01 /* Don't strip the '\r' of "\r\n" line endings. */
+
+typedef struct b_lineidx b_lineidx;
+
+/**
+ * Index the start offset of every line in src. The index holds no reference to
+ * src, so src must be passed again to the accessors. After appending to src,
+ * b_lineidx_extend scans only the new data.
+ */
+BSTR_PUBLIC b_lineidx *b_lineidx_create(const bstring *src, unsigned flags);
+BSTR_PUBLIC int        b_lineidx_extend(b_lineidx *idx, const bstring *src);
+BSTR_PUBLIC void       b_lineidx_destroy(b_lineidx *idx);
+
+/**
+ * Number of lines, with the same convention as b_split_lines: a trailing
+ * newline does not produce a final empty line.
+ */
+BSTR_PUBLIC unsigned   b_lineidx_count(const b_lineidx *idx) __attribute__((pure));
+
+/**
+ * Store a static view of line n (0 based, without its terminator) in dest.
+ */
+BSTR_PUBLIC int        b_lineidx_get(const b_lineidx *idx, const bstring *src,
+                                     unsigned n, bstring *dest);
+
+/**
+ * Return the 0 based line containing byte offset, or BSTR_ERR if offset is
+ * past the indexed data.
+ */
+BSTR_PUBLIC int64_t    b_lineidx_lineof(const b_lineidx *idx, unsigned offset) __attribute__((pure));
+
+/*--------------------------------------------------------------------------------------*/
+/* Ropes */
+
+#define B_ROPE_MAX_DEPTH 96
+
+typedef struct b_rope b_rope;
+struct b_rope_node;
+
+typedef struct b_rope_iter {
+        const struct b_rope_node *stack[B_ROPE_MAX_DEPTH];
+        unsigned                  depth;
+} b_rope_iter;
+
+/**
+ * A rope is a balanced tree of bstring slices. Ropes share structure, so
+ * b_rope_copy, b_rope_concat and b_rope_substr are O(log n) and never copy
+ * the data; insertion and deletion are O(log n) as well. Small appends are
+ * coalesced into their neighbouring leaf. Ropes are not thread safe, and
+ * neither are two ropes that share data.
+ */
+BSTR_PUBLIC b_rope  *b_rope_create(void);
+BSTR_PUBLIC b_rope  *b_rope_from_bstr(const bstring *bstr);
+BSTR_PUBLIC b_rope  *b_rope_copy(const b_rope *rope);
+BSTR_PUBLIC void     b_rope_destroy(b_rope *rope);
+BSTR_PUBLIC uint64_t b_rope_len(const b_rope *rope) __attribute__((pure));
+
+BSTR_PUBLIC int      b_rope_append(b_rope *rope, const bstring *bstr);
+BSTR_PUBLIC int      b_rope_append_blk(b_rope *rope, const void *blk, unsigned len);
+BSTR_PUBLIC int      b_rope_concat(b_rope *dest, const b_rope *src);
+BSTR_PUBLIC int      b_rope_insert(b_rope *rope, uint64_t pos, const bstring *bstr);
+BSTR_PUBLIC int      b_rope_insert_rope(b_rope *rope, uint64_t pos, const b_rope *src);
+BSTR_PUBLIC int      b_rope_delete(b_rope *rope, uint64_t pos, uint64_t len);
+BSTR_PUBLIC b_rope  *b_rope_substr(const b_rope *rope, uint64_t pos, uint64_t len);
+
+/**
+ * Append bstr without copying it. The rope takes ownership: bstr must be
+ * freeable and must not be used by the caller afterwards.
+ */
+BSTR_PUBLIC int      b_rope_append_steal(b_rope *rope, bstring *bstr);
+
+/**
+ * Return the byte at pos, or BSTR_ERR if pos is out of range.
+ */
+BSTR_PUBLIC int      b_rope_index(const b_rope *rope, uint64_t pos) __attribute__((pure));
+
+/**
+ * Copy the whole rope into one contiguous bstring. Fails if the result would
+ * not fit in a bstring.
+ */
+BSTR_PUBLIC bstring *b_rope_flatten(const b_rope *rope);
+BSTR_PUBLIC int      b_rope_flatten_append(bstring *dest, const b_rope *rope);
+
+/**
+ * Walk the rope one leaf at a time: each call stores a static view of the next
+ * chunk in chunk. The rope must not be modified during the iteration.
+ */
+BSTR_PUBLIC void     b_rope_iter_init(b_rope_iter *it, const b_rope *rope);
+BSTR_PUBLIC bool     b_rope_iter_next(b_rope_iter *it, bstring *chunk);
+
+/*--------------------------------------------------------------------------------------*/
+/* Segmented string builder */
+
+typedef struct b_builder b_builder;
+
+/**
+ * Create a builder that appends into a chain of segsize byte segments (a
+ * segsize of 0 selects 64 KiB). Appended data is never moved. b_builder_reset
+ * empties the builder but keeps its first segment for reuse.
+ */
+BSTR_PUBLIC b_builder *b_builder_create(unsigned segsize);
+BSTR_PUBLIC void       b_builder_reset(b_builder *bld);
+BSTR_PUBLIC void       b_builder_destroy(b_builder *bld);
+BSTR_PUBLIC uint64_t   b_builder_len(const b_builder *bld) __attribute__((pure));
+
+BSTR_PUBLIC int        b_builder_append(b_builder *bld, const bstring *bstr);
+BSTR_PUBLIC int        b_builder_append_blk(b_builder *bld, const void *blk, unsigned len);
+BSTR_PUBLIC int        b_builder_append_char(b_builder *bld, int ch);
+BSTR_PUBLIC int        b_builder_format(b_builder *bld, const char *fmt, ...) BSTR_PRINTF(2, 3);
+BSTR_PUBLIC int        b_builder_vformat(b_builder *bld, const char *fmt, va_list args) BSTR_PRINTF(2, 0);
+
+/**
+ * Return a pointer to at least len contiguous writable bytes. Nothing is added
+ * to the builder until b_builder_commit is called with the number of bytes
+ * actually written, which may be less than len.
+ */
+BSTR_PUBLIC uchar     *b_builder_reserve(b_builder *bld, unsigned len);
+BSTR_PUBLIC int        b_builder_commit(b_builder *bld, unsigned len);
+
+/**
+ * Copy the contents into a single new bstring.
+ */
+BSTR_PUBLIC bstring   *b_builder_flatten(const b_builder *bld);
+
+/**
+ * Write the contents to fd with writev, without flattening them first. Returns
+ * the number of bytes written or BSTR_ERR.
+ */
+BSTR_PUBLIC int64_t    b_builder_write_fd(const b_builder *bld, int fd);
+
+/*--------------------------------------------------------------------------------------*/
+/* Gap buffers */
+
+typedef struct b_gapbuf b_gapbuf;
+
+/**
+ * A gap buffer is an editable string with a cursor. Insertions and deletions
+ * at the cursor are amortized O(1); moving the cursor costs the distance
+ * moved. b_gapbuf_from_bstr takes ownership of a freeable bstring without
+ * copying it, and b_gapbuf_to_bstr gives the buffer back as a bstring (and
+ * destroys the gap buffer), which is free when the cursor is at the end.
+ */
+BSTR_PUBLIC b_gapbuf *b_gapbuf_create(unsigned size);
+BSTR_PUBLIC b_gapbuf *b_gapbuf_from_bstr(bstring *bstr);
+BSTR_PUBLIC bstring  *b_gapbuf_to_bstr(b_gapbuf *gb);
+BSTR_PUBLIC void      b_gapbuf_destroy(b_gapbuf *gb);
+BSTR_PUBLIC unsigned  b_gapbuf_len(const b_gapbuf *gb) __attribute__((pure));
+BSTR_PUBLIC unsigned  b_gapbuf_cursor(const b_gapbuf *gb) __attribute__((pure));
+BSTR_PUBLIC int       b_gapbuf_seek(b_gapbuf *gb, unsigned pos);
+
+/**
+ * Insert at the cursor, leaving the cursor after the new text.
+ */
+BSTR_PUBLIC int       b_gapbuf_insert(b_gapbuf *gb, const bstring *bstr);
+BSTR_PUBLIC int       b_gapbuf_insert_blk(b_gapbuf *gb, const void *blk, unsigned len);
+BSTR_PUBLIC int       b_gapbuf_insert_char(b_gapbuf *gb, int ch);
+
+/**
+ * b_gapbuf_delete removes len bytes after the cursor, b_gapbuf_backspace len
+ * bytes before it. b_gapbuf_replace deletes len bytes after the cursor and
+ * inserts repl in their place.
+ */
+BSTR_PUBLIC int       b_gapbuf_delete(b_gapbuf *gb, unsigned len);
+BSTR_PUBLIC int       b_gapbuf_backspace(b_gapbuf *gb, unsigned len);
+BSTR_PUBLIC int       b_gapbuf_replace(b_gapbuf *gb, unsigned len, const bstring *repl);
+
+/**
+ * Read access. Positions are logical, i.e. the gap is invisible.
+ * b_gapbuf_views stores static views of the text before and after the cursor;
+ * they are invalidated by any edit or cursor movement.
+ */
+BSTR_PUBLIC int       b_gapbuf_char(const b_gapbuf *gb, unsigned pos) __attribute__((pure));
+BSTR_PUBLIC int       b_gapbuf_views(const b_gapbuf *gb, bstring *before, bstring *after);
+BSTR_PUBLIC int64_t   b_gapbuf_strchrp(const b_gapbuf *gb, int ch, unsigned pos) __attribute__((pure));
+BSTR_PUBLIC int64_t   b_gapbuf_strstr(const b_gapbuf *gb, const bstring *needle, unsigned pos) __attribute__((pure));
+
+/*--------------------------------------------------------------------------------------*/
+/* Number parsing */
+
+/**
+ * Parse the whole of a bstring or block as a decimal number. The input need
+ * not be '\0' terminated and no whitespace is skipped. The syntax is that of
+ * strtoll/strtod in the C locale, minus hex; doubles also accept "inf",
+ * "infinity" and "nan". Returns BSTR_OK, or BSTR_ERR with errno set to EINVAL
+ * for malformed input (*out untouched) or ERANGE for a value out of range
+ * (*out clamped, or +-HUGE_VAL/0.0 for doubles).
+ */
+BSTR_PUBLIC int b_parse_int64(const bstring *str, int64_t *out);
+BSTR_PUBLIC int b_parse_uint64(const bstring *str, uint64_t *out);
+BSTR_PUBLIC int b_parse_double(const bstring *str, double *out);
+BSTR_PUBLIC int b_parse_int64_blk(const void *blk, unsigned len, int64_t *out);
+BSTR_PUBLIC int b_parse_uint64_blk(const void *blk, unsigned len, uint64_t *out);
+BSTR_PUBLIC int b_parse_double_blk(const void *blk, unsigned len, double *out);
+
+/**
+ * Parse every entry of list into out, which must hold list->qty values.
+ * Entries that fail are stored as 0 (NaN for doubles), or the clamped value on
+ * overflow. Returns the number of failures, with the index of the first in
+ * *first_bad (-1 if none) when first_bad is not NULL.
+ */
+BSTR_PUBLIC int64_t b_list_parse_int64(const b_list *list, int64_t *out, int64_t *first_bad);
+BSTR_PUBLIC int64_t b_list_parse_uint64(const b_list *list, uint64_t *out, int64_t *first_bad);
+BSTR_PUBLIC int64_t b_list_parse_double(const b_list *list, double *out, int64_t *first_bad);
+
 /*--------------------------------------------------------------------------------------*/
 
 #define b_conchar b_catchar
@@ -419,6 +1106,69 @@ b_catchar(bstring *bstr, const char ch)
 
 #ifdef __cplusplus
 }
+
+/*
+ * The C++ front end for b_sprint, b_sprinta and b_writer_print. Overload
+ * resolution plays the part of _Generic, so again an unsupported type fails to
+ * compile. This header may be read inside bstring.h's extern "C" block, hence
+ * the explicit linkage.
+ */
+extern "C++" {
+static inline b_arg b_arg_make_(const b_arg arg)               { return arg; }
+static inline b_arg b_arg_make_(const char *str)               { return b_arg_cstr_(str); }
+static inline b_arg b_arg_make_(const bstring *bstr)           { return b_arg_bstr_(bstr); }
+static inline b_arg b_arg_make_(const char ch)                 { return b_arg_char(ch); }
+static inline b_arg b_arg_make_(const signed char val)         { return b_arg_int_(val); }
+static inline b_arg b_arg_make_(const short val)               { return b_arg_int_(val); }
+static inline b_arg b_arg_make_(const int val)                 { return b_arg_int_(val); }
+static inline b_arg b_arg_make_(const long val)                { return b_arg_int_(val); }
+static inline b_arg b_arg_make_(const long long val)           { return b_arg_int_(val); }
+static inline b_arg b_arg_make_(const unsigned char val)       { return b_arg_uint_(val); }
+static inline b_arg b_arg_make_(const unsigned short val)      { return b_arg_uint_(val); }
+static inline b_arg b_arg_make_(const unsigned val)            { return b_arg_uint_(val); }
+static inline b_arg b_arg_make_(const unsigned long val)       { return b_arg_uint_(val); }
+static inline b_arg b_arg_make_(const unsigned long long val)  { return b_arg_uint_(val); }
+static inline b_arg b_arg_make_(const float val)               { return b_arg_gen_(val); }
+static inline b_arg b_arg_make_(const double val)              { return b_arg_gen_(val); }
+
+/*
+ * Every pointer converts to bool, so a plain bool overload would quietly print
+ * any unsupported pointer as 1. This one only matches an actual bool.
+ */
+template <typename T> struct b_arg_bool_ {};
+template <> struct b_arg_bool_<bool> { typedef b_arg type; };
+
+template <typename T>
+static inline typename b_arg_bool_<T>::type
+b_arg_make_(const T val)
+{
+        return b_arg_uint_(val);
+}
+
+template <typename... Args>
+static inline bstring *
+b_sprint(const Args &...args)
+{
+        const b_arg argv[] = {b_arg_make_(args)...};
+        return _b_sprint(argv, sizeof...(Args));
+}
+
+template <typename... Args>
+static inline int
+b_sprinta(bstring *dest, const Args &...args)
+{
+        const b_arg argv[] = {b_arg_make_(args)...};
+        return _b_sprinta(dest, argv, sizeof...(Args));
+}
+
+template <typename... Args>
+static inline int
+b_writer_print(b_writer *wr, const Args &...args)
+{
+        const b_arg argv[] = {b_arg_make_(args)...};
+        return _b_writer_print(wr, argv, sizeof...(Args));
+}
+}
 #endif
 
 #endif /* additions.h */
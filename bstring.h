@@ -613,6 +613,48 @@ BSTR_PUBLIC b_list *b_splits(const bstring *str, const bstring *splitStr);
  */
 BSTR_PUBLIC b_list *b_splitstr(const bstring *str, const bstring *splitStr);
 
+/**
+ * Iterate the set of disjoint sequential substrings over str starting at
+ * position pos divided by the character splitChar.
+ *
+ * The parm passed to bsplitcb is passed on to cb. If the function cb returns a
+ * value < 0, then further iterating is halted and this value is returned by
+ * b_splitcb. Otherwise BSTR_OK is returned.
+ *
+ * Unlike b_split, no b_list is built and nothing is copied; cb is handed the
+ * offset and length of each piece within str. The bounds of str are read once
+ * up front, so str must not be modified or destroyed until b_splitcb returns.
+ * A cb that needs to change str should instead stop the split by returning a
+ * negative value, and the change can be made once b_splitcb has returned.
+ */
+BSTR_PUBLIC int b_splitcb(const bstring *str, uchar splitChar, unsigned pos,
+                          b_cbfunc cb, void *parm);
+
+/**
+ * Iterate the set of disjoint sequential substrings over str starting at
+ * position pos divided by any of the characters in splitStr.
+ *
+ * An empty splitStr causes the whole str from pos onward to be passed to cb
+ * once. The return value and the restrictions placed on cb are the same as for
+ * b_splitcb. Membership in splitStr is tested with a 256 bit class map, which
+ * is vectorized when SSSE3 (or SSE2 for sets of at most 4 characters) is
+ * available at compile time.
+ */
+BSTR_PUBLIC int b_splitscb(const bstring *str, const bstring *splitStr,
+                           unsigned pos, b_cbfunc cb, void *parm);
+
+/**
+ * Iterate the set of disjoint sequential substrings over str starting at
+ * position pos divided by the entire substring splitStr.
+ *
+ * An empty splitStr causes the whole str from pos onward to be passed to cb
+ * once. The return value and the restrictions placed on cb are the same as for
+ * b_splitcb. Occurrences are located with a binary safe memmem, so '\0'
+ * characters in either string are not treated specially.
+ */
+BSTR_PUBLIC int b_splitstrcb(const bstring *str, const bstring *splitStr,
+                             unsigned pos, b_cbfunc cb, void *parm);
+
 /**
  * Join the entries of a b_list into one bstring by sequentially concatenating
  * them with the sep bstring in between.
@@ -712,6 +754,9 @@ BSTR_PUBLIC int b_format_assign(bstring *bstr, const char *fmt, ...) BSTR_PRINTF
  * \code
  * bformata(b0 = bfromcstr ("Hello"), ", %s", b1->data);
  * \endcode
+ *
+ * The output is written straight into the spare capacity of bstr, growing it
+ * at most once, so no argument may point into bstr's own buffer.
  */
 BSTR_PUBLIC int b_formata(bstring *bstr, const char *fmt, ...) BSTR_PRINTF(2, 3);
 
@@ -38,6 +38,10 @@
 
 #include "private.h"
 
+#ifndef _WIN32
+#  include <sys/mman.h>
+#endif
+
 #include "bstring.h"
 
 #ifdef BSTR_USE_TALLOC
@@ -158,11 +162,16 @@ b_free(bstring *bstr)
                 /* FATAL_ERROR("bstring runtime error: Attempt to free NULL bstring"); */
 
         if ((!(bstr->flags & BSTR_WRITE_ALLOWED) ||
-              (bstr->flags & BSTR_BASE_MOVED)) && !IS_CLONE(bstr))
+              (bstr->flags & BSTR_BASE_MOVED)) && !IS_CLONE(bstr) && !IS_MAPPED(bstr))
                 return (-1);
                 /* RUNTIME_ERROR(); */
                 /* FATAL_ERROR("bstring runtime error: Attempt to free non-writable which is not a clone"); */
 
+#ifndef _WIN32
+        if (bstr->data && IS_MAPPED(bstr))
+                munmap(bstr->data, bstr->slen);
+        else
+#endif
         if (bstr->data && (bstr->flags & BSTR_DATA_FREEABLE))
                 talloc_free(bstr->data);
 
@@ -788,14 +797,20 @@ b_reada(bstring *bstr, const bNread read_ptr, void *parm)
         if (INVALID(bstr) || NO_WRITE(bstr) || !read_ptr)
                 RUNTIME_ERROR();
 
+        /* Grow geometrically and offer the reader all of the spare room, so a
+         * large input costs O(log n) reallocations and few calls. */
         unsigned i = bstr->slen;
-        for (unsigned n = (i + 16);; n += ((n < BS_BUFF_SZ) ? n : BS_BUFF_SZ)) {
-                if (BSTR_OK != b_alloc(bstr, n + 1))
-                        RUNTIME_ERROR();
-                const int bytes_read = read_ptr((void *)(bstr->data + i), 1, n - i, parm);
-                i += bytes_read;
+        for (;;) {
+                if ((uint64_t)bstr->mlen <= (uint64_t)i + 16U) {
+                        const uint64_t want = MAX((uint64_t)bstr->mlen * 2U, (uint64_t)i + 17U);
+                        if (want >= UINT32_MAX || b_alloc(bstr, (unsigned)want) != BSTR_OK)
+                                RUNTIME_ERROR();
+                }
+                const size_t room       = bstr->mlen - i - 1U;
+                const size_t bytes_read = read_ptr((void *)(bstr->data + i), 1, room, parm);
+                i += (unsigned)bytes_read;
                 bstr->slen = i;
-                if (i < n)
+                if (bytes_read < room)
                         break;
         }
         bstr->data[i] = (uchar)'\0';
@@ -894,6 +909,10 @@ b_gets(const bNgetc getc_ptr, void *parm,
  * leads to the idea that if the retval is larger than n, then changing n to the
  * retval will reduce the number of iterations required. */
 
+/* Output from b_vformata that doesn't fit in place goes here first. */
+#define FORMAT_SCRATCH (1024)
+static _Thread_local char format_scratch[FORMAT_SCRATCH];
+
 
 bstring *
 b_format(const char *const fmt, ...)
@@ -930,11 +949,9 @@ b_formata(bstring *bstr, const char *const fmt, ...)
                 RUNTIME_ERROR();
         va_list va;
         va_start(va, fmt);
-        bstring *buff = b_vformat(fmt, va);
+        const int ret = b_vformata(bstr, fmt, va);
         va_end(va);
 
-        const int ret = b_concat(bstr, buff);
-        b_free(buff);
         return ret;
 }
 
@@ -1017,14 +1034,49 @@ b_vformat_assign(bstring *bstr, const char *const fmt, va_list arglist)
         return ret;
 }
 
+/*
+ * Append without building an intermediate bstring. With plenty of spare room
+ * the output goes straight into it. Otherwise it goes to a per-thread scratch
+ * buffer and is copied over once the destination has grown to fit. Output
+ * that fits in neither is formatted a second time, directly into the
+ * destination after growing it exactly once.
+ */
 int
 b_vformata(bstring *bstr, const char *const fmt, va_list arglist)
 {
-        if (!fmt || NO_WRITE(bstr)) 
+        if (!fmt || INVALID(bstr) || NO_WRITE(bstr))
                 RUNTIME_ERROR();
 
-        bstring  *buff = b_vformat(fmt, arglist);
-        const int ret  = b_concat(bstr, buff);
-        b_free(buff);
-        return ret;
+        const unsigned avail  = (bstr->mlen > bstr->slen) ? bstr->mlen - bstr->slen : 0;
+        const bool     direct = avail >= FORMAT_SCRATCH;
+        const unsigned room   = direct ? avail : FORMAT_SCRATCH;
+        char          *out    = direct ? (char *)bstr->data + bstr->slen : format_scratch;
+        va_list        cpy;
+
+        va_copy(cpy, arglist);
+        const int n = vsnprintf(out, room, fmt, cpy);
+        va_end(cpy);
+
+        if (n < 0 || (unsigned)n >= room) {
+                /* Undo whatever was written over the terminator. */
+                if (direct)
+                        bstr->data[bstr->slen] = (uchar)'\0';
+                if (n < 0 || (uint64_t)bstr->slen + (uint64_t)n >= UINT32_MAX)
+                        RUNTIME_ERROR();
+                if (b_alloc(bstr, bstr->slen + (unsigned)n + 1U) != BSTR_OK)
+                        RUNTIME_ERROR();
+
+                out = (char *)bstr->data + bstr->slen;
+                va_copy(cpy, arglist);
+                vsnprintf(out, (size_t)n + 1U, fmt, cpy);
+                va_end(cpy);
+        } else if (!direct) {
+                if (b_alloc(bstr, bstr->slen + (unsigned)n + 1U) != BSTR_OK)
+                        RUNTIME_ERROR();
+                out = memcpy(bstr->data + bstr->slen, format_scratch, (size_t)n + 1U);
+        }
+
+        /* As before, an embedded '\0' ends the output. */
+        bstr->slen += (unsigned)strlen(out);
+        return BSTR_OK;
 }
@@ -0,0 +1,350 @@
+/*
+ * Segmented string builder. Output is appended into a chain of fixed size
+ * segments, so nothing is ever reallocated or moved while it grows. The result
+ * is either flattened once into a bstring or handed to writev directly.
+ */
+
+#include "private.h"
+
+#ifndef _WIN32
+#  include <sys/uio.h>
+#endif
+
+#include "bstring.h"
+
+#ifdef BSTR_USE_TALLOC
+#  include <talloc.h>
+#  define free talloc_free
+#endif
+
+#define BUILDER_SEGSIZE (65536U)
+
+#ifndef IOV_MAX
+#  define IOV_MAX 1024
+#endif
+
+struct builder_seg {
+        struct builder_seg *next;
+        unsigned            len;
+        unsigned            cap;
+        uchar               data[];
+};
+
+struct b_builder {
+        struct builder_seg *head;
+        struct builder_seg *tail;
+        uint64_t            len;
+        unsigned            segsize;
+        unsigned            reserved;
+};
+
+
+static struct builder_seg *
+builder_push(b_builder *bld, const unsigned need)
+{
+        const unsigned cap = MAX(need, bld->segsize);
+#ifdef BSTR_USE_TALLOC
+        struct builder_seg *seg = talloc_size(bld, sizeof(struct builder_seg) + cap);
+#else
+        struct builder_seg *seg = malloc(sizeof(struct builder_seg) + cap);
+#endif
+        if (!seg)
+                FATAL_ERROR("Out of memory");
+
+        seg->next = NULL;
+        seg->len  = 0;
+        seg->cap  = cap;
+
+        if (bld->tail)
+                bld->tail->next = seg;
+        else
+                bld->head = seg;
+        bld->tail = seg;
+
+        return seg;
+}
+
+
+b_builder *
+b_builder_create(const unsigned segsize)
+{
+#ifdef BSTR_USE_TALLOC
+        b_builder *bld = talloc(NULL, b_builder);
+#else
+        b_builder *bld = malloc(sizeof(b_builder));
+#endif
+        bld->head     = bld->tail = NULL;
+        bld->len      = 0;
+        bld->segsize  = segsize ? segsize : BUILDER_SEGSIZE;
+        bld->reserved = 0;
+
+        return bld;
+}
+
+
+void
+b_builder_reset(b_builder *bld)
+{
+        if (!bld || !bld->head)
+                return;
+
+        /* Keep the first segment around for reuse. */
+        struct builder_seg *seg = bld->head->next;
+        while (seg) {
+                struct builder_seg *next = seg->next;
+                free(seg);
+                seg = next;
+        }
+
+        bld->head->next = NULL;
+        bld->head->len  = 0;
+        bld->tail       = bld->head;
+        bld->len        = 0;
+        bld->reserved   = 0;
+}
+
+
+void
+b_builder_destroy(b_builder *bld)
+{
+        if (!bld)
+                return;
+
+        struct builder_seg *seg = bld->head;
+        while (seg) {
+                struct builder_seg *next = seg->next;
+                free(seg);
+                seg = next;
+        }
+        free(bld);
+}
+
+
+uint64_t
+b_builder_len(const b_builder *bld)
+{
+        return bld ? bld->len : 0;
+}
+
+
+/*============================================================================*/
+/* Appending */
+/*============================================================================*/
+
+
+int
+b_builder_append_blk(b_builder *bld, const void *blk, unsigned len)
+{
+        if (!bld || (!blk && len > 0))
+                RUNTIME_ERROR();
+
+        const uchar        *src = blk;
+        struct builder_seg *seg = bld->tail;
+        bld->len += len;
+
+        /* Fill whatever is left of the current segment, then spill the rest
+         * into a single new one. */
+        if (seg && seg->len < seg->cap) {
+                const unsigned n = MIN(len, seg->cap - seg->len);
+                memcpy(seg->data + seg->len, src, n);
+                seg->len += n;
+                src      += n;
+                len      -= n;
+        }
+        if (len > 0) {
+                seg = builder_push(bld, len);
+                memcpy(seg->data, src, len);
+                seg->len = len;
+        }
+
+        return BSTR_OK;
+}
+
+
+int
+b_builder_append(b_builder *bld, const bstring *bstr)
+{
+        if (INVALID(bstr))
+                RUNTIME_ERROR();
+
+        return b_builder_append_blk(bld, bstr->data, bstr->slen);
+}
+
+
+int
+b_builder_append_char(b_builder *bld, const int ch)
+{
+        if (!bld)
+                RUNTIME_ERROR();
+
+        struct builder_seg *seg = bld->tail;
+        if (!seg || seg->len == seg->cap)
+                seg = builder_push(bld, 1);
+
+        seg->data[seg->len++] = (uchar)ch;
+        ++bld->len;
+
+        return BSTR_OK;
+}
+
+
+uchar *
+b_builder_reserve(b_builder *bld, const unsigned len)
+{
+        if (!bld || len == 0)
+                RETURN_NULL();
+
+        struct builder_seg *seg = bld->tail;
+        if (!seg || seg->cap - seg->len < len)
+                seg = builder_push(bld, len);
+
+        bld->reserved = len;
+        return seg->data + seg->len;
+}
+
+
+int
+b_builder_commit(b_builder *bld, const unsigned len)
+{
+        if (!bld || len > bld->reserved)
+                RUNTIME_ERROR();
+
+        bld->tail->len += len;
+        bld->len       += len;
+        bld->reserved   = 0;
+
+        return BSTR_OK;
+}
+
+
+/*
+ * Formatting goes straight into the spare room of the current segment. Only
+ * when that is too small is the output formatted a second time, into a
+ * segment of exactly the right size.
+ */
+int
+b_builder_vformat(b_builder *bld, const char *fmt, va_list args)
+{
+        if (!bld || !fmt)
+                RUNTIME_ERROR();
+
+        struct builder_seg *seg   = bld->tail;
+        unsigned            avail = seg ? seg->cap - seg->len : 0;
+        va_list             cpy;
+        int                 n;
+
+        va_copy(cpy, args);
+        n = vsnprintf(avail ? (char *)seg->data + seg->len : NULL, avail, fmt, cpy);
+        va_end(cpy);
+
+        if (n < 0)
+                RUNTIME_ERROR();
+
+        /* vsnprintf needs room for its terminator, which we don't keep. */
+        if ((unsigned)n >= avail) {
+                seg = builder_push(bld, (unsigned)n + 1U);
+                va_copy(cpy, args);
+                vsnprintf((char *)seg->data, (size_t)n + 1U, fmt, cpy);
+                va_end(cpy);
+        }
+
+        seg->len += (unsigned)n;
+        bld->len += (unsigned)n;
+
+        return BSTR_OK;
+}
+
+
+int
+b_builder_format(b_builder *bld, const char *fmt, ...)
+{
+        va_list va;
+        va_start(va, fmt);
+        const int ret = b_builder_vformat(bld, fmt, va);
+        va_end(va);
+
+        return ret;
+}
+
+
+/*============================================================================*/
+/* Output */
+/*============================================================================*/
+
+
+bstring *
+b_builder_flatten(const b_builder *bld)
+{
+        if (!bld || bld->len >= UINT32_MAX)
+                RETURN_NULL();
+
+        bstring *ret = b_create((unsigned)bld->len);
+
+        for (const struct builder_seg *seg = bld->head; seg; seg = seg->next) {
+                memcpy(ret->data + ret->slen, seg->data, seg->len);
+                ret->slen += seg->len;
+        }
+        ret->data[ret->slen] = (uchar)'\0';
+
+        return ret;
+}
+
+
+#ifndef _WIN32
+/*
+ * Write every segment with as few writev calls as possible, at most IOV_MAX
+ * segments at a time. Short writes are resumed from where they stopped.
+ */
+int64_t
+b_builder_write_fd(const b_builder *bld, const int fd)
+{
+        if (!bld || fd < 0)
+                RUNTIME_ERROR();
+
+        const struct builder_seg *seg = bld->head;
+        struct iovec              iov[IOV_MAX];
+        int64_t                   total = 0;
+
+        while (seg) {
+                int cnt = 0;
+                for (; seg && cnt < IOV_MAX; seg = seg->next) {
+                        if (seg->len == 0)
+                                continue;
+                        iov[cnt].iov_base = (void *)seg->data;
+                        iov[cnt].iov_len  = seg->len;
+                        ++cnt;
+                }
+
+                const int64_t n = BSTRING_writev(fd, iov, cnt);
+                if (n < 0)
+                        RUNTIME_ERROR();
+                total += n;
+        }
+
+        return total;
+}
+
+#else
+
+int64_t
+b_builder_write_fd(const b_builder *bld, const int fd)
+{
+        if (!bld || fd < 0)
+                RUNTIME_ERROR();
+
+        int64_t total = 0;
+
+        for (const struct builder_seg *seg = bld->head; seg; seg = seg->next) {
+                unsigned off = 0;
+                while (off < seg->len) {
+                        const int n = write(fd, seg->data + off, seg->len - off);
+                        if (n < 0)
+                                RUNTIME_ERROR();
+                        off += (unsigned)n;
+                }
+                total += seg->len;
+        }
+
+        return total;
+}
+#endif
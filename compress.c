@@ -0,0 +1,643 @@
+/*
+ * LZ compression for bstrings. The block format is LZ4's: a token whose high
+ * nibble is a literal count and low nibble a match length, the literals, then
+ * a two byte little endian offset, with 15 in either nibble meaning that more
+ * length bytes follow. Compression is a single greedy pass with a small hash
+ * table of recent positions, and decompression is a tight copy loop, so both
+ * run at memory speed rather than entropy coder speed. b_compress prefixes
+ * the block with the uncompressed length as four little endian bytes.
+ *
+ * A b_packed holds a string (or a whole list) in that form and inflates it
+ * on first access, so cold data can be kept compressed behind a handle. The
+ * compressed bytes are never stored in a bstring, since every bstring user
+ * reads ->data directly.
+ */
+
+#include "private.h"
+
+#include "bstring.h"
+
+#ifdef BSTR_USE_TALLOC
+#  include <talloc.h>
+#  define free talloc_free
+#endif
+
+#define LZ_HASHLOG      (12)
+#define LZ_MINMATCH     (4U)
+#define LZ_LASTLITERALS (5U)  /* The last bytes are always literals... */
+#define LZ_MFLIMIT      (12U) /* ...and no match starts this close to the end. */
+#define LZ_MAXOFFSET    (65535U)
+#define LZ_HEADER       (4U)
+
+/* Strings shorter than this aren't worth packing. */
+#define COMPRESS_MIN    (64U)
+
+#define LZ_BOUND(LEN) ((LEN) + (LEN) / 255U + 16U)
+
+static inline uint32_t
+lz_read32(const uchar *p)
+{
+        uint32_t v;
+        memcpy(&v, p, sizeof v);
+        return v;
+}
+
+
+static inline unsigned
+lz_hash(const uint32_t seq)
+{
+        return (seq * 2654435761U) >> (32 - LZ_HASHLOG);
+}
+
+
+static inline uchar *
+lz_put_length(uchar *op, unsigned len)
+{
+        while (len >= 255U) {
+                *op++ = 255;
+                len  -= 255U;
+        }
+        *op++ = (uchar)len;
+        return op;
+}
+
+
+/*
+ * Length of the common prefix of a and b, not reading past limit, compared a
+ * word at a time where the byte order allows.
+ */
+static inline unsigned
+lz_match_len(const uchar *a, const uchar *b, const uchar *limit)
+{
+        const uchar *start = a;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        while (a + 8 <= limit) {
+                uint64_t x, y;
+                memcpy(&x, a, 8);
+                memcpy(&y, b, 8);
+                if (x != y)
+                        return (unsigned)PTRSUB(a, start) + ((unsigned)__builtin_ctzll(x ^ y) >> 3);
+                a += 8;
+                b += 8;
+        }
+#endif
+        while (a < limit && *a == *b) {
+                ++a;
+                ++b;
+        }
+
+        return (unsigned)PTRSUB(a, start);
+}
+
+
+static uchar *
+lz_put_sequence(uchar *op, const uchar *lit, const unsigned nlit,
+                const unsigned offset, const unsigned mlen)
+{
+        uchar *token = op++;
+
+        if (nlit >= 15U) {
+                *token = 15U << 4;
+                op     = lz_put_length(op, nlit - 15U);
+        } else {
+                *token = (uchar)(nlit << 4);
+        }
+        memcpy(op, lit, nlit);
+        op += nlit;
+
+        if (mlen == 0)
+                return op;
+
+        *op++ = (uchar)(offset & 0xFFU);
+        *op++ = (uchar)(offset >> 8);
+
+        const unsigned ml = mlen - LZ_MINMATCH;
+        if (ml >= 15U) {
+                *token |= 15U;
+                op      = lz_put_length(op, ml - 15U);
+        } else {
+                *token |= (uchar)ml;
+        }
+
+        return op;
+}
+
+
+/*
+ * Compress len bytes into dst, which must hold LZ_BOUND(len) bytes. Returns
+ * the compressed length.
+ */
+static unsigned
+lz_compress_block(const uchar *src, const unsigned len, uchar *dst)
+{
+        uint32_t     table[1U << LZ_HASHLOG];
+        const uchar *ip     = src;
+        const uchar *anchor = src;
+        const uchar *iend   = src + len;
+        uchar       *op     = dst;
+
+        if (len > LZ_MFLIMIT) {
+                const uchar *mflimit    = iend - LZ_MFLIMIT;
+                const uchar *matchlimit = iend - LZ_LASTLITERALS;
+
+                memset(table, 0, sizeof table);
+                ++ip;
+
+                while (ip < mflimit) {
+                        const uint32_t seq = lz_read32(ip);
+                        const unsigned h   = lz_hash(seq);
+                        const uchar   *ref = src + table[h];
+                        table[h]           = (uint32_t)PTRSUB(ip, src);
+
+                        if (ref >= ip || PTRSUB(ip, ref) > LZ_MAXOFFSET || lz_read32(ref) != seq) {
+                                /* Step faster through data that isn't matching. */
+                                ip += 1 + (PTRSUB(ip, anchor) >> 6);
+                                continue;
+                        }
+
+                        while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                                --ip;
+                                --ref;
+                        }
+
+                        const unsigned mlen = LZ_MINMATCH +
+                            lz_match_len(ip + LZ_MINMATCH, ref + LZ_MINMATCH, matchlimit);
+
+                        op     = lz_put_sequence(op, anchor, (unsigned)PTRSUB(ip, anchor),
+                                                 (unsigned)PTRSUB(ip, ref), mlen);
+                        ip    += mlen;
+                        anchor = ip;
+
+                        if (ip < mflimit)
+                                table[lz_hash(lz_read32(ip - 2))] = (uint32_t)PTRSUB(ip - 2, src);
+                }
+        }
+
+        op = lz_put_sequence(op, anchor, (unsigned)PTRSUB(iend, anchor), 0, 0);
+        return (unsigned)PTRSUB(op, dst);
+}
+
+
+/*
+ * Decompress exactly dlen bytes into dst, checking every length and offset
+ * against both buffers so that corrupt input can't overrun anything.
+ */
+static int
+lz_decompress_block(const uchar *src, const unsigned slen, uchar *dst, const unsigned dlen)
+{
+        const uchar *ip   = src;
+        const uchar *iend = src + slen;
+        uchar       *op   = dst;
+        uchar       *oend = dst + dlen;
+
+        for (;;) {
+                if (ip >= iend)
+                        return BSTR_ERR;
+
+                const unsigned token = *ip++;
+                size_t         nlit  = token >> 4;
+
+                if (nlit == 15U) {
+                        unsigned b;
+                        do {
+                                if (ip >= iend)
+                                        return BSTR_ERR;
+                                b     = *ip++;
+                                nlit += b;
+                        } while (b == 255U);
+                }
+                if (nlit > (size_t)PTRSUB(iend, ip) || nlit > (size_t)PTRSUB(oend, op))
+                        return BSTR_ERR;
+                /* Most literal runs are short: copy a fixed 16 bytes when both
+                 * buffers have room for the overshoot. */
+                if (nlit <= 16 && PTRSUB(iend, ip) >= 16 && PTRSUB(oend, op) >= 16)
+                        memcpy(op, ip, 16);
+                else
+                        memcpy(op, ip, nlit);
+                op += nlit;
+                ip += nlit;
+
+                /* The last sequence has literals only. */
+                if (ip == iend)
+                        break;
+                if (PTRSUB(iend, ip) < 2)
+                        return BSTR_ERR;
+
+                const size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+                ip += 2;
+                if (offset == 0 || offset > (size_t)PTRSUB(op, dst))
+                        return BSTR_ERR;
+
+                size_t mlen = token & 15U;
+                if (mlen == 15U) {
+                        unsigned b;
+                        do {
+                                if (ip >= iend)
+                                        return BSTR_ERR;
+                                b     = *ip++;
+                                mlen += b;
+                        } while (b == 255U);
+                }
+                mlen += LZ_MINMATCH;
+                if (mlen > (size_t)PTRSUB(oend, op))
+                        return BSTR_ERR;
+
+                const uchar *match = op - offset;
+                if (offset >= 16 && (size_t)PTRSUB(oend, op) >= mlen + 16) {
+                        /* Whole 16 byte chunks, overshooting into space that
+                         * later sequences overwrite. */
+                        for (size_t i = 0; i < mlen; i += 16)
+                                memcpy(op + i, match + i, 16);
+                } else if (offset >= mlen) {
+                        memcpy(op, match, mlen);
+                } else if (offset >= 8) {
+                        /* Overlapping, but each 8 byte chunk is already complete. */
+                        size_t i = 0;
+                        for (; i + 8 <= mlen; i += 8)
+                                memcpy(op + i, match + i, 8);
+                        for (; i < mlen; ++i)
+                                op[i] = match[i];
+                } else {
+                        for (size_t i = 0; i < mlen; ++i)
+                                op[i] = match[i];
+                }
+                op += mlen;
+        }
+
+        return op == oend ? BSTR_OK : BSTR_ERR;
+}
+
+
+/*
+ * Compress into a new buffer, trimmed to size, with the length header.
+ * Returns its size in *outlen.
+ */
+static uchar *
+lz_compress(const void *ctx, const uchar *src, const unsigned len, unsigned *outlen)
+{
+        const uint64_t bound = LZ_HEADER + LZ_BOUND((uint64_t)len);
+        if (bound >= UINT32_MAX)
+                return NULL;
+
+#ifdef BSTR_USE_TALLOC
+        uchar *buf = talloc_size(ctx, bound);
+#else
+        (void)ctx;
+        uchar *buf = malloc(bound);
+#endif
+        buf[0] = (uchar)(len & 0xFFU);
+        buf[1] = (uchar)((len >> 8) & 0xFFU);
+        buf[2] = (uchar)((len >> 16) & 0xFFU);
+        buf[3] = (uchar)(len >> 24);
+
+        *outlen = LZ_HEADER + lz_compress_block(src, len, buf + LZ_HEADER);
+#ifdef BSTR_USE_TALLOC
+        return talloc_realloc_size(ctx, buf, *outlen + 1U);
+#else
+        return realloc(buf, *outlen + 1U);
+#endif
+}
+
+
+/*============================================================================*/
+
+
+bstring *
+b_compress(const bstring *src)
+{
+        if (INVALID(src))
+                RETURN_NULL();
+
+#ifdef BSTR_USE_TALLOC
+        bstring *ret = talloc(NULL, bstring);
+#else
+        bstring *ret = malloc(sizeof *ret);
+#endif
+        unsigned n;
+        ret->data = lz_compress(ret, src->data, src->slen, &n);
+        if (!ret->data) {
+                free(ret);
+                RETURN_NULL();
+        }
+        ret->data[n] = (uchar)'\0';
+        ret->slen    = n;
+        ret->mlen    = n + 1U;
+        ret->flags   = BSTR_STANDARD;
+#ifdef BSTR_USE_TALLOC
+        talloc_set_destructor(ret, b_free);
+#endif
+
+        return ret;
+}
+
+
+/*
+ * Input that isn't the output of b_compress is an expected failure, reported
+ * as NULL with errno set to EINVAL.
+ */
+bstring *
+b_decompress(const bstring *src)
+{
+        if (INVALID(src))
+                RETURN_NULL();
+        if (src->slen <= LZ_HEADER) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        const unsigned len = (unsigned)src->data[0] | ((unsigned)src->data[1] << 8) |
+                             ((unsigned)src->data[2] << 16) | ((unsigned)src->data[3] << 24);
+        /* No LZ4 sequence expands by more than 255 bytes per input byte, so
+         * a larger claimed length is corrupt and must not be allocated. */
+        if (len == UINT32_MAX ||
+            len > (uint64_t)(src->slen - LZ_HEADER) * 255U + 16U) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        bstring *ret = b_create(len);
+        if (lz_decompress_block(src->data + LZ_HEADER, src->slen - LZ_HEADER,
+                                ret->data, len) != BSTR_OK) {
+                b_free(ret);
+                errno = EINVAL;
+                return NULL;
+        }
+        ret->data[len] = (uchar)'\0';
+        ret->slen      = len;
+
+        return ret;
+}
+
+
+/*============================================================================*/
+/* Packed strings */
+/*============================================================================*/
+
+/*
+ * A packed string holds a compressed copy of a bstring and inflates it on
+ * first access. The compressed bytes live here and never in a bstring, so no
+ * bstring can be read while it holds compressed data. The compressed copy is
+ * kept after inflation so that b_packed_evict can drop the plain one again.
+ * Strings that are short or don't shrink are just kept plain.
+ */
+struct b_packed {
+        bstring        *plain;
+        uchar          *comp;
+        unsigned        clen;
+        unsigned        len;
+        bool            is_list;
+        pthread_mutex_t lock;
+};
+
+
+static b_packed *
+packed_new(const uchar *data, const unsigned len, const bool is_list)
+{
+#ifdef BSTR_USE_TALLOC
+        b_packed *pk = talloc(NULL, b_packed);
+#else
+        b_packed *pk = malloc(sizeof(b_packed));
+#endif
+        pk->plain   = NULL;
+        pk->comp    = NULL;
+        pk->clen    = 0;
+        pk->len     = len;
+        pk->is_list = is_list;
+        pthread_mutex_init(&pk->lock, NULL);
+
+        if (len >= COMPRESS_MIN) {
+                unsigned n;
+                uchar   *buf = lz_compress(NULL, data, len, &n);
+                if (buf && n < len) {
+                        pk->comp = buf;
+                        pk->clen = n;
+                        return pk;
+                }
+                if (buf)
+                        free(buf);
+        }
+
+        pk->plain = b_fromblk(data, len);
+        return pk;
+}
+
+
+static bstring *
+packed_inflate(const b_packed *pk)
+{
+        bstring *ret = b_create(pk->len);
+        if (lz_decompress_block(pk->comp + LZ_HEADER, pk->clen - LZ_HEADER,
+                                ret->data, pk->len) != BSTR_OK) {
+                b_free(ret);
+                return NULL;
+        }
+        ret->data[pk->len] = (uchar)'\0';
+        ret->slen          = pk->len;
+
+        return ret;
+}
+
+
+/*
+ * Several threads may ask for the same string at once, so inflation happens
+ * under the packed string's lock, and the result is published with release
+ * ordering for the unlocked fast path.
+ */
+static bstring *
+packed_get(b_packed *pk)
+{
+        bstring *plain = __atomic_load_n(&pk->plain, __ATOMIC_ACQUIRE);
+        if (plain)
+                return plain;
+
+        pthread_mutex_lock(&pk->lock);
+        plain = pk->plain;
+        if (!plain) {
+                plain = packed_inflate(pk);
+                __atomic_store_n(&pk->plain, plain, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&pk->lock);
+
+        return plain;
+}
+
+
+b_packed *
+b_pack(const bstring *src)
+{
+        if (INVALID(src))
+                RETURN_NULL();
+
+        return packed_new(src->data, src->slen, false);
+}
+
+
+const bstring *
+b_packed_get(b_packed *pk)
+{
+        if (!pk || pk->is_list)
+                RETURN_NULL();
+
+        const bstring *ret = packed_get(pk);
+        if (!ret)
+                RETURN_NULL();
+        return ret;
+}
+
+
+bstring *
+b_unpack(b_packed *pk)
+{
+        if (!pk || pk->is_list)
+                RETURN_NULL();
+
+        bstring *ret = packed_get(pk);
+        if (!ret)
+                RETURN_NULL();
+        pk->plain = NULL;
+        b_packed_destroy(pk);
+
+        return ret;
+}
+
+
+void
+b_packed_evict(b_packed *pk)
+{
+        if (!pk || !pk->comp || !pk->plain)
+                return;
+        b_free(pk->plain);
+        pk->plain = NULL;
+}
+
+
+void
+b_packed_destroy(b_packed *pk)
+{
+        if (!pk)
+                return;
+        if (pk->plain)
+                b_free(pk->plain);
+        if (pk->comp)
+                free(pk->comp);
+        pthread_mutex_destroy(&pk->lock);
+        free(pk);
+}
+
+
+unsigned
+b_packed_len(const b_packed *pk)
+{
+        return (pk && !pk->is_list) ? pk->len : 0;
+}
+
+
+uint64_t
+b_packed_size(const b_packed *pk)
+{
+        if (!pk)
+                return 0;
+
+        const bstring *plain = __atomic_load_n(&pk->plain, __ATOMIC_ACQUIRE);
+        return sizeof(b_packed) + (pk->comp ? pk->clen + 1U : 0U) + (plain ? plain->mlen : 0U);
+}
+
+
+/*============================================================================*/
+/* Packed lists */
+/*============================================================================*/
+
+/*
+ * A whole list is packed as one block, which compresses many short strings
+ * far better than packing them one by one: the element count and lengths
+ * (UINT32_MAX for a NULL element) as little endian 32 bit words, then the
+ * contents back to back.
+ */
+static inline void
+packed_put32(uchar *p, const uint32_t v)
+{
+        p[0] = (uchar)(v & 0xFFU);
+        p[1] = (uchar)((v >> 8) & 0xFFU);
+        p[2] = (uchar)((v >> 16) & 0xFFU);
+        p[3] = (uchar)(v >> 24);
+}
+
+
+static inline uint32_t
+packed_get32(const uchar *p)
+{
+        return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+b_packed *
+b_pack_list(const b_list *list)
+{
+        if (!list || !list->lst)
+                RETURN_NULL();
+
+        uint64_t total = 4U + (uint64_t)list->qty * 4U;
+        for (unsigned i = 0; i < list->qty; ++i)
+                if (!INVALID(list->lst[i]))
+                        total += list->lst[i]->slen;
+        if (total >= UINT32_MAX)
+                RETURN_NULL();
+
+        bstring *blob = b_create((unsigned)total);
+        uchar   *lens = blob->data + 4;
+        uchar   *out  = lens + (size_t)list->qty * 4U;
+
+        packed_put32(blob->data, list->qty);
+        for (unsigned i = 0; i < list->qty; ++i) {
+                const bstring *elem = list->lst[i];
+                if (INVALID(elem)) {
+                        packed_put32(lens + (size_t)i * 4U, UINT32_MAX);
+                        continue;
+                }
+                packed_put32(lens + (size_t)i * 4U, elem->slen);
+                memcpy(out, elem->data, elem->slen);
+                out += elem->slen;
+        }
+        blob->slen = (unsigned)total;
+
+        b_packed *pk = packed_new(blob->data, blob->slen, true);
+        b_free(blob);
+        return pk;
+}
+
+
+/*
+ * The list isn't cached: every call inflates the block into a new list, and
+ * the packed list stays compressed.
+ */
+b_list *
+b_unpack_list(const b_packed *pk)
+{
+        if (!pk || !pk->is_list)
+                RETURN_NULL();
+
+        bstring *blob = pk->plain ? NULL : packed_inflate(pk);
+        const bstring *src = pk->plain ? pk->plain : blob;
+        if (!src)
+                RETURN_NULL();
+
+        const uchar   *lens = src->data + 4;
+        const unsigned qty  = packed_get32(src->data);
+        const uchar   *in   = lens + (size_t)qty * 4U;
+        b_list        *ret  = b_list_create_alloc(MAX(qty, 1U));
+
+        for (unsigned i = 0; i < qty; ++i) {
+                const uint32_t len = packed_get32(lens + (size_t)i * 4U);
+                if (len == UINT32_MAX) {
+                        b_list_append(ret, NULL);
+                        continue;
+                }
+                b_list_append(ret, b_fromblk(in, len));
+                in += len;
+        }
+
+        if (blob)
+                b_free(blob);
+        return ret;
+}
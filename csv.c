@@ -0,0 +1,335 @@
+/*
+ * Streaming RFC 4180 CSV/TSV parser. Fields are returned as static bstring
+ * views into the source buffer; only fields containing doubled quotes are
+ * copied (unescaped) into a per-record scratch buffer.
+ */
+
+#include "private.h"
+
+#include "bstring.h"
+
+#ifdef BSTR_USE_TALLOC
+#  include <talloc.h>
+#  define free talloc_free
+#endif
+
+#define CSV_INIT_READ (65536U)
+
+enum csv_status { CSV_DONE, CSV_MORE, CSV_BAD };
+
+struct csv_field {
+        unsigned off;
+        unsigned len;
+        bool     scratch;
+};
+
+struct b_csv {
+        const uchar      *data;
+        unsigned          len;
+        unsigned          pos;
+        int               fd;
+        bool              eof;
+        uchar             delim;
+        uchar             quote;
+        unsigned          flags;
+        uint64_t          recno;
+        bstring          *buf;
+        bstring          *scratch;
+        struct csv_field *raw;
+        bstring          *fields;
+        unsigned          nfields;
+        unsigned          mfields;
+        struct b_charset  structural;
+};
+
+
+static b_csv *
+csv_new(const int delim, const unsigned flags)
+{
+#ifdef BSTR_USE_TALLOC
+        b_csv *csv  = talloc_zero(NULL, b_csv);
+        csv->raw    = talloc_array(csv, struct csv_field, 16);
+        csv->fields = talloc_array(csv, bstring, 16);
+#else
+        b_csv *csv  = calloc(1, sizeof(b_csv));
+        csv->raw    = nmalloc(16, sizeof(struct csv_field));
+        csv->fields = nmalloc(16, sizeof(bstring));
+#endif
+        const uchar set[3] = {(uchar)delim, '\n', '\r'};
+
+        csv->fd      = (-1);
+        csv->delim   = (uchar)delim;
+        csv->quote   = '"';
+        csv->flags   = flags;
+        csv->mfields = 16;
+        csv->scratch = b_create(128);
+        BSTRING_charset_init(&csv->structural, set, 3);
+
+        return csv;
+}
+
+
+b_csv *
+b_csv_open(const bstring *src, const int delim, const unsigned flags)
+{
+        if (INVALID(src) || delim == '\n' || delim == '\r')
+                RETURN_NULL();
+
+        b_csv *csv = csv_new(delim, flags);
+        csv->data  = src->data;
+        csv->len   = src->slen;
+        csv->eof   = true;
+
+        return csv;
+}
+
+
+b_csv *
+b_csv_open_fd(const int fd, const int delim, const unsigned flags)
+{
+        if (fd < 0 || delim == '\n' || delim == '\r')
+                RETURN_NULL();
+
+        b_csv *csv = csv_new(delim, flags);
+        csv->fd    = fd;
+        csv->buf   = b_create(CSV_INIT_READ);
+        csv->data  = csv->buf->data;
+
+        return csv;
+}
+
+
+void
+b_csv_close(b_csv *csv)
+{
+        if (!csv)
+                return;
+        if (csv->buf)
+                b_free(csv->buf);
+        b_free(csv->scratch);
+        free(csv->raw);
+        free(csv->fields);
+        free(csv);
+}
+
+
+uint64_t
+b_csv_recno(const b_csv *csv)
+{
+        return csv ? csv->recno : 0;
+}
+
+
+/*
+ * Discard everything before the start of the current record and read more
+ * data behind it. The buffer is doubled whenever less than a quarter of it is
+ * free, so a single record larger than the buffer costs O(log n) rescans.
+ */
+static int
+csv_fill(b_csv *csv)
+{
+        bstring *buf = csv->buf;
+
+        if (csv->pos > 0) {
+                memmove(buf->data, buf->data + csv->pos, csv->len - csv->pos);
+                csv->len -= csv->pos;
+                csv->pos  = 0;
+        }
+        if ((buf->mlen - 1U) - csv->len < buf->mlen / 4U) {
+                buf->slen = csv->len;
+                if (b_alloc(buf, buf->mlen * 2U) != BSTR_OK)
+                        RUNTIME_ERROR();
+        }
+
+        ssize_t nread;
+        do
+                nread = read(csv->fd, buf->data + csv->len, (buf->mlen - 1U) - csv->len);
+        while (nread < 0 && errno == EINTR);
+
+        if (nread < 0)
+                RUNTIME_ERROR();
+        if (nread == 0)
+                csv->eof = true;
+
+        csv->len += (unsigned)nread;
+        buf->slen = csv->len;
+        csv->data = buf->data;
+
+        return BSTR_OK;
+}
+
+
+static void
+csv_push(b_csv *csv, const unsigned off, const unsigned len, const bool scratch)
+{
+        if (csv->nfields >= csv->mfields) {
+                csv->mfields *= 2;
+#ifdef BSTR_USE_TALLOC
+                csv->raw    = talloc_realloc(csv, csv->raw, struct csv_field, csv->mfields);
+                csv->fields = talloc_realloc(csv, csv->fields, bstring, csv->mfields);
+#else
+                csv->raw    = nrealloc(csv->raw, csv->mfields, sizeof(struct csv_field));
+                csv->fields = nrealloc(csv->fields, csv->mfields, sizeof(bstring));
+#endif
+        }
+        csv->raw[csv->nfields++] = (struct csv_field){off, len, scratch};
+}
+
+
+static enum csv_status
+csv_quoted(b_csv *csv, const uchar **ptrp, const uchar *const end)
+{
+        bstring     *scratch    = csv->scratch;
+        const uchar *start      = *ptrp + 1;
+        const uchar *ptr        = start;
+        const uchar *close      = NULL;
+        bool         in_scratch = false;
+        unsigned     soff       = 0;
+
+        for (;;) {
+                const uchar *q = memchr(ptr, csv->quote, (size_t)(end - ptr));
+
+                if (!q) {
+                        if (!csv->eof)
+                                return CSV_MORE;
+                        if (csv->flags & B_CSV_STRICT)
+                                return CSV_BAD;
+                        q = end;
+                } else if (q + 1 == end && !csv->eof) {
+                        return CSV_MORE;
+                } else if (q + 1 < end && q[1] == csv->quote) {
+                        /* Doubled quote: from here on the field needs a copy. */
+                        if (!in_scratch) {
+                                soff       = scratch->slen;
+                                in_scratch = true;
+                        }
+                        b_catblk(scratch, ptr, (unsigned)PTRSUB(q + 1, ptr));
+                        ptr = q + 2;
+                        continue;
+                }
+
+                if (in_scratch)
+                        b_catblk(scratch, ptr, (unsigned)PTRSUB(q, ptr));
+                close = q;
+                ptr   = (q < end) ? q + 1 : end;
+                break;
+        }
+
+        if (ptr < end && *ptr != csv->delim && *ptr != '\n' && *ptr != '\r') {
+                if (csv->flags & B_CSV_STRICT)
+                        return CSV_BAD;
+
+                /* Lenient: keep any stray text up to the next delimiter. */
+                const uchar *next = BSTRING_charset_find(&csv->structural, ptr, end);
+                if (!next) {
+                        if (!csv->eof)
+                                return CSV_MORE;
+                        next = end;
+                }
+                if (!in_scratch) {
+                        soff       = scratch->slen;
+                        in_scratch = true;
+                        b_catblk(scratch, start, (unsigned)PTRSUB(close, start));
+                }
+                b_catblk(scratch, ptr, (unsigned)PTRSUB(next, ptr));
+                ptr = next;
+        }
+
+        if (in_scratch)
+                csv_push(csv, soff, scratch->slen - soff, true);
+        else
+                csv_push(csv, (unsigned)PTRSUB(start, csv->data),
+                         (unsigned)PTRSUB(close, start), false);
+
+        *ptrp = ptr;
+        return CSV_DONE;
+}
+
+
+static enum csv_status
+csv_record(b_csv *csv)
+{
+        const uchar *const end = csv->data + csv->len;
+        const uchar       *ptr = csv->data + csv->pos;
+
+        csv->nfields       = 0;
+        csv->scratch->slen = 0;
+
+        for (;;) {
+                if (ptr < end && *ptr == csv->quote && !(csv->flags & B_CSV_NOQUOTE)) {
+                        const enum csv_status st = csv_quoted(csv, &ptr, end);
+                        if (st != CSV_DONE)
+                                return st;
+                } else {
+                        const uchar *next = BSTRING_charset_find(&csv->structural, ptr, end);
+                        if (!next) {
+                                if (!csv->eof)
+                                        return CSV_MORE;
+                                next = end;
+                        }
+                        csv_push(csv, (unsigned)PTRSUB(ptr, csv->data),
+                                 (unsigned)PTRSUB(next, ptr), false);
+                        ptr = next;
+                }
+
+                if (ptr == end) {
+                        if (!csv->eof)
+                                return CSV_MORE;
+                        break;
+                }
+                if (*ptr == csv->delim) {
+                        ++ptr;
+                        continue;
+                }
+                if (*ptr == '\r') {
+                        if (ptr + 1 == end && !csv->eof)
+                                return CSV_MORE;
+                        if (++ptr < end && *ptr == '\n')
+                                ++ptr;
+                } else {
+                        ++ptr;
+                }
+                break;
+        }
+
+        csv->pos = (unsigned)PTRSUB(ptr, csv->data);
+        return CSV_DONE;
+}
+
+
+int
+b_csv_next(b_csv *csv, bstring **fields)
+{
+        if (!csv || !fields)
+                RUNTIME_ERROR();
+
+        for (;;) {
+                if (csv->pos >= csv->len) {
+                        if (csv->eof)
+                                return 0;
+                        if (csv_fill(csv) != BSTR_OK)
+                                RUNTIME_ERROR();
+                        continue;
+                }
+
+                const enum csv_status st = csv_record(csv);
+                if (st == CSV_BAD)
+                        RUNTIME_ERROR();
+                if (st == CSV_DONE)
+                        break;
+                if (csv_fill(csv) != BSTR_OK)
+                        RUNTIME_ERROR();
+        }
+
+        /* The scratch buffer may have moved while the record was parsed, so
+         * the views are only materialized once it is complete. */
+        for (unsigned i = 0; i < csv->nfields; ++i) {
+                const struct csv_field *f = &csv->raw[i];
+                const uchar *base = f->scratch ? csv->scratch->data : csv->data;
+                csv->fields[i] = bt_fromblk(base + f->off, f->len);
+        }
+
+        ++csv->recno;
+        *fields = csv->fields;
+        return (int)csv->nfields;
+}
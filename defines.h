@@ -63,6 +63,7 @@ enum BSTR_flags {
         BSTR_BASE_MOVED    = 0x20U,
         BSTR_MASK_USR2     = 0x40U,
         BSTR_MASK_USR1     = 0x80U,
+        BSTR_MAPPED        = 0x100U,
 };
 
 #define BSTR_STANDARD (BSTR_WRITE_ALLOWED | BSTR_FREEABLE | BSTR_DATA_FREEABLE)
@@ -0,0 +1,1988 @@
+/*
+ * The bstring printf analogues. A format is compiled once into a program of
+ * literal spans and typed argument slots. Running a program measures every
+ * argument exactly once, allocates the exact output size, and then copies.
+ *
+ * Conversions:
+ *   %s      bstring *        (NULL prints "(null)")
+ *   %n      const char *     (NULL prints "(null)")
+ *   %d %i   signed integer
+ *   %u      unsigned integer
+ *   %x %X   unsigned integer, hexadecimal
+ *   %o      unsigned integer, octal
+ *   %p      pointer
+ *   %c      character
+ *   %f %F   double, plain notation
+ *   %e %E   double, exponential notation
+ *   %g %G   double, whichever of the two suits the exponent
+ *   %%      literal '%'
+ *
+ * Integers take the hh, h, l, ll, z, j and t size modifiers, and doubles take
+ * l as a no-op. All conversions take the '-', '0', '+', ' ' and '#' flags, a
+ * width and a precision as in printf(3), including '*' for either.
+ *
+ * Unlike printf(3), a double without a precision is printed in the shortest
+ * form that reads back as the same value, rather than with six digits. With a
+ * precision the output matches printf(3).
+ */
+
+#include "private.h"
+
+#include <math.h>
+
+#include "bstring.h"
+
+#ifdef BSTR_USE_TALLOC
+#  include <talloc.h>
+#  define free talloc_free
+#endif
+
+/* Argument slots handled without touching the heap. */
+#define FMT_LOCAL_ARGS  (32)
+#define FMT_LOCAL_SLOTS (16)
+#define FMT_SCRATCH     (512)
+
+#define FMT_NONE (-1)
+#define FMT_STAR (-2)
+
+enum fmt_op {
+        FMT_LIT,
+        FMT_BSTR,
+        FMT_CSTR,
+        FMT_INT,
+        FMT_UINT,
+        FMT_PTR,
+        FMT_CHAR,
+        FMT_DBL,
+};
+
+enum fmt_size {
+        FMT_SZ_INT,
+        FMT_SZ_CHAR,
+        FMT_SZ_SHORT,
+        FMT_SZ_LONG,
+        FMT_SZ_LLONG,
+        FMT_SZ_SIZE,
+        FMT_SZ_INTMAX,
+        FMT_SZ_PTRDIFF,
+};
+
+enum fmt_flags {
+        FMT_F_LEFT  = 0x01,
+        FMT_F_ZERO  = 0x02,
+        FMT_F_PLUS  = 0x04,
+        FMT_F_SPACE = 0x08,
+        FMT_F_ALT   = 0x10,
+};
+
+struct fmt_slot {
+        uint8_t  op;
+        uint8_t  size;
+        uint8_t  flags;
+        uchar    conv;
+        int      width; /* FMT_NONE, FMT_STAR or the width. */
+        int      prec;  /* Likewise. */
+        unsigned off;   /* Literal span in the format text. */
+        unsigned len;
+};
+
+struct b_fmt {
+        const uchar     *text;
+        bstring         *src;
+        struct fmt_slot *slots;
+        unsigned         nslots;
+        unsigned         mslots;
+        unsigned         nargs;
+        struct fmt_slot  local[FMT_LOCAL_SLOTS];
+};
+
+/*
+ * An argument, fetched and laid out in the first pass. Integers are stored as
+ * their magnitude, with any sign in the prefix. Doubles are converted right
+ * away into the run's scratch buffer, and only their offset is kept. The
+ * field is, in order: pad spaces (unless left justified), the prefix, zeros,
+ * then the body.
+ */
+struct fmt_arg {
+        union {
+                const uchar *ptr;
+                int64_t      i;
+                uint64_t     u;
+        };
+        unsigned len;
+        unsigned body;
+        unsigned zeros;
+        uint8_t  nprefix;
+        uchar    prefix[2];
+        bool     left;
+};
+
+/* Converted doubles, on the stack unless there are a lot of them. */
+struct fmt_scratch {
+        uchar   *buf;
+        unsigned len;
+        unsigned cap;
+        uchar    local[FMT_SCRATCH];
+};
+
+
+/*============================================================================*/
+/* Integer kernels */
+/*============================================================================*/
+
+
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static const uint64_t powers_of_10[20] = {
+    UINT64_C(1),
+    UINT64_C(10),
+    UINT64_C(100),
+    UINT64_C(1000),
+    UINT64_C(10000),
+    UINT64_C(100000),
+    UINT64_C(1000000),
+    UINT64_C(10000000),
+    UINT64_C(100000000),
+    UINT64_C(1000000000),
+    UINT64_C(10000000000),
+    UINT64_C(100000000000),
+    UINT64_C(1000000000000),
+    UINT64_C(10000000000000),
+    UINT64_C(100000000000000),
+    UINT64_C(1000000000000000),
+    UINT64_C(10000000000000000),
+    UINT64_C(100000000000000000),
+    UINT64_C(1000000000000000000),
+    UINT64_C(10000000000000000000),
+};
+
+
+/*
+ * Number of decimal digits in val. The bit length gives log10 to within one
+ * (1233 / 4096 ~ log10(2)), and a single table lookup settles it.
+ */
+unsigned
+BSTRING_udigits(const uint64_t val)
+{
+        const unsigned bits = 64U - (unsigned)__builtin_clzll(val | 1U);
+        const unsigned t    = (bits * 1233U) >> 12;
+        return t - ((val | 1U) < powers_of_10[t]) + 1U;
+}
+
+
+/* Write exactly ndigits decimal digits of val, two at a time from the end. */
+void
+BSTRING_utoa(uchar *out, uint64_t val, const unsigned ndigits)
+{
+        uchar *ptr = out + ndigits;
+
+        while (val >= 100) {
+                const unsigned i = (unsigned)(val % 100U) * 2U;
+                val   /= 100U;
+                *--ptr = (uchar)digit_pairs[i + 1];
+                *--ptr = (uchar)digit_pairs[i];
+        }
+        if (val >= 10) {
+                const unsigned i = (unsigned)val * 2U;
+                *--ptr = (uchar)digit_pairs[i + 1];
+                *--ptr = (uchar)digit_pairs[i];
+        } else {
+                *--ptr = (uchar)('0' + val);
+        }
+}
+
+
+static inline unsigned
+fmt_xdigits(const uint64_t val)
+{
+        return (67U - (unsigned)__builtin_clzll(val | 1U)) / 4U;
+}
+
+
+static inline unsigned
+fmt_odigits(const uint64_t val)
+{
+        return (66U - (unsigned)__builtin_clzll(val | 1U)) / 3U;
+}
+
+
+static void
+fmt_xtoa(uchar *out, uint64_t val, const unsigned ndigits, const bool upper)
+{
+        const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+        for (uchar *ptr = out + ndigits; ptr > out; val >>= 4)
+                *--ptr = (uchar)digits[val & 0xFU];
+}
+
+
+static void
+fmt_otoa(uchar *out, uint64_t val, const unsigned ndigits)
+{
+        for (uchar *ptr = out + ndigits; ptr > out; val >>= 3)
+                *--ptr = (uchar)('0' + (val & 7U));
+}
+
+
+static int
+fmt_cat_digits(bstring *bstr, const uint64_t val, const int radix, const bool neg)
+{
+        if (INVALID(bstr) || NO_WRITE(bstr))
+                RUNTIME_ERROR();
+
+        const unsigned n = (radix == 16) ? fmt_xdigits(val)
+                         : (radix == 8)  ? fmt_odigits(val)
+                                         : BSTRING_udigits(val);
+        if (b_alloc(bstr, bstr->slen + n + neg + 1U) != BSTR_OK)
+                RUNTIME_ERROR();
+
+        uchar *out = bstr->data + bstr->slen;
+        if (neg)
+                *out++ = '-';
+        if (radix == 16)
+                fmt_xtoa(out, val, n, false);
+        else if (radix == 8)
+                fmt_otoa(out, val, n);
+        else
+                BSTRING_utoa(out, val, n);
+
+        bstr->slen += n + neg;
+        bstr->data[bstr->slen] = (uchar)'\0';
+        return BSTR_OK;
+}
+
+
+int
+b_cat_int(bstring *bstr, const int64_t val)
+{
+        return fmt_cat_digits(bstr, (val < 0) ? -(uint64_t)val : (uint64_t)val, 10, val < 0);
+}
+
+
+int
+b_cat_uint(bstring *bstr, const uint64_t val)
+{
+        return fmt_cat_digits(bstr, val, 10, false);
+}
+
+
+int
+b_cat_hex(bstring *bstr, const uint64_t val)
+{
+        return fmt_cat_digits(bstr, val, 16, false);
+}
+
+
+int
+b_cat_oct(bstring *bstr, const uint64_t val)
+{
+        return fmt_cat_digits(bstr, val, 8, false);
+}
+
+
+/*============================================================================*/
+/* Floating point kernels */
+/*============================================================================*/
+
+/*
+ * Shortest round-trip digits come from Grisu3 (Loitsch, "Printing
+ * Floating-Point Numbers Quickly and Accurately with Integers", PLDI 2010): a
+ * couple of 64 bit multiplications against a table of cached powers of ten,
+ * plus a check that the result is provably the shortest, correctly rounded
+ * one. The roughly 0.5% of doubles that fail the check take a slower path
+ * through snprintf.
+ */
+
+struct fmt_diyfp {
+        uint64_t f;
+        int      e;
+};
+
+#define DBL_HIDDEN_BIT (UINT64_C(1) << 52)
+#define DBL_FRAC_MASK  (DBL_HIDDEN_BIT - 1U)
+
+/* Room for any shortest form except plain notation ('f'), which may need
+ * several hundred digits. */
+#define FMT_DBL_SHORT (32U)
+#define FMT_DBL_FIXED (352U)
+#define FMT_DBL_PREC  (64U)
+
+/* 10^k for k = -348, -340, ..., 340, normalized as f * 2^e. */
+static const uint64_t cached_pow10_f[87] = {
+    UINT64_C(0xfa8fd5a0081c0288), UINT64_C(0xbaaee17fa23ebf76), UINT64_C(0x8b16fb203055ac76),
+    UINT64_C(0xcf42894a5dce35ea), UINT64_C(0x9a6bb0aa55653b2d), UINT64_C(0xe61acf033d1a45df),
+    UINT64_C(0xab70fe17c79ac6ca), UINT64_C(0xff77b1fcbebcdc4f), UINT64_C(0xbe5691ef416bd60c),
+    UINT64_C(0x8dd01fad907ffc3c), UINT64_C(0xd3515c2831559a83), UINT64_C(0x9d71ac8fada6c9b5),
+    UINT64_C(0xea9c227723ee8bcb), UINT64_C(0xaecc49914078536d), UINT64_C(0x823c12795db6ce57),
+    UINT64_C(0xc21094364dfb5637), UINT64_C(0x9096ea6f3848984f), UINT64_C(0xd77485cb25823ac7),
+    UINT64_C(0xa086cfcd97bf97f4), UINT64_C(0xef340a98172aace5), UINT64_C(0xb23867fb2a35b28e),
+    UINT64_C(0x84c8d4dfd2c63f3b), UINT64_C(0xc5dd44271ad3cdba), UINT64_C(0x936b9fcebb25c996),
+    UINT64_C(0xdbac6c247d62a584), UINT64_C(0xa3ab66580d5fdaf6), UINT64_C(0xf3e2f893dec3f126),
+    UINT64_C(0xb5b5ada8aaff80b8), UINT64_C(0x87625f056c7c4a8b), UINT64_C(0xc9bcff6034c13053),
+    UINT64_C(0x964e858c91ba2655), UINT64_C(0xdff9772470297ebd), UINT64_C(0xa6dfbd9fb8e5b88f),
+    UINT64_C(0xf8a95fcf88747d94), UINT64_C(0xb94470938fa89bcf), UINT64_C(0x8a08f0f8bf0f156b),
+    UINT64_C(0xcdb02555653131b6), UINT64_C(0x993fe2c6d07b7fac), UINT64_C(0xe45c10c42a2b3b06),
+    UINT64_C(0xaa242499697392d3), UINT64_C(0xfd87b5f28300ca0e), UINT64_C(0xbce5086492111aeb),
+    UINT64_C(0x8cbccc096f5088cc), UINT64_C(0xd1b71758e219652c), UINT64_C(0x9c40000000000000),
+    UINT64_C(0xe8d4a51000000000), UINT64_C(0xad78ebc5ac620000), UINT64_C(0x813f3978f8940984),
+    UINT64_C(0xc097ce7bc90715b3), UINT64_C(0x8f7e32ce7bea5c70), UINT64_C(0xd5d238a4abe98068),
+    UINT64_C(0x9f4f2726179a2245), UINT64_C(0xed63a231d4c4fb27), UINT64_C(0xb0de65388cc8ada8),
+    UINT64_C(0x83c7088e1aab65db), UINT64_C(0xc45d1df942711d9a), UINT64_C(0x924d692ca61be758),
+    UINT64_C(0xda01ee641a708dea), UINT64_C(0xa26da3999aef774a), UINT64_C(0xf209787bb47d6b85),
+    UINT64_C(0xb454e4a179dd1877), UINT64_C(0x865b86925b9bc5c2), UINT64_C(0xc83553c5c8965d3d),
+    UINT64_C(0x952ab45cfa97a0b3), UINT64_C(0xde469fbd99a05fe3), UINT64_C(0xa59bc234db398c25),
+    UINT64_C(0xf6c69a72a3989f5c), UINT64_C(0xb7dcbf5354e9bece), UINT64_C(0x88fcf317f22241e2),
+    UINT64_C(0xcc20ce9bd35c78a5), UINT64_C(0x98165af37b2153df), UINT64_C(0xe2a0b5dc971f303a),
+    UINT64_C(0xa8d9d1535ce3b396), UINT64_C(0xfb9b7cd9a4a7443c), UINT64_C(0xbb764c4ca7a44410),
+    UINT64_C(0x8bab8eefb6409c1a), UINT64_C(0xd01fef10a657842c), UINT64_C(0x9b10a4e5e9913129),
+    UINT64_C(0xe7109bfba19c0c9d), UINT64_C(0xac2820d9623bf429), UINT64_C(0x80444b5e7aa7cf85),
+    UINT64_C(0xbf21e44003acdd2d), UINT64_C(0x8e679c2f5e44ff8f), UINT64_C(0xd433179d9c8cb841),
+    UINT64_C(0x9e19db92b4e31ba9), UINT64_C(0xeb96bf6ebadf77d9), UINT64_C(0xaf87023b9bf0ee6b),
+};
+
+static const int16_t cached_pow10_e[87] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+/* Every power of ten that is exactly representable as a double. */
+static const double exact_pow10[23] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+
+static inline struct fmt_diyfp
+diyfp_normalize(const struct fmt_diyfp x)
+{
+        const int shift = __builtin_clzll(x.f);
+        return (struct fmt_diyfp){x.f << shift, x.e - shift};
+}
+
+
+/* The upper 64 bits of the product, rounded. */
+static inline struct fmt_diyfp
+diyfp_mul(const struct fmt_diyfp a, const struct fmt_diyfp b)
+{
+#ifdef __SIZEOF_INT128__
+        const unsigned __int128 p = (unsigned __int128)a.f * b.f;
+        const uint64_t          h = (uint64_t)(p >> 64) + (((uint64_t)p >> 63) & 1U);
+#else
+        const uint64_t M32 = UINT64_C(0xFFFFFFFF);
+        const uint64_t ah  = a.f >> 32, al = a.f & M32;
+        const uint64_t bh  = b.f >> 32, bl = b.f & M32;
+        const uint64_t mid = ((al * bl) >> 32) + ((ah * bl) & M32) + ((al * bh) & M32) + (UINT64_C(1) << 31);
+        const uint64_t h   = (ah * bh) + ((ah * bl) >> 32) + ((al * bh) >> 32) + (mid >> 32);
+#endif
+        return (struct fmt_diyfp){h, a.e + b.e + 64};
+}
+
+
+/*
+ * Walk the last digit down while that moves it closer to v, then check that the
+ * digits are provably right. W is only known to within unit either way, and
+ * the rounding interval to within unit at each end, so this fails whenever
+ * that doubt could change the last digit or put it outside the interval.
+ */
+static bool
+grisu_round_weed(uchar *buf, const unsigned len, const uint64_t too_high_w, const uint64_t unsafe,
+                 uint64_t rest, const uint64_t ten_kappa, const uint64_t unit)
+{
+        const uint64_t small = too_high_w - unit;
+        const uint64_t big   = too_high_w + unit;
+
+        while (rest < small && unsafe - rest >= ten_kappa &&
+               (rest + ten_kappa < small || small - rest >= rest + ten_kappa - small)) {
+                --buf[len - 1];
+                rest += ten_kappa;
+        }
+
+        if (rest < big && unsafe - rest >= ten_kappa &&
+            (rest + ten_kappa < big || big - rest > rest + ten_kappa - big))
+                return false;
+
+        return 2U * unit <= rest && rest <= unsafe - 4U * unit;
+}
+
+
+/*
+ * Generate digits of Wp + 1 until the remainder falls inside the widened
+ * interval (Wm - 1, Wp + 1), which gives the fewest digits that might lie in
+ * the real one; grisu_round_weed then decides whether they do.
+ */
+static bool
+grisu_digits(const struct fmt_diyfp W, const struct fmt_diyfp Wm, const struct fmt_diyfp Wp,
+             uchar *buf, unsigned *len, int *K)
+{
+        const int      shift    = -W.e;
+        const uint64_t one      = UINT64_C(1) << shift;
+        uint64_t       unit     = 1;
+        const uint64_t too_high = Wp.f + unit;
+        uint64_t       unsafe   = too_high - (Wm.f - unit);
+        uint32_t       p1       = (uint32_t)(too_high >> shift);
+        uint64_t       p2       = too_high & (one - 1U);
+        int            kappa    = (int)BSTRING_udigits(p1);
+
+        *len = 0;
+
+        /* Integral part, one digit at a time, dividing by constants. */
+        while (kappa > 0) {
+                uint32_t d;
+                switch (kappa) {
+                case 10: d = p1 / 1000000000U; p1 %= 1000000000U; break;
+                case 9:  d = p1 / 100000000U;  p1 %= 100000000U;  break;
+                case 8:  d = p1 / 10000000U;   p1 %= 10000000U;   break;
+                case 7:  d = p1 / 1000000U;    p1 %= 1000000U;    break;
+                case 6:  d = p1 / 100000U;     p1 %= 100000U;     break;
+                case 5:  d = p1 / 10000U;      p1 %= 10000U;      break;
+                case 4:  d = p1 / 1000U;       p1 %= 1000U;       break;
+                case 3:  d = p1 / 100U;        p1 %= 100U;        break;
+                case 2:  d = p1 / 10U;         p1 %= 10U;         break;
+                default: d = p1;               p1 = 0;            break;
+                }
+                if (d || *len)
+                        buf[(*len)++] = (uchar)('0' + d);
+                --kappa;
+
+                const uint64_t rest = ((uint64_t)p1 << shift) + p2;
+                if (rest < unsafe) {
+                        *K += kappa;
+                        return grisu_round_weed(buf, *len, too_high - W.f, unsafe, rest,
+                                                powers_of_10[kappa] << shift, unit);
+                }
+        }
+
+        /* Fractional part. The error grows tenfold with each digit. */
+        for (;;) {
+                p2     *= 10U;
+                unit   *= 10U;
+                unsafe *= 10U;
+                const unsigned d = (unsigned)(p2 >> shift);
+                if (d || *len)
+                        buf[(*len)++] = (uchar)('0' + d);
+                p2 &= one - 1U;
+                --kappa;
+
+                if (p2 < unsafe) {
+                        *K += kappa;
+                        return grisu_round_weed(buf, *len, (too_high - W.f) * unit, unsafe, p2,
+                                                one, unit);
+                }
+        }
+}
+
+
+/*
+ * Digits of v > 0 into buf (at most 17 of them), with v = buf * 10^*K.
+ * Returns 0 for the inputs Grisu3 can't settle.
+ */
+static unsigned
+fmt_grisu3(const double v, uchar *buf, int *K)
+{
+        uint64_t bits;
+        memcpy(&bits, &v, sizeof(bits));
+
+        const int        biased = (int)((bits >> 52) & 0x7FFU);
+        struct fmt_diyfp w      = {bits & DBL_FRAC_MASK, -1074};
+        if (biased != 0) {
+                w.f += DBL_HIDDEN_BIT;
+                w.e  = biased - 1075;
+        }
+
+        /* Halfway points to the neighbouring doubles, on a common exponent. */
+        const struct fmt_diyfp mp = diyfp_normalize((struct fmt_diyfp){(w.f << 1) + 1U, w.e - 1});
+        struct fmt_diyfp       mm = (w.f == DBL_HIDDEN_BIT)
+                                  ? (struct fmt_diyfp){(w.f << 2) - 1U, w.e - 2}
+                                  : (struct fmt_diyfp){(w.f << 1) - 1U, w.e - 1};
+        mm.f <<= mm.e - mp.e;
+        mm.e   = mp.e;
+
+        /* A cached power that brings the exponent into [-60, -32]. */
+        const double dk = (-61 - mp.e) * 0.30102999566398114 + 347;
+        int          k  = (int)dk;
+        if (dk - k > 0.0)
+                ++k;
+        const unsigned         idx = (unsigned)(k >> 3) + 1U;
+        const struct fmt_diyfp c   = {cached_pow10_f[idx], cached_pow10_e[idx]};
+        *K = 348 - (int)(idx << 3);
+
+        const struct fmt_diyfp W  = diyfp_mul(diyfp_normalize(w), c);
+        const struct fmt_diyfp Wp = diyfp_mul(mp, c);
+        const struct fmt_diyfp Wm = diyfp_mul(mm, c);
+
+        unsigned len;
+        if (!grisu_digits(W, Wm, Wp, buf, &len, K))
+                return 0;
+        while (len > 1 && buf[len - 1] == '0') {
+                --len;
+                ++*K;
+        }
+        return len;
+}
+
+
+/*
+ * The slow path for what Grisu3 rejects: printf's correctly rounded digits,
+ * from 17 (which always read back as v) down for as long as they still do.
+ * Reading back goes through b_parse_double_blk, which ignores the locale.
+ */
+static unsigned
+fmt_shortest_slow(const double v, uchar *buf, int *K)
+{
+        const int saved = errno;
+        unsigned  len   = 0;
+
+        for (int sig = 17; sig > 0; --sig) {
+                char        text[48];
+                uchar       dig[24];
+                unsigned    n = 0;
+                const char *ptr;
+
+                snprintf(text, sizeof(text), "%.*e", sig - 1, v);
+                for (ptr = text; *ptr != 'e'; ++ptr)
+                        if (*ptr >= '0' && *ptr <= '9')
+                                dig[n++] = (uchar)*ptr;
+                const int k = atoi(ptr + 1) + 1 - (int)n;
+
+                if (sig < 17) {
+                        char   num[48];
+                        double back = 0;
+                        memcpy(num, dig, n);
+                        const int m = (int)n + snprintf(num + n, sizeof(num) - n, "e%d", k);
+                        b_parse_double_blk(num, (unsigned)m, &back);
+                        if (back != v)
+                                break;
+                }
+                memcpy(buf, dig, n);
+                len = n;
+                *K  = k;
+        }
+
+        errno = saved;
+        return len;
+}
+
+
+/*
+ * Round v * 10^k (v >= 0) to the nearest integer, ties to even, exactly as if
+ * the product were computed with infinite precision. Dekker's two-product
+ * recovers the rounding error of the floating point product, which decides
+ * the cases where it lands next to a half. Fails unless 0 <= k <= 22 and the
+ * product is below 2^52.
+ */
+static bool
+fmt_round_scaled(const double v, const int k, uint64_t *out)
+{
+        if (k < 0 || k > 22)
+                return false;
+
+        const double s = exact_pow10[k];
+        const double p = v * s;
+        if (!(p < 4503599627370496.0))
+                return false;
+
+        /* Split both factors in halves whose partial products are exact. */
+        const double vs  = 134217729.0 * v;
+        const double vh  = vs - (vs - v);
+        const double vl  = v - vh;
+        const double ss  = 134217729.0 * s;
+        const double sh  = ss - (ss - s);
+        const double sl  = s - sh;
+        const double err = (((vh * sh) - p) + (vh * sl) + (vl * sh)) + (vl * sl);
+
+        /* The exact fraction is d + err, and |err| <= 1/4 here. */
+        uint64_t     r = (uint64_t)p;
+        const double d = p - (double)r;
+        if (d > 0.75 || (d >= 0.25 && err > 0.5 - d))
+                ++r;
+        else if (d >= 0.25 && err == 0.5 - d)
+                r += r & 1U;
+
+        *out = r;
+        return true;
+}
+
+
+/*
+ * Round v >= 0 to sig significant digits: v ~= r * 10^(X + 1 - sig), where r
+ * has exactly sig digits. Fails whenever fmt_round_scaled can't be exact.
+ */
+static bool
+fmt_round_sig(const double v, const unsigned sig, uint64_t *r, int *X)
+{
+        if (v == 0) {
+                *r = 0;
+                *X = 0;
+                return true;
+        }
+        if (sig > 15)
+                return false;
+
+        uint64_t bits;
+        memcpy(&bits, &v, sizeof(bits));
+        const int e2 = (int)(bits >> 52) - 1023;
+        if (e2 == -1023)
+                return false;
+
+        /* v is in [2^e2, 2^(e2 + 1)), so its decimal exponent is x or x + 1. */
+        int x = (e2 * 78913) >> 18;
+        if (fmt_round_scaled(v, (int)sig - 1 - x, r)) {
+                /* Too low a guess shows up as an extra digit. */
+                if (*r > powers_of_10[sig] && !fmt_round_scaled(v, (int)sig - 1 - ++x, r))
+                        return false;
+        } else {
+                /* Only more than sig digits' worth proves the guess x + 1. */
+                if (!fmt_round_scaled(v, (int)sig - 1 - ++x, r) || *r <= powers_of_10[sig - 1])
+                        return false;
+        }
+
+        /* Rounding up may carry into one more digit, as in 9.96 -> 10.0. */
+        if (*r == powers_of_10[sig]) {
+                *r /= 10U;
+                ++x;
+        }
+
+        *X = x;
+        return true;
+}
+
+
+/*
+ * Write the n digits dig, the first of which has decimal exponent X, in plain
+ * notation with at least frac fractional digits.
+ */
+static unsigned
+fmt_put_fixed(uchar *out, const uchar *dig, const unsigned n, const int X, int frac, const bool point)
+{
+        uchar *ptr = out;
+
+        if (X + 1 - (int)n < -frac)
+                frac = (int)n - X - 1;
+
+        for (int pos = MAX(X, 0); pos >= -frac; --pos) {
+                if (pos == -1)
+                        *ptr++ = '.';
+                const int i = X - pos;
+                *ptr++ = (i >= 0 && i < (int)n) ? dig[i] : '0';
+        }
+        if (frac == 0 && point)
+                *ptr++ = '.';
+
+        return (unsigned)PTRSUB(ptr, out);
+}
+
+
+/* The same in exponential notation, as in "1.25e+03". */
+static unsigned
+fmt_put_exp(uchar *out, const uchar *dig, const unsigned n, const int X,
+            const unsigned frac, const bool point, const bool upper)
+{
+        uchar         *ptr = out;
+        const unsigned ex  = (unsigned)((X < 0) ? -X : X);
+
+        *ptr++ = dig[0];
+        if (frac > 0 || n > 1 || point)
+                *ptr++ = '.';
+        memcpy(ptr, dig + 1, n - 1U);
+        ptr += n - 1U;
+        if (frac > n - 1U) {
+                memset(ptr, '0', frac - (n - 1U));
+                ptr += frac - (n - 1U);
+        }
+
+        *ptr++ = upper ? 'E' : 'e';
+        *ptr++ = (X < 0) ? '-' : '+';
+        if (ex < 10)
+                *ptr++ = '0';
+        const unsigned nd = BSTRING_udigits(ex);
+        BSTRING_utoa(ptr, ex, nd);
+
+        return (unsigned)PTRSUB(ptr + nd, out);
+}
+
+
+/*
+ * The shortest round-trip form of finite v >= 0. 'g' uses plain notation for
+ * decimal exponents in [-4, 17) and exponential notation otherwise.
+ */
+static unsigned
+fmt_shortest(uchar *out, const double v, const int conv, const bool alt)
+{
+        uchar    dig[24];
+        unsigned n = 1;
+        int      X = 0;
+
+        if (v == 0) {
+                dig[0] = '0';
+        } else {
+                int K;
+                if ((n = fmt_grisu3(v, dig, &K)) == 0)
+                        n = fmt_shortest_slow(v, dig, &K);
+                X = (int)n + K - 1;
+        }
+
+        switch (conv) {
+        case 'f': case 'F':
+                return fmt_put_fixed(out, dig, n, X, 0, alt);
+        case 'e': case 'E':
+                return fmt_put_exp(out, dig, n, X, 0, alt, conv == 'E');
+        default:
+                if (X >= -4 && X < 17)
+                        return fmt_put_fixed(out, dig, n, X, 0, alt);
+                return fmt_put_exp(out, dig, n, X, 0, alt, conv == 'G');
+        }
+}
+
+
+/* The shortest form of any double, sign included, in FMT_DBL_SHORT + 1 bytes
+ * ('e' and 'g') or FMT_DBL_FIXED + 1 bytes ('f'). */
+static unsigned
+fmt_put_double(uchar *out, const double val, const int conv)
+{
+        uchar *ptr = out;
+        if (signbit(val))
+                *ptr++ = '-';
+
+        if (isnan(val) || isinf(val)) {
+                memcpy(ptr, isnan(val) ? "nan" : "inf", 3);
+                ptr += 3;
+        } else {
+                ptr += fmt_shortest(ptr, signbit(val) ? -val : val, conv, false);
+        }
+
+        return (unsigned)PTRSUB(ptr, out);
+}
+
+
+int
+b_cat_double(bstring *bstr, const double val)
+{
+        if (INVALID(bstr) || NO_WRITE(bstr))
+                RUNTIME_ERROR();
+        if (b_alloc(bstr, bstr->slen + FMT_DBL_SHORT + 2U) != BSTR_OK)
+                RUNTIME_ERROR();
+
+        bstr->slen += fmt_put_double(bstr->data + bstr->slen, val, 'g');
+        bstr->data[bstr->slen] = (uchar)'\0';
+        return BSTR_OK;
+}
+
+
+/*============================================================================*/
+/* Compilation */
+/*============================================================================*/
+
+
+static void
+fmt_push(b_fmt *prog, const struct fmt_slot slot)
+{
+        /* Merge adjacent literals, e.g. the '%' of "%%" and the text after it. */
+        if (slot.op == FMT_LIT && prog->nslots > 0) {
+                struct fmt_slot *prev = &prog->slots[prog->nslots - 1];
+                if (prev->op == FMT_LIT && prev->off + prev->len == slot.off) {
+                        prev->len += slot.len;
+                        return;
+                }
+        }
+
+        if (prog->nslots == prog->mslots) {
+                prog->mslots *= 2;
+                if (prog->slots == prog->local) {
+#ifdef BSTR_USE_TALLOC
+                        prog->slots = talloc_array(NULL, struct fmt_slot, prog->mslots);
+#else
+                        prog->slots = nmalloc(prog->mslots, sizeof(struct fmt_slot));
+#endif
+                        memcpy(prog->slots, prog->local, sizeof(prog->local));
+                } else {
+#ifdef BSTR_USE_TALLOC
+                        prog->slots = talloc_realloc(NULL, prog->slots, struct fmt_slot, prog->mslots);
+#else
+                        prog->slots = nrealloc(prog->slots, prog->mslots, sizeof(struct fmt_slot));
+#endif
+                }
+        }
+
+        prog->slots[prog->nslots++] = slot;
+        if (slot.op != FMT_LIT)
+                ++prog->nargs;
+}
+
+
+/* Parse a width or precision: digits, '*', or nothing at all. */
+static bool
+fmt_parse_num(const uchar *text, const unsigned len, unsigned *ip, int *num)
+{
+        unsigned i = *ip;
+
+        if (i < len && text[i] == '*') {
+                *num = FMT_STAR;
+                *ip  = i + 1;
+                return true;
+        }
+
+        int64_t val = 0;
+        for (; i < len && isdigit(text[i]); ++i)
+                if ((val = (val * 10) + (text[i] - '0')) > INT_MAX)
+                        return false;
+
+        if (i > *ip)
+                *num = (int)val;
+        *ip = i;
+        return true;
+}
+
+
+/*
+ * Parse fmt into prog. On an illegal conversion the offending character is
+ * stored in *bad and BSTR_ERR is returned.
+ */
+static int
+fmt_parse(b_fmt *prog, const uchar *text, const unsigned len, int *bad)
+{
+        prog->text   = text;
+        prog->src    = NULL;
+        prog->slots  = prog->local;
+        prog->nslots = prog->nargs = 0;
+        prog->mslots = FMT_LOCAL_SLOTS;
+
+        unsigned i = 0;
+        while (i < len) {
+                const uchar *pct = memchr(text + i, '%', len - i);
+                const unsigned lit = pct ? (unsigned)PTRSUB(pct, text) - i : len - i;
+
+                if (lit > 0)
+                        fmt_push(prog, (struct fmt_slot){.op = FMT_LIT, .off = i, .len = lit});
+                if (!pct)
+                        break;
+                i += lit + 1U;
+
+                struct fmt_slot slot = {.op = FMT_LIT, .size = FMT_SZ_INT,
+                                        .width = FMT_NONE, .prec = FMT_NONE};
+
+                for (; i < len; ++i) {
+                        switch (text[i]) {
+                        case '-': slot.flags |= FMT_F_LEFT;  continue;
+                        case '0': slot.flags |= FMT_F_ZERO;  continue;
+                        case '+': slot.flags |= FMT_F_PLUS;  continue;
+                        case ' ': slot.flags |= FMT_F_SPACE; continue;
+                        case '#': slot.flags |= FMT_F_ALT;   continue;
+                        default:  break;
+                        }
+                        break;
+                }
+                if (!fmt_parse_num(text, len, &i, &slot.width))
+                        goto error;
+                if (i < len && text[i] == '.') {
+                        ++i;
+                        slot.prec = 0;
+                        if (!fmt_parse_num(text, len, &i, &slot.prec))
+                                goto error;
+                }
+
+                if (i < len) {
+                        switch (text[i]) {
+                        case 'h':
+                                slot.size = FMT_SZ_SHORT;
+                                if (++i < len && text[i] == 'h') {
+                                        slot.size = FMT_SZ_CHAR;
+                                        ++i;
+                                }
+                                break;
+                        case 'l':
+                                slot.size = FMT_SZ_LONG;
+                                if (++i < len && text[i] == 'l') {
+                                        slot.size = FMT_SZ_LLONG;
+                                        ++i;
+                                }
+                                break;
+                        case 'z': slot.size = FMT_SZ_SIZE;    ++i; break;
+                        case 'j': slot.size = FMT_SZ_INTMAX;  ++i; break;
+                        case 't': slot.size = FMT_SZ_PTRDIFF; ++i; break;
+                        default:  break;
+                        }
+                }
+
+                const int ch = (i < len) ? text[i] : '\0';
+                slot.conv    = (uchar)ch;
+
+                switch (ch) {
+                case 'd': case 'i':
+                        slot.op = FMT_INT;
+                        break;
+                case 'u': case 'x': case 'X': case 'o':
+                        slot.op = FMT_UINT;
+                        break;
+                case 'p': slot.op = FMT_PTR;  break;
+                case 's': slot.op = FMT_BSTR; break;
+                case 'n': slot.op = FMT_CSTR; break;
+                case 'c': slot.op = FMT_CHAR; break;
+                case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+                        slot.op = FMT_DBL;
+                        break;
+                case '%':
+                        slot = (struct fmt_slot){.op = FMT_LIT, .off = i, .len = 1};
+                        break;
+                default:
+                        goto error;
+                }
+
+                /* Size modifiers only make sense for integers, bar "%lf". */
+                if (slot.size != FMT_SZ_INT && slot.op != FMT_INT && slot.op != FMT_UINT &&
+                    !(slot.op == FMT_DBL && slot.size == FMT_SZ_LONG))
+                        goto error;
+
+                fmt_push(prog, slot);
+                ++i;
+        }
+
+        return BSTR_OK;
+
+error:
+        *bad = (i < len) ? text[i] : '\0';
+        if (prog->slots != prog->local)
+                free(prog->slots);
+        prog->slots = prog->local;
+        RUNTIME_ERROR();
+}
+
+
+static void
+fmt_release(b_fmt *prog)
+{
+        if (prog->slots != prog->local)
+                free(prog->slots);
+}
+
+
+b_fmt *
+b_fmt_compile(const bstring *fmt)
+{
+        if (INVALID(fmt))
+                RETURN_NULL();
+
+#ifdef BSTR_USE_TALLOC
+        b_fmt *prog = talloc(NULL, b_fmt);
+#else
+        b_fmt *prog = malloc(sizeof(b_fmt));
+#endif
+        bstring *src = b_strcpy(fmt);
+        int      bad;
+
+        if (fmt_parse(prog, src->data, src->slen, &bad) != BSTR_OK) {
+                b_free(src);
+                free(prog);
+                RETURN_NULL();
+        }
+
+        prog->src = src;
+        return prog;
+}
+
+
+void
+b_fmt_destroy(b_fmt *prog)
+{
+        if (!prog)
+                return;
+        fmt_release(prog);
+        b_free(prog->src);
+        free(prog);
+}
+
+
+/*============================================================================*/
+/* Execution */
+/*============================================================================*/
+
+
+static int64_t
+fmt_fetch_int(const int size, va_list *args)
+{
+        switch (size) {
+        case FMT_SZ_INT:     return va_arg(*args, int);
+        case FMT_SZ_CHAR:    return (signed char)va_arg(*args, int);
+        case FMT_SZ_SHORT:   return (short)va_arg(*args, int);
+        case FMT_SZ_LONG:    return va_arg(*args, long);
+        case FMT_SZ_LLONG:   return va_arg(*args, long long);
+        case FMT_SZ_SIZE:    return va_arg(*args, ssize_t);
+        case FMT_SZ_INTMAX:  return va_arg(*args, intmax_t);
+        case FMT_SZ_PTRDIFF: return va_arg(*args, ptrdiff_t);
+        default:             abort();
+        }
+}
+
+
+static uint64_t
+fmt_fetch_uint(const int size, va_list *args)
+{
+        switch (size) {
+        case FMT_SZ_INT:     return va_arg(*args, unsigned);
+        case FMT_SZ_CHAR:    return (unsigned char)va_arg(*args, unsigned);
+        case FMT_SZ_SHORT:   return (unsigned short)va_arg(*args, unsigned);
+        case FMT_SZ_LONG:    return va_arg(*args, unsigned long);
+        case FMT_SZ_LLONG:   return va_arg(*args, unsigned long long);
+        case FMT_SZ_SIZE:    return va_arg(*args, size_t);
+        case FMT_SZ_INTMAX:  return va_arg(*args, uintmax_t);
+        case FMT_SZ_PTRDIFF: return (uint64_t)va_arg(*args, ptrdiff_t);
+        default:             abort();
+        }
+}
+
+
+/* Lay out an integer whose magnitude, body and prefix are already set. */
+static void
+fmt_layout_int(struct fmt_arg *arg, const struct fmt_slot *slot, const int width, const int prec)
+{
+        if (prec == 0 && arg->u == 0 && slot->op != FMT_PTR)
+                arg->body = 0;
+
+        arg->zeros = 0;
+        if (prec > 0 && (unsigned)prec > arg->body)
+                arg->zeros = (unsigned)prec - arg->body;
+        else if (prec < 0 && (slot->flags & FMT_F_ZERO) && !arg->left &&
+                 width > 0 && (unsigned)width > arg->nprefix + arg->body)
+                arg->zeros = (unsigned)width - arg->nprefix - arg->body;
+
+        /* "%#o" must begin with a zero, but "0" is enough for zero itself. */
+        if (slot->conv == 'o' && (slot->flags & FMT_F_ALT) && arg->zeros == 0 &&
+            (arg->u != 0 || arg->body == 0))
+                arg->zeros = 1;
+}
+
+
+/* Room for need more bytes at the end of the scratch buffer. */
+static uchar *
+fmt_scratch_reserve(struct fmt_scratch *sc, const unsigned need)
+{
+        if (sc->cap - sc->len >= need)
+                return sc->buf + sc->len;
+        if ((uint64_t)sc->len + need >= UINT32_MAX)
+                return NULL;
+
+        const unsigned cap = (unsigned)MAX((uint64_t)sc->cap * 2U, (uint64_t)sc->len + need);
+        if (sc->buf == sc->local) {
+#ifdef BSTR_USE_TALLOC
+                sc->buf = talloc_array(NULL, uchar, cap);
+#else
+                sc->buf = malloc(cap);
+#endif
+                memcpy(sc->buf, sc->local, sc->len);
+        } else {
+#ifdef BSTR_USE_TALLOC
+                sc->buf = talloc_realloc(NULL, sc->buf, uchar, cap);
+#else
+                sc->buf = realloc(sc->buf, cap);
+#endif
+        }
+        if (!sc->buf)
+                FATAL_ERROR("Out of memory");
+
+        sc->cap = cap;
+        return sc->buf + sc->len;
+}
+
+
+/*
+ * Convert finite v >= 0 into the scratch buffer, returning the length or -1.
+ * Without a precision the shortest form is used. With one, precisions of up
+ * to 15 significant digits (or 22 decimals for 'f') are rounded exactly here;
+ * anything beyond that is left to the C library, which rounds correctly at
+ * any precision.
+ */
+static int64_t
+fmt_double(struct fmt_scratch *sc, const double v, const int conv, const int prec, const bool alt)
+{
+        const bool upper = (conv == 'E' || conv == 'F' || conv == 'G');
+        uchar      dig[24];
+        uint64_t   r;
+        uchar     *out;
+
+        if (prec < 0) {
+                if (!(out = fmt_scratch_reserve(sc, (conv == 'f' || conv == 'F') ? FMT_DBL_FIXED : FMT_DBL_SHORT)))
+                        return -1;
+                return fmt_shortest(out, v, conv, alt);
+        }
+
+        if (conv == 'f' || conv == 'F') {
+                if (fmt_round_scaled(v, prec, &r)) {
+                        const unsigned n = BSTRING_udigits(r);
+                        BSTRING_utoa(dig, r, n);
+                        if (!(out = fmt_scratch_reserve(sc, FMT_DBL_PREC)))
+                                return -1;
+                        return fmt_put_fixed(out, dig, n, (int)n - 1 - prec, prec, alt);
+                }
+        } else {
+                const unsigned sig = (conv == 'e' || conv == 'E') ? (unsigned)prec + 1U
+                                                                  : (unsigned)MAX(prec, 1);
+                int X;
+                if (fmt_round_sig(v, sig, &r, &X)) {
+                        memset(dig, '0', sig);
+                        BSTRING_utoa(dig, r, sig);
+                        if (!(out = fmt_scratch_reserve(sc, FMT_DBL_PREC)))
+                                return -1;
+                        if (conv == 'e' || conv == 'E')
+                                return fmt_put_exp(out, dig, sig, X, sig - 1U, alt, upper);
+
+                        /* As in printf, 'g' drops trailing zeros unless '#' is given. */
+                        unsigned n = sig;
+                        if (!alt)
+                                while (n > 1 && dig[n - 1] == '0')
+                                        --n;
+                        if (X >= -4 && X < (int)sig)
+                                return fmt_put_fixed(out, dig, n, X, alt ? (int)sig - 1 - X : 0, alt);
+                        return fmt_put_exp(out, dig, n, X, alt ? sig - 1U : 0, alt, upper);
+                }
+        }
+
+        char  cf[8];
+        char *ptr = cf;
+        *ptr++ = '%';
+        if (alt)
+                *ptr++ = '#';
+        *ptr++ = '.';
+        *ptr++ = '*';
+        *ptr++ = (char)conv;
+        *ptr   = '\0';
+
+        const int n = snprintf(NULL, 0, cf, prec, v);
+        if (n < 0 || !(out = fmt_scratch_reserve(sc, (unsigned)n + 1U)))
+                return -1;
+        snprintf((char *)out, (size_t)n + 1U, cf, prec, v);
+        return n;
+}
+
+
+/* Fetch and lay out every argument. Returns the exact output length, or -1. */
+static int64_t
+fmt_measure(const b_fmt *prog, struct fmt_arg *argv, struct fmt_scratch *sc, va_list args)
+{
+        static const uchar nullstr[] = "(null)";
+        int64_t total = 0;
+        va_list ap;
+
+        /* Work on a copy so that it can be handed to helpers by address. */
+        va_copy(ap, args);
+
+        for (unsigned s = 0; s < prog->nslots; ++s) {
+                const struct fmt_slot *slot = &prog->slots[s];
+                struct fmt_arg        *arg  = argv;
+
+                if (slot->op == FMT_LIT) {
+                        total += slot->len;
+                        continue;
+                }
+
+                int width = slot->width;
+                int prec  = slot->prec;
+
+                arg->left    = (slot->flags & FMT_F_LEFT) != 0;
+                arg->nprefix = 0;
+                arg->zeros   = 0;
+
+                /* As in printf, a negative '*' width means left justify. */
+                if (width == FMT_STAR && (width = va_arg(ap, int)) < 0) {
+                        arg->left = true;
+                        width     = (width == INT_MIN) ? INT_MAX : -width;
+                }
+                if (prec == FMT_STAR && (prec = va_arg(ap, int)) < 0)
+                        prec = FMT_NONE;
+
+                switch (slot->op) {
+                case FMT_BSTR:
+                case FMT_CSTR:
+                        if (slot->op == FMT_BSTR) {
+                                const bstring *next = va_arg(ap, const bstring *);
+                                arg->ptr  = INVALID(next) ? nullstr : next->data;
+                                arg->body = INVALID(next) ? sizeof(nullstr) - 1U : next->slen;
+                        } else {
+                                const char *next = va_arg(ap, const char *);
+                                arg->ptr  = next ? (const uchar *)next : nullstr;
+                                arg->body = (unsigned)((prec >= 0) ? strnlen((const char *)arg->ptr, (size_t)prec)
+                                                                   : strlen((const char *)arg->ptr));
+                        }
+                        if (prec >= 0 && (unsigned)prec < arg->body)
+                                arg->body = (unsigned)prec;
+                        break;
+
+                case FMT_CHAR:
+                        arg->i    = va_arg(ap, int);
+                        arg->body = 1;
+                        break;
+
+                case FMT_INT: {
+                        const int64_t val = fmt_fetch_int(slot->size, &ap);
+                        arg->u    = (val < 0) ? -(uint64_t)val : (uint64_t)val;
+                        arg->body = BSTRING_udigits(arg->u);
+                        if (val < 0 || (slot->flags & (FMT_F_PLUS | FMT_F_SPACE))) {
+                                arg->nprefix   = 1;
+                                arg->prefix[0] = (val < 0) ? '-' : (slot->flags & FMT_F_PLUS) ? '+' : ' ';
+                        }
+                        fmt_layout_int(arg, slot, width, prec);
+                        break;
+                }
+                case FMT_UINT:
+                case FMT_PTR:
+                        if (slot->op == FMT_PTR)
+                                arg->u = (uintptr_t)va_arg(ap, void *);
+                        else
+                                arg->u = fmt_fetch_uint(slot->size, &ap);
+
+                        if (slot->conv == 'o') {
+                                arg->body = fmt_odigits(arg->u);
+                        } else if (slot->conv == 'u') {
+                                arg->body = BSTRING_udigits(arg->u);
+                        } else {
+                                arg->body = fmt_xdigits(arg->u);
+                                if (slot->op == FMT_PTR || ((slot->flags & FMT_F_ALT) && arg->u != 0)) {
+                                        arg->nprefix   = 2;
+                                        arg->prefix[0] = '0';
+                                        arg->prefix[1] = (slot->conv == 'X') ? 'X' : 'x';
+                                }
+                        }
+                        fmt_layout_int(arg, slot, width, prec);
+                        break;
+
+                case FMT_DBL: {
+                        const double val = va_arg(ap, double);
+                        if (signbit(val) || (slot->flags & (FMT_F_PLUS | FMT_F_SPACE))) {
+                                arg->nprefix   = 1;
+                                arg->prefix[0] = signbit(val) ? '-' : (slot->flags & FMT_F_PLUS) ? '+' : ' ';
+                        }
+
+                        arg->u = sc->len;
+                        if (isnan(val) || isinf(val)) {
+                                const bool upper = (slot->conv == 'E' || slot->conv == 'F' || slot->conv == 'G');
+                                uchar     *out   = fmt_scratch_reserve(sc, 3);
+                                if (!out)
+                                        goto error;
+                                memcpy(out, isnan(val) ? (upper ? "NAN" : "nan") : (upper ? "INF" : "inf"), 3);
+                                arg->body = 3;
+                        } else {
+                                const int64_t n = fmt_double(sc, signbit(val) ? -val : val, slot->conv,
+                                                             prec, (slot->flags & FMT_F_ALT) != 0);
+                                if (n < 0)
+                                        goto error;
+                                arg->body = (unsigned)n;
+
+                                /* Unlike integers, a precision doesn't disable the '0' flag. */
+                                if ((slot->flags & FMT_F_ZERO) && !arg->left && width > 0 &&
+                                    (unsigned)width > arg->nprefix + arg->body)
+                                        arg->zeros = (unsigned)width - arg->nprefix - arg->body;
+                        }
+                        sc->len += arg->body;
+                        break;
+                }
+
+                default:
+                        abort();
+                }
+
+                const unsigned content = arg->nprefix + arg->zeros + arg->body;
+                arg->len = (width > 0 && (unsigned)width > content) ? (unsigned)width : content;
+
+                total += arg->len;
+                ++argv;
+        }
+
+        va_end(ap);
+        return total;
+
+error:
+        va_end(ap);
+        return INT64_C(-1);
+}
+
+
+/* Write the argv->body bytes of an argument's body. */
+static void
+fmt_put_body(const struct fmt_slot *slot, const struct fmt_arg *argv, const struct fmt_scratch *sc, uchar *ptr)
+{
+        switch (slot->op) {
+        case FMT_BSTR:
+        case FMT_CSTR:
+                memcpy(ptr, argv->ptr, argv->body);
+                break;
+        case FMT_CHAR:
+                *ptr = (uchar)argv->i;
+                break;
+        case FMT_INT:
+        case FMT_UINT:
+        case FMT_PTR:
+                if (argv->body == 0)
+                        break;
+                if (slot->conv == 'o')
+                        fmt_otoa(ptr, argv->u, argv->body);
+                else if (slot->conv == 'x' || slot->conv == 'X' || slot->conv == 'p')
+                        fmt_xtoa(ptr, argv->u, argv->body, slot->conv == 'X');
+                else
+                        BSTRING_utoa(ptr, argv->u, argv->body);
+                break;
+        case FMT_DBL:
+                memcpy(ptr, sc->buf + argv->u, argv->body);
+                break;
+        default:
+                abort();
+        }
+}
+
+
+static void
+fmt_emit(const b_fmt *prog, const struct fmt_arg *argv, const struct fmt_scratch *sc, uchar *out)
+{
+        for (unsigned s = 0; s < prog->nslots; ++s) {
+                const struct fmt_slot *slot = &prog->slots[s];
+
+                if (slot->op == FMT_LIT) {
+                        memcpy(out, prog->text + slot->off, slot->len);
+                        out += slot->len;
+                        continue;
+                }
+
+                const unsigned pad = argv->len - (argv->nprefix + argv->zeros + argv->body);
+                uchar         *ptr = out;
+
+                if (!argv->left) {
+                        memset(ptr, ' ', pad);
+                        ptr += pad;
+                }
+                for (unsigned i = 0; i < argv->nprefix; ++i)
+                        *ptr++ = argv->prefix[i];
+                memset(ptr, '0', argv->zeros);
+                ptr += argv->zeros;
+
+                fmt_put_body(slot, argv, sc, ptr);
+                ptr += argv->body;
+
+                if (argv->left)
+                        memset(ptr, ' ', pad);
+
+                out += argv->len;
+                ++argv;
+        }
+}
+
+
+/*============================================================================*/
+/* Streaming output */
+/*============================================================================*/
+
+/*
+ * Output for a file descriptor or FILE is rendered into a fixed per-thread
+ * buffer that is flushed whenever it fills, so nothing the size of the whole
+ * output is ever built. Bodies larger than the buffer are written directly.
+ */
+
+#define FMT_STREAM_BUF (8192)
+
+struct fmt_sink {
+        uchar   *buf;
+        unsigned len;
+        unsigned cap;
+        int      fd;
+        FILE    *fp;
+        int64_t  total;
+        bool     failed;
+};
+
+static _Thread_local uchar fmt_stream_buf[FMT_STREAM_BUF];
+static _Thread_local bool  fmt_stream_busy;
+
+
+static void
+fmt_sink_raw(struct fmt_sink *sink, const uchar *data, size_t len)
+{
+        if (sink->failed || len == 0)
+                return;
+
+        if (sink->fp) {
+                if (fwrite(data, 1, len, sink->fp) != len)
+                        sink->failed = true;
+                else
+                        sink->total += (int64_t)len;
+                return;
+        }
+
+        while (len > 0) {
+                const ssize_t n = write(sink->fd, data, len);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        sink->failed = true;
+                        return;
+                }
+                sink->total += n;
+                data        += n;
+                len         -= (size_t)n;
+        }
+}
+
+
+static void
+fmt_sink_flush(struct fmt_sink *sink)
+{
+        fmt_sink_raw(sink, sink->buf, sink->len);
+        sink->len = 0;
+}
+
+
+/* At least need contiguous bytes, which must not exceed the buffer size. */
+static inline uchar *
+fmt_sink_room(struct fmt_sink *sink, const unsigned need)
+{
+        if (sink->cap - sink->len < need)
+                fmt_sink_flush(sink);
+        return sink->buf + sink->len;
+}
+
+
+static void
+fmt_sink_put(struct fmt_sink *sink, const uchar *data, const unsigned len)
+{
+        if (sink->cap - sink->len < len) {
+                fmt_sink_flush(sink);
+                if (len >= sink->cap) {
+                        fmt_sink_raw(sink, data, len);
+                        return;
+                }
+        }
+        memcpy(sink->buf + sink->len, data, len);
+        sink->len += len;
+}
+
+
+static void
+fmt_sink_fill(struct fmt_sink *sink, const int ch, unsigned num)
+{
+        while (num > 0) {
+                if (sink->len == sink->cap)
+                        fmt_sink_flush(sink);
+                const unsigned n = MIN(num, sink->cap - sink->len);
+                memset(sink->buf + sink->len, ch, n);
+                sink->len += n;
+                num       -= n;
+        }
+}
+
+
+static void
+fmt_emit_stream(const b_fmt *prog, const struct fmt_arg *argv, const struct fmt_scratch *sc,
+                struct fmt_sink *sink)
+{
+        for (unsigned s = 0; s < prog->nslots; ++s) {
+                const struct fmt_slot *slot = &prog->slots[s];
+
+                if (slot->op == FMT_LIT) {
+                        fmt_sink_put(sink, prog->text + slot->off, slot->len);
+                        continue;
+                }
+
+                const unsigned pad = argv->len - (argv->nprefix + argv->zeros + argv->body);
+
+                if (!argv->left)
+                        fmt_sink_fill(sink, ' ', pad);
+                fmt_sink_put(sink, argv->prefix, argv->nprefix);
+                fmt_sink_fill(sink, '0', argv->zeros);
+
+                switch (slot->op) {
+                case FMT_BSTR:
+                case FMT_CSTR:
+                        fmt_sink_put(sink, argv->ptr, argv->body);
+                        break;
+                case FMT_DBL:
+                        fmt_sink_put(sink, sc->buf + argv->u, argv->body);
+                        break;
+                default:
+                        /* Numbers and characters are short enough to render in place. */
+                        fmt_put_body(slot, argv, sc, fmt_sink_room(sink, argv->body));
+                        sink->len += argv->body;
+                        break;
+                }
+
+                if (argv->left)
+                        fmt_sink_fill(sink, ' ', pad);
+                ++argv;
+        }
+}
+
+
+/*
+ * Run prog and append the output to dest, or to a new bstring if *dest is
+ * NULL, or else stream it to sink. The arguments are only walked once.
+ */
+static int
+fmt_run(const b_fmt *prog, bstring **dest, struct fmt_sink *sink, va_list args)
+{
+        struct fmt_arg     local[FMT_LOCAL_ARGS];
+        struct fmt_arg    *argv = local;
+        struct fmt_scratch sc;
+        int                ret  = BSTR_ERR;
+
+        sc.buf = sc.local;
+        sc.len = 0;
+        sc.cap = FMT_SCRATCH;
+
+        if (prog->nargs > FMT_LOCAL_ARGS) {
+#ifdef BSTR_USE_TALLOC
+                argv = talloc_array(NULL, struct fmt_arg, prog->nargs);
+#else
+                argv = nmalloc(prog->nargs, sizeof(struct fmt_arg));
+#endif
+        }
+
+        const int64_t len = fmt_measure(prog, argv, &sc, args);
+        if (len < 0)
+                goto out;
+
+        if (sink) {
+                fmt_emit_stream(prog, argv, &sc, sink);
+                fmt_sink_flush(sink);
+                ret = sink->failed ? BSTR_ERR : BSTR_OK;
+                goto out;
+        }
+
+        if (len >= UINT32_MAX)
+                goto out;
+        if (!*dest) {
+                *dest = b_create((unsigned)len);
+        } else {
+                if ((uint64_t)(*dest)->slen + (uint64_t)len >= UINT32_MAX)
+                        goto out;
+                if (b_alloc(*dest, (*dest)->slen + (unsigned)len + 1U) != BSTR_OK)
+                        goto out;
+        }
+
+        fmt_emit(prog, argv, &sc, (*dest)->data + (*dest)->slen);
+        (*dest)->slen += (unsigned)len;
+        (*dest)->data[(*dest)->slen] = (uchar)'\0';
+        ret = BSTR_OK;
+
+out:
+        if (argv != local)
+                free(argv);
+        if (sc.buf != sc.local)
+                free(sc.buf);
+        return ret;
+}
+
+
+/*
+ * The one-shot functions compile into a program on the stack, which costs a
+ * single scan of the format. Illegal conversions remain fatal here.
+ */
+static int
+fmt_run_oneshot(const bstring *fmt, bstring **dest, struct fmt_sink *sink, va_list args)
+{
+        b_fmt prog;
+        int   bad = 0;
+
+        if (fmt_parse(&prog, fmt->data, fmt->slen, &bad) != BSTR_OK)
+                errx(1, "Value '%c' is not legal.", bad);
+
+        const int ret = fmt_run(&prog, dest, sink, args);
+        fmt_release(&prog);
+        return ret;
+}
+
+
+/*
+ * Stream prog, or else the format fmt, to fd or to fp if it isn't NULL.
+ * Returns the number of bytes written, or BSTR_ERR. A nested call on the same
+ * thread (from a signal handler, say) gets a small buffer on the stack.
+ */
+static int64_t
+fmt_stream(const b_fmt *prog, const bstring *fmt, const int fd, FILE *fp, va_list args)
+{
+        uchar           fallback[256];
+        struct fmt_sink sink   = {.fd = fd, .fp = fp};
+        const bool      nested = fmt_stream_busy;
+
+        sink.buf        = nested ? fallback : fmt_stream_buf;
+        sink.cap        = nested ? sizeof(fallback) : FMT_STREAM_BUF;
+        fmt_stream_busy = true;
+
+        const int ret = prog ? fmt_run(prog, NULL, &sink, args)
+                             : fmt_run_oneshot(fmt, NULL, &sink, args);
+
+        fmt_stream_busy = nested;
+        if (ret != BSTR_OK)
+                RUNTIME_ERROR();
+
+        return sink.total;
+}
+
+
+bstring *
+b_fmt_vsprintf(const b_fmt *prog, va_list args)
+{
+        if (!prog)
+                RETURN_NULL();
+
+        bstring *ret = NULL;
+        if (fmt_run(prog, &ret, NULL, args) != BSTR_OK)
+                RETURN_NULL();
+
+        return ret;
+}
+
+
+bstring *
+b_fmt_sprintf(const b_fmt *prog, ...)
+{
+        va_list ap;
+        va_start(ap, prog);
+        bstring *ret = b_fmt_vsprintf(prog, ap);
+        va_end(ap);
+
+        return ret;
+}
+
+
+int
+b_fmt_vsprintfa(bstring *dest, const b_fmt *prog, va_list args)
+{
+        if (INVALID(dest) || NO_WRITE(dest) || !prog)
+                RUNTIME_ERROR();
+
+        return fmt_run(prog, &dest, NULL, args);
+}
+
+
+int
+b_fmt_sprintfa(bstring *dest, const b_fmt *prog, ...)
+{
+        va_list ap;
+        va_start(ap, prog);
+        const int ret = b_fmt_vsprintfa(dest, prog, ap);
+        va_end(ap);
+
+        return ret;
+}
+
+
+int64_t
+b_fmt_vfprintf(FILE *out_fp, const b_fmt *prog, va_list args)
+{
+        if (!out_fp || !prog)
+                RUNTIME_ERROR();
+
+        return fmt_stream(prog, NULL, -1, out_fp, args);
+}
+
+
+int64_t
+b_fmt_fprintf(FILE *out_fp, const b_fmt *prog, ...)
+{
+        va_list ap;
+        va_start(ap, prog);
+        const int64_t ret = b_fmt_vfprintf(out_fp, prog, ap);
+        va_end(ap);
+
+        return ret;
+}
+
+
+int64_t
+b_fmt_vdprintf(const int out_fd, const b_fmt *prog, va_list args)
+{
+        if (out_fd < 0 || !prog)
+                RUNTIME_ERROR();
+
+        return fmt_stream(prog, NULL, out_fd, NULL, args);
+}
+
+
+int64_t
+b_fmt_dprintf(const int out_fd, const b_fmt *prog, ...)
+{
+        va_list ap;
+        va_start(ap, prog);
+        const int64_t ret = b_fmt_vdprintf(out_fd, prog, ap);
+        va_end(ap);
+
+        return ret;
+}
+
+
+/*============================================================================*/
+/* Simple printf analogues. */
+/*============================================================================*/
+
+
+bstring *
+_b_sprintf(const bstring *fmt, ...)
+{
+        va_list ap;
+        va_start(ap, fmt);
+        bstring *ret = _b_vsprintf(fmt, ap);
+        va_end(ap);
+        return ret;
+}
+
+
+bstring *
+_b_vsprintf(const bstring *fmt, va_list args)
+{
+        if (INVALID(fmt))
+                RETURN_NULL();
+
+        bstring *ret = NULL;
+        if (fmt_run_oneshot(fmt, &ret, NULL, args) != BSTR_OK)
+                RETURN_NULL();
+
+        return ret;
+}
+
+
+int
+_b_fprintf(FILE *out_fp, const bstring *fmt, ...)
+{
+        va_list ap;
+        va_start(ap, fmt);
+        const int ret = _b_vfprintf(out_fp, fmt, ap);
+        va_end(ap);
+
+        return ret;
+}
+
+
+int
+_b_vfprintf(FILE *out_fp, const bstring *fmt, va_list args)
+{
+        if (INVALID(fmt) || !out_fp)
+                RUNTIME_ERROR();
+
+        return (int)fmt_stream(NULL, fmt, -1, out_fp, args);
+}
+
+
+int
+_b_dprintf(const int out_fd, const bstring *fmt, ...)
+{
+        va_list ap;
+        va_start(ap, fmt);
+        const int ret = _b_vdprintf(out_fd, fmt, ap);
+        va_end(ap);
+
+        return ret;
+}
+
+
+int
+_b_vdprintf(const int out_fd, const bstring *fmt, va_list args)
+{
+        if (INVALID(fmt) || out_fd < 0)
+                RUNTIME_ERROR();
+
+        return (int)fmt_stream(NULL, fmt, out_fd, NULL, args);
+}
+
+
+int
+_b_sprintfa(bstring *dest, const bstring *fmt, ...)
+{
+        if (INVALID(dest) || NO_WRITE(dest) || INVALID(fmt))
+                RUNTIME_ERROR();
+        va_list ap;
+        va_start(ap, fmt);
+        const int ret = _b_vsprintfa(dest, fmt, ap);
+        va_end(ap);
+
+        return ret;
+}
+
+
+int
+_b_vsprintfa(bstring *dest, const bstring *fmt, va_list args)
+{
+        if (INVALID(dest) || NO_WRITE(dest) || INVALID(fmt))
+                RUNTIME_ERROR();
+
+        return fmt_run_oneshot(fmt, &dest, NULL, args);
+}
+
+
+/*============================================================================*/
+/* Typed arguments */
+/*============================================================================*/
+
+
+/* The exact length of a block, or the most a number can need. */
+static uint64_t
+fmt_arg_size(const b_arg *arg)
+{
+        switch (arg->type) {
+        case B_ARG_BLK:  return arg->len;
+        case B_ARG_INT:  return 20U;
+        case B_ARG_UINT: return 20U;
+        case B_ARG_HEX:  return 16U;
+        case B_ARG_OCT:  return 22U;
+        case B_ARG_CHAR: return 1U;
+        case B_ARG_DBL:
+                if (arg->prec >= 0)
+                        return FMT_DBL_PREC + 1U;
+                return ((arg->conv == 'f') ? FMT_DBL_FIXED : FMT_DBL_SHORT) + 1U;
+        default:
+                abort();
+        }
+}
+
+
+static uint64_t
+fmt_args_size(const b_arg *argv, const unsigned argc)
+{
+        uint64_t total = 0;
+        for (unsigned i = 0; i < argc; ++i)
+                total += fmt_arg_size(&argv[i]);
+        return total;
+}
+
+
+/*
+ * A double with a precision, which can need more room than was reserved for
+ * it, so it goes through the scratch buffer first. Growing dest here must
+ * keep the room reserved for the arguments that follow it.
+ */
+static int
+fmt_cat_double_prec(bstring *dest, const b_arg *arg, const b_arg *rest, const unsigned nrest)
+{
+        struct fmt_scratch sc;
+        const double       val = arg->d;
+        uchar             *out;
+        int64_t            n;
+
+        sc.buf = sc.local;
+        sc.len = 0;
+        sc.cap = FMT_SCRATCH;
+
+        if (signbit(val))
+                sc.buf[sc.len++] = '-';
+        if (isnan(val) || isinf(val)) {
+                memcpy(sc.buf + sc.len, isnan(val) ? "nan" : "inf", 3);
+                n = 3;
+        } else {
+                n = fmt_double(&sc, signbit(val) ? -val : val, arg->conv, arg->prec, false);
+        }
+
+        int ret = BSTR_ERR;
+        const uint64_t need = (uint64_t)dest->slen + sc.len + (uint64_t)n +
+                              fmt_args_size(rest, nrest) + 1U;
+        if (n >= 0 && need < UINT32_MAX && b_alloc(dest, (unsigned)need) == BSTR_OK) {
+                out = dest->data + dest->slen;
+                memcpy(out, sc.buf, sc.len + (unsigned)n);
+                dest->slen += sc.len + (unsigned)n;
+                ret = BSTR_OK;
+        }
+
+        if (sc.buf != sc.local)
+                free(sc.buf);
+        return ret;
+}
+
+
+/*
+ * Hand each argument to the kernel for its type, with room for all of them
+ * already reserved by the caller. Nothing is parsed at run time.
+ */
+static int
+fmt_args_emit(bstring *dest, const b_arg *argv, const unsigned argc)
+{
+        for (unsigned i = 0; i < argc; ++i) {
+                const b_arg *arg = &argv[i];
+                uchar       *out = dest->data + dest->slen;
+                unsigned     n;
+
+                switch (arg->type) {
+                case B_ARG_BLK:
+                        memcpy(out, arg->ptr, arg->len);
+                        dest->slen += arg->len;
+                        break;
+                case B_ARG_INT:
+                case B_ARG_UINT: {
+                        const bool     neg = arg->type == B_ARG_INT && arg->i < 0;
+                        const uint64_t val = neg ? -arg->u : arg->u;
+                        if (neg)
+                                *out++ = '-';
+                        n = BSTRING_udigits(val);
+                        BSTRING_utoa(out, val, n);
+                        dest->slen += n + neg;
+                        break;
+                }
+                case B_ARG_HEX:
+                        n = fmt_xdigits(arg->u);
+                        fmt_xtoa(out, arg->u, n, false);
+                        dest->slen += n;
+                        break;
+                case B_ARG_OCT:
+                        n = fmt_odigits(arg->u);
+                        fmt_otoa(out, arg->u, n);
+                        dest->slen += n;
+                        break;
+                case B_ARG_CHAR:
+                        *out = (uchar)arg->u;
+                        dest->slen += 1;
+                        break;
+                case B_ARG_DBL:
+                        if (arg->prec < 0)
+                                dest->slen += fmt_put_double(out, arg->d, arg->conv);
+                        else if (fmt_cat_double_prec(dest, arg, argv + i + 1, argc - i - 1) != BSTR_OK)
+                                RUNTIME_ERROR();
+                        break;
+                default:
+                        abort();
+                }
+        }
+
+        dest->data[dest->slen] = (uchar)'\0';
+        return BSTR_OK;
+}
+
+
+int
+_b_sprinta(bstring *dest, const b_arg *argv, const unsigned argc)
+{
+        if (INVALID(dest) || NO_WRITE(dest) || (!argv && argc > 0))
+                RUNTIME_ERROR();
+
+        const uint64_t need = (uint64_t)dest->slen + fmt_args_size(argv, argc) + 1U;
+        if (need >= UINT32_MAX || b_alloc(dest, (unsigned)need) != BSTR_OK)
+                RUNTIME_ERROR();
+
+        return fmt_args_emit(dest, argv, argc);
+}
+
+
+bstring *
+_b_sprint(const b_arg *argv, const unsigned argc)
+{
+        if (!argv && argc > 0)
+                RETURN_NULL();
+
+        const uint64_t size = fmt_args_size(argv, argc);
+        if (size >= UINT32_MAX)
+                RETURN_NULL();
+
+        bstring *ret = b_create((unsigned)size);
+        if (fmt_args_emit(ret, argv, argc) != BSTR_OK) {
+                b_free(ret);
+                RETURN_NULL();
+        }
+
+        return ret;
+}
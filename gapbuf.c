@@ -0,0 +1,336 @@
+/*
+ * Gap buffers: a bstring whose unused capacity sits at the cursor rather than
+ * at the end. Edits at the cursor only touch the gap, and moving the cursor
+ * moves just the bytes it passes over. The last byte of the allocation is
+ * always kept free so that the buffer can be turned back into a terminated
+ * bstring in place.
+ */
+
+#include "private.h"
+
+#include "bstring.h"
+
+#ifdef BSTR_USE_TALLOC
+#  include <talloc.h>
+#  define free talloc_free
+#endif
+
+#define GAPBUF_MIN_GAP (64U)
+
+struct b_gapbuf {
+        bstring *str;
+        unsigned gap_start;
+        unsigned gap_end;
+};
+
+#define GB_CAP(GB)  ((GB)->str->mlen - 1U)
+#define GB_TAIL(GB) (GB_CAP(GB) - (GB)->gap_end)
+#define GB_GAP(GB)  ((GB)->gap_end - (GB)->gap_start)
+#define GB_LEN(GB)  ((GB)->gap_start + GB_TAIL(GB))
+
+/* Map a logical position to its byte in the buffer. */
+#define GB_AT(GB, POS) \
+        ((GB)->str->data[((POS) < (GB)->gap_start) ? (POS) : (POS) + GB_GAP(GB)])
+
+
+static b_gapbuf *
+gapbuf_wrap(bstring *str)
+{
+#ifdef BSTR_USE_TALLOC
+        b_gapbuf *gb = talloc(NULL, b_gapbuf);
+#else
+        b_gapbuf *gb = malloc(sizeof(b_gapbuf));
+#endif
+        gb->str       = str;
+        gb->gap_start = str->slen;
+        gb->gap_end   = str->mlen - 1U;
+
+        return gb;
+}
+
+
+b_gapbuf *
+b_gapbuf_create(const unsigned size)
+{
+        return gapbuf_wrap(b_create(MAX(size, GAPBUF_MIN_GAP)));
+}
+
+
+b_gapbuf *
+b_gapbuf_from_bstr(bstring *bstr)
+{
+        if (INVALID(bstr) || NO_WRITE(bstr) || NO_ALLOC(bstr) ||
+            !(bstr->flags & BSTR_FREEABLE))
+                RETURN_NULL();
+
+        return gapbuf_wrap(bstr);
+}
+
+
+/* Move the gap to the end and hand the buffer over, terminated, as is. */
+bstring *
+b_gapbuf_to_bstr(b_gapbuf *gb)
+{
+        if (!gb)
+                RETURN_NULL();
+
+        b_gapbuf_seek(gb, GB_LEN(gb));
+        bstring *ret = gb->str;
+        ret->slen    = gb->gap_start;
+        ret->data[ret->slen] = (uchar)'\0';
+        free(gb);
+
+        return ret;
+}
+
+
+void
+b_gapbuf_destroy(b_gapbuf *gb)
+{
+        if (!gb)
+                return;
+        b_free(gb->str);
+        free(gb);
+}
+
+
+unsigned
+b_gapbuf_len(const b_gapbuf *gb)
+{
+        return gb ? GB_LEN(gb) : 0;
+}
+
+
+unsigned
+b_gapbuf_cursor(const b_gapbuf *gb)
+{
+        return gb ? gb->gap_start : 0;
+}
+
+
+/*============================================================================*/
+/* Cursor movement and editing */
+/*============================================================================*/
+
+
+int
+b_gapbuf_seek(b_gapbuf *gb, const unsigned pos)
+{
+        if (!gb || pos > GB_LEN(gb))
+                RUNTIME_ERROR();
+
+        uchar *data = gb->str->data;
+
+        if (pos < gb->gap_start) {
+                const unsigned n = gb->gap_start - pos;
+                memmove(data + gb->gap_end - n, data + pos, n);
+                gb->gap_start -= n;
+                gb->gap_end   -= n;
+        } else if (pos > gb->gap_start) {
+                const unsigned n = pos - gb->gap_start;
+                memmove(data + gb->gap_start, data + gb->gap_end, n);
+                gb->gap_start += n;
+                gb->gap_end   += n;
+        }
+
+        return BSTR_OK;
+}
+
+
+/*
+ * Make the gap at least need bytes long. The allocation at least doubles each
+ * time, which keeps a run of insertions amortized O(1) per byte.
+ */
+static int
+gapbuf_reserve(b_gapbuf *gb, const unsigned need)
+{
+        if (GB_GAP(gb) >= need)
+                return BSTR_OK;
+
+        bstring       *str  = gb->str;
+        const unsigned tail = GB_TAIL(gb);
+        const uint64_t want = MAX((uint64_t)str->mlen * 2U,
+                                  (uint64_t)GB_LEN(gb) + need + GAPBUF_MIN_GAP + 1U);
+        if (want >= UINT32_MAX)
+                RUNTIME_ERROR();
+
+        /* b_alloc only guarantees to preserve the first slen bytes. */
+        str->slen = GB_CAP(gb);
+        if (b_alloc(str, (unsigned)want) != BSTR_OK)
+                RUNTIME_ERROR();
+        str->slen = 0;
+
+        memmove(str->data + GB_CAP(gb) - tail, str->data + gb->gap_end, tail);
+        gb->gap_end = GB_CAP(gb) - tail;
+
+        return BSTR_OK;
+}
+
+
+int
+b_gapbuf_insert_blk(b_gapbuf *gb, const void *blk, const unsigned len)
+{
+        if (!gb || (!blk && len > 0))
+                RUNTIME_ERROR();
+        if (gapbuf_reserve(gb, len) != BSTR_OK)
+                RUNTIME_ERROR();
+
+        memcpy(gb->str->data + gb->gap_start, blk, len);
+        gb->gap_start += len;
+
+        return BSTR_OK;
+}
+
+
+int
+b_gapbuf_insert(b_gapbuf *gb, const bstring *bstr)
+{
+        if (INVALID(bstr))
+                RUNTIME_ERROR();
+
+        return b_gapbuf_insert_blk(gb, bstr->data, bstr->slen);
+}
+
+
+int
+b_gapbuf_insert_char(b_gapbuf *gb, const int ch)
+{
+        if (!gb || gapbuf_reserve(gb, 1) != BSTR_OK)
+                RUNTIME_ERROR();
+
+        gb->str->data[gb->gap_start++] = (uchar)ch;
+        return BSTR_OK;
+}
+
+
+int
+b_gapbuf_delete(b_gapbuf *gb, const unsigned len)
+{
+        if (!gb || len > GB_TAIL(gb))
+                RUNTIME_ERROR();
+
+        gb->gap_end += len;
+        return BSTR_OK;
+}
+
+
+int
+b_gapbuf_backspace(b_gapbuf *gb, const unsigned len)
+{
+        if (!gb || len > gb->gap_start)
+                RUNTIME_ERROR();
+
+        gb->gap_start -= len;
+        return BSTR_OK;
+}
+
+
+int
+b_gapbuf_replace(b_gapbuf *gb, const unsigned len, const bstring *repl)
+{
+        if (!gb || INVALID(repl) || len > GB_TAIL(gb))
+                RUNTIME_ERROR();
+
+        /* Delete first so that the insertion can reuse the space. */
+        gb->gap_end += len;
+        return b_gapbuf_insert_blk(gb, repl->data, repl->slen);
+}
+
+
+/*============================================================================*/
+/* Reading */
+/*============================================================================*/
+
+
+int
+b_gapbuf_char(const b_gapbuf *gb, const unsigned pos)
+{
+        if (!gb || pos >= GB_LEN(gb))
+                RUNTIME_ERROR();
+
+        return GB_AT(gb, pos);
+}
+
+
+int
+b_gapbuf_views(const b_gapbuf *gb, bstring *before, bstring *after)
+{
+        if (!gb || !before || !after)
+                RUNTIME_ERROR();
+
+        *before = bt_fromblk(gb->str->data, gb->gap_start);
+        *after  = bt_fromblk(gb->str->data + gb->gap_end, GB_TAIL(gb));
+
+        return BSTR_OK;
+}
+
+
+int64_t
+b_gapbuf_strchrp(const b_gapbuf *gb, const int ch, const unsigned pos)
+{
+        if (!gb || pos > GB_LEN(gb))
+                RUNTIME_ERROR();
+
+        const uchar *data = gb->str->data;
+        const uchar *ptr;
+
+        if (pos < gb->gap_start) {
+                ptr = memchr(data + pos, ch, gb->gap_start - pos);
+                if (ptr)
+                        return PTRSUB(ptr, data);
+        }
+
+        const unsigned skip = (pos > gb->gap_start) ? pos - gb->gap_start : 0;
+        ptr = memchr(data + gb->gap_end + skip, ch, GB_TAIL(gb) - skip);
+        if (ptr)
+                return PTRSUB(ptr, data) - GB_GAP(gb);
+
+        return BSTR_ERR;
+}
+
+
+int64_t
+b_gapbuf_strstr(const b_gapbuf *gb, const bstring *needle, const unsigned pos)
+{
+        if (!gb || INVALID(needle) || pos > GB_LEN(gb))
+                RUNTIME_ERROR();
+        if (needle->slen == 0)
+                return pos;
+        if (needle->slen > GB_LEN(gb) - pos)
+                return BSTR_ERR;
+
+        const uchar   *data = gb->str->data;
+        const uchar   *nd   = needle->data;
+        const unsigned nlen = needle->slen;
+        const unsigned gs   = gb->gap_start;
+        const uchar   *ptr;
+
+        /* Matches entirely before the gap. */
+        if (pos < gs && gs - pos >= nlen) {
+                ptr = BSTRING_memmem(data + pos, gs - pos, nd, nlen);
+                if (ptr)
+                        return PTRSUB(ptr, data);
+        }
+
+        /* Matches straddling the gap: compare the two halves separately. */
+        if (gs > pos && GB_TAIL(gb) > 0) {
+                unsigned start = (gs - pos >= nlen) ? gs - nlen + 1U : pos;
+                for (; start < gs; ++start) {
+                        const unsigned head = gs - start;
+                        if (nlen - head <= GB_TAIL(gb) &&
+                            memcmp(data + start, nd, head) == 0 &&
+                            memcmp(data + gb->gap_end, nd + head, nlen - head) == 0)
+                                return start;
+                }
+        }
+
+        /* Matches entirely after the gap. */
+        const unsigned skip = (pos > gs) ? pos - gs : 0;
+        if (GB_TAIL(gb) - skip >= nlen) {
+                ptr = BSTRING_memmem(data + gb->gap_end + skip, GB_TAIL(gb) - skip, nd, nlen);
+                if (ptr)
+                        return PTRSUB(ptr, data) - GB_GAP(gb);
+        }
+
+        return BSTR_ERR;
+}
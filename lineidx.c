@@ -0,0 +1,189 @@
+/*
+ * Line offset index: one pass over a buffer records where every line starts,
+ * after which any line can be fetched as a view in O(1) and any byte offset
+ * can be mapped back to its line with a binary search.
+ */
+
+#include "private.h"
+
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+
+#include "bstring.h"
+
+#ifdef BSTR_USE_TALLOC
+#  include <talloc.h>
+#  define free talloc_free
+#endif
+
+struct b_lineidx {
+        uint32_t *starts;
+        unsigned  nstarts;
+        unsigned  mstarts;
+        unsigned  len;
+        unsigned  flags;
+};
+
+
+static void
+lineidx_reserve(b_lineidx *idx, const unsigned extra)
+{
+        if (idx->nstarts + extra <= idx->mstarts)
+                return;
+        unsigned size = idx->mstarts;
+        while (size < idx->nstarts + extra)
+                size *= 2;
+
+#ifdef BSTR_USE_TALLOC
+        idx->starts = talloc_realloc(idx, idx->starts, uint32_t, size);
+#else
+        idx->starts = nrealloc(idx->starts, size, sizeof(uint32_t));
+#endif
+        idx->mstarts = size;
+}
+
+
+/*
+ * Record the start of every line beginning in [from, to). The vector path
+ * builds a 64 bit newline mask per block and peels positions off it with ctz,
+ * which is much cheaper than a memchr call per line when lines are short.
+ */
+static void
+lineidx_scan(b_lineidx *idx, const uchar *data, unsigned from, const unsigned to)
+{
+#if defined(__SSE2__)
+        const __m128i nl = _mm_set1_epi8('\n');
+
+        for (; to - from >= 64; from += 64) {
+                const uchar *blk = data + from;
+                const uint64_t m0 = (uint32_t)_mm_movemask_epi8(
+                    _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(blk +  0)), nl));
+                const uint64_t m1 = (uint32_t)_mm_movemask_epi8(
+                    _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(blk + 16)), nl));
+                const uint64_t m2 = (uint32_t)_mm_movemask_epi8(
+                    _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(blk + 32)), nl));
+                const uint64_t m3 = (uint32_t)_mm_movemask_epi8(
+                    _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(blk + 48)), nl));
+                uint64_t mask = m0 | (m1 << 16) | (m2 << 32) | (m3 << 48);
+
+                if (!mask)
+                        continue;
+                lineidx_reserve(idx, 64);
+                while (mask) {
+                        idx->starts[idx->nstarts++] = from + (unsigned)__builtin_ctzll(mask) + 1U;
+                        mask &= mask - 1;
+                }
+        }
+#endif
+
+        while (from < to) {
+                const uchar *ptr = memchr(data + from, '\n', to - from);
+                if (!ptr)
+                        break;
+                lineidx_reserve(idx, 1);
+                from = (unsigned)PTRSUB(ptr, data) + 1U;
+                idx->starts[idx->nstarts++] = from;
+        }
+}
+
+
+b_lineidx *
+b_lineidx_create(const bstring *src, const unsigned flags)
+{
+        if (INVALID(src))
+                RETURN_NULL();
+
+#ifdef BSTR_USE_TALLOC
+        b_lineidx *idx = talloc(NULL, b_lineidx);
+        idx->starts    = talloc_array(idx, uint32_t, 64);
+#else
+        b_lineidx *idx = malloc(sizeof(b_lineidx));
+        idx->starts    = nmalloc(64, sizeof(uint32_t));
+#endif
+        idx->mstarts   = 64;
+        idx->nstarts   = 1;
+        idx->starts[0] = 0;
+        idx->len       = 0;
+        idx->flags     = flags;
+
+        if (b_lineidx_extend(idx, src) != BSTR_OK) {
+                b_lineidx_destroy(idx);
+                RETURN_NULL();
+        }
+
+        return idx;
+}
+
+
+void
+b_lineidx_destroy(b_lineidx *idx)
+{
+        if (!idx)
+                return;
+        free(idx->starts);
+        free(idx);
+}
+
+
+int
+b_lineidx_extend(b_lineidx *idx, const bstring *src)
+{
+        if (!idx || INVALID(src) || src->slen < idx->len)
+                RUNTIME_ERROR();
+
+        lineidx_scan(idx, src->data, idx->len, src->slen);
+        idx->len = src->slen;
+
+        return BSTR_OK;
+}
+
+
+unsigned
+b_lineidx_count(const b_lineidx *idx)
+{
+        if (!idx)
+                return 0;
+        /* A trailing newline does not start another (empty) line. */
+        return idx->nstarts - (idx->starts[idx->nstarts - 1] == idx->len);
+}
+
+
+int
+b_lineidx_get(const b_lineidx *idx, const bstring *src, const unsigned n, bstring *dest)
+{
+        if (!idx || INVALID(src) || !dest || src->slen < idx->len ||
+            n >= b_lineidx_count(idx))
+                RUNTIME_ERROR();
+
+        const unsigned start = idx->starts[n];
+        unsigned       end   = (n + 1 < idx->nstarts) ? idx->starts[n + 1] - 1U : idx->len;
+
+        if (end > start && !(idx->flags & B_LINEIDX_KEEP_CR) && src->data[end - 1] == '\r')
+                --end;
+
+        *dest = bt_fromblk(src->data + start, end - start);
+        return BSTR_OK;
+}
+
+
+int64_t
+b_lineidx_lineof(const b_lineidx *idx, const unsigned offset)
+{
+        if (!idx || offset >= idx->len)
+                RUNTIME_ERROR();
+
+        /* Find the last line that starts at or before offset. */
+        unsigned lo = 0;
+        unsigned hi = idx->nstarts;
+
+        while (hi - lo > 1) {
+                const unsigned mid = lo + ((hi - lo) / 2);
+                if (idx->starts[mid] <= offset)
+                        lo = mid;
+                else
+                        hi = mid;
+        }
+
+        return (int64_t)lo;
+}
@@ -0,0 +1,829 @@
+/*
+ * Batch file loading. Reading thousands of small files one after another
+ * leaves the device idle between each open, stat, read and close. Here many
+ * files are kept in flight at once: through io_uring on Linux, where the
+ * opens and reads of a whole batch are queued to the kernel together, and
+ * otherwise through a small pool of threads each doing ordinary blocking reads.
+ *
+ * io_uring is driven with raw system calls so that liburing isn't needed.
+ * Define HAVE_LINUX_IO_URING_H to build that path.
+ *
+ * b_load_tree walks a directory tree with a pool of threads and loads the
+ * files in it that match a pattern.
+ */
+
+#include "private.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+
+#if defined(__linux__) && defined(HAVE_LINUX_IO_URING_H)
+#  include <linux/io_uring.h>
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#  define LOADER_URING
+#endif
+
+#include "bstring.h"
+
+#ifdef BSTR_USE_TALLOC
+#  include <talloc.h>
+#  define free talloc_free
+#endif
+#ifndef O_BINARY
+#  define O_BINARY 0
+#endif
+#ifndef O_CLOEXEC
+#  define O_CLOEXEC 0
+#endif
+
+/* Files kept in flight at once, and the initial buffer for files of unknown
+ * size. */
+#define LOADER_QUEUE_DEPTH (128U)
+#define LOADER_INIT_READ   (8192U)
+
+/* The smallest file b_load_tree maps with B_TREE_MMAP. */
+#define TREE_MMAP_MIN      (65536)
+
+struct load_job {
+        const char *path;
+        char       *copy;
+        bstring    *out;
+        int         fd;
+        bool        regular;
+        unsigned    size;
+        bool        opened;
+        bool        done;
+        unsigned    want;
+};
+
+
+/*
+ * open(2) needs a terminated path. Bstrings that own their buffer always have
+ * one; views may not, so those are copied.
+ */
+static void
+load_job_init(struct load_job *job, const bstring *path)
+{
+        *job = (struct load_job){.fd = (-1)};
+
+        if (INVALID(path))
+                return;
+        if (path->mlen > path->slen && path->data[path->slen] == '\0') {
+                job->path = (const char *)path->data;
+        } else {
+#ifdef BSTR_USE_TALLOC
+                job->copy = talloc_size(NULL, (size_t)path->slen + 1U);
+#else
+                job->copy = malloc((size_t)path->slen + 1U);
+#endif
+                memcpy(job->copy, path->data, path->slen);
+                job->copy[path->slen] = '\0';
+                job->path = job->copy;
+        }
+}
+
+
+/* Load one file the ordinary way. */
+static void
+load_job_sync(struct load_job *job)
+{
+        if (!job->path)
+                return;
+
+        const int fd = open(job->path, O_RDONLY | O_BINARY | O_CLOEXEC);
+        if (fd < 0)
+                return;
+        job->out = b_read_fd(fd);
+        close(fd);
+}
+
+
+/*============================================================================*/
+/* io_uring */
+/*============================================================================*/
+
+#ifdef LOADER_URING
+
+struct uring {
+        int                  fd;
+        unsigned             pending;
+        unsigned             sq_local;
+        unsigned            *sq_head;
+        unsigned            *sq_tail;
+        unsigned            *sq_mask;
+        unsigned            *sq_array;
+        unsigned            *cq_head;
+        unsigned            *cq_tail;
+        unsigned            *cq_mask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+        void                *sq_ring;
+        void                *cq_ring;
+        size_t               sq_ring_sz;
+        size_t               cq_ring_sz;
+        size_t               sqes_sz;
+};
+
+
+static void
+uring_exit(struct uring *ring)
+{
+        if (ring->sqes)
+                munmap(ring->sqes, ring->sqes_sz);
+        if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+                munmap(ring->cq_ring, ring->cq_ring_sz);
+        if (ring->sq_ring)
+                munmap(ring->sq_ring, ring->sq_ring_sz);
+        if (ring->fd >= 0)
+                close(ring->fd);
+}
+
+
+/*
+ * Returns false if io_uring is unavailable, which includes kernels without it
+ * and sandboxes that forbid it.
+ */
+static bool
+uring_init(struct uring *ring, const unsigned entries)
+{
+        struct io_uring_params params;
+        memset(&params, 0, sizeof params);
+        memset(ring, 0, sizeof *ring);
+
+        ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (ring->fd < 0)
+                return false;
+
+        ring->sq_ring_sz = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        ring->cq_ring_sz = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        ring->sqes_sz    = params.sq_entries * sizeof(struct io_uring_sqe);
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+                ring->sq_ring_sz = ring->cq_ring_sz = MAX(ring->sq_ring_sz, ring->cq_ring_sz);
+
+        ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+        if (ring->sq_ring == MAP_FAILED) {
+                ring->sq_ring = NULL;
+                goto fail;
+        }
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                ring->cq_ring = ring->sq_ring;
+        } else {
+                ring->cq_ring = mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+                if (ring->cq_ring == MAP_FAILED) {
+                        ring->cq_ring = NULL;
+                        goto fail;
+                }
+        }
+        ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+        if (ring->sqes == MAP_FAILED) {
+                ring->sqes = NULL;
+                goto fail;
+        }
+
+        uchar *sq = ring->sq_ring;
+        uchar *cq = ring->cq_ring;
+        ring->sq_head  = (unsigned *)(sq + params.sq_off.head);
+        ring->sq_tail  = (unsigned *)(sq + params.sq_off.tail);
+        ring->sq_mask  = (unsigned *)(sq + params.sq_off.ring_mask);
+        ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+        ring->cq_head  = (unsigned *)(cq + params.cq_off.head);
+        ring->cq_tail  = (unsigned *)(cq + params.cq_off.tail);
+        ring->cq_mask  = (unsigned *)(cq + params.cq_off.ring_mask);
+        ring->cqes     = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+        ring->sq_local = *ring->sq_tail;
+
+        return true;
+
+fail:
+        uring_exit(ring);
+        return false;
+}
+
+
+/*
+ * Claim an SQE. The caller never has more operations outstanding than the
+ * ring has entries, so there is always a free slot. New entries only become
+ * visible to the kernel when the tail is published in uring_submit_wait.
+ */
+static struct io_uring_sqe *
+uring_sqe(struct uring *ring, const uint64_t user_data)
+{
+        const unsigned idx = ring->sq_local++ & *ring->sq_mask;
+
+        struct io_uring_sqe *sqe = &ring->sqes[idx];
+        memset(sqe, 0, sizeof *sqe);
+        sqe->user_data      = user_data;
+        ring->sq_array[idx] = idx;
+        ++ring->pending;
+
+        return sqe;
+}
+
+
+static int
+uring_submit_wait(struct uring *ring)
+{
+        __atomic_store_n(ring->sq_tail, ring->sq_local, __ATOMIC_RELEASE);
+
+        for (;;) {
+                const long n = syscall(__NR_io_uring_enter, ring->fd, ring->pending, 1U,
+                                       IORING_ENTER_GETEVENTS, NULL, 0);
+                if (n >= 0) {
+                        ring->pending -= (unsigned)n;
+                        return BSTR_OK;
+                }
+                if (errno != EINTR)
+                        RUNTIME_ERROR();
+        }
+}
+
+
+static void
+uring_queue_open(struct uring *ring, struct load_job *job, const unsigned idx)
+{
+        struct io_uring_sqe *sqe = uring_sqe(ring, idx);
+        sqe->opcode     = IORING_OP_OPENAT;
+        sqe->fd         = AT_FDCWD;
+        sqe->addr       = (uint64_t)(uintptr_t)job->path;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+}
+
+
+/*
+ * Read into all of the spare room. Regular files are read at an explicit
+ * offset; anything else from its current position.
+ */
+static void
+uring_queue_read(struct uring *ring, struct load_job *job, const unsigned idx)
+{
+        bstring *out = job->out;
+        job->want    = out->mlen - out->slen - 1U;
+
+        struct io_uring_sqe *sqe = uring_sqe(ring, idx);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd     = job->fd;
+        sqe->addr   = (uint64_t)(uintptr_t)(out->data + out->slen);
+        sqe->len    = job->want;
+        sqe->off    = job->regular ? (uint64_t)out->slen : (uint64_t)-1;
+}
+
+
+static void
+uring_job_finish(struct load_job *job, const bool ok)
+{
+        if (job->fd >= 0)
+                close(job->fd);
+        job->fd = (-1);
+
+        if (!ok && job->out)
+                b_free(job->out);
+        if (!ok)
+                job->out = NULL;
+        else
+                job->out->data[job->out->slen] = (uchar)'\0';
+}
+
+
+/*
+ * Returns true if the job needs another operation, false once it is finished
+ * one way or the other.
+ */
+static bool
+uring_job_step(struct uring *ring, struct load_job *job, const unsigned idx, const int res)
+{
+        if (!job->opened) {
+                /* Kernels older than 5.6 lack OPENAT and READ. */
+                if (res == -EINVAL || res == -EOPNOTSUPP) {
+                        load_job_sync(job);
+                        return false;
+                }
+                if (res < 0)
+                        return false;
+
+                struct stat st;
+                job->opened = true;
+                job->fd     = res;
+                if (fstat(job->fd, &st) != 0 || (uint64_t)st.st_size >= UINT32_MAX - 1U) {
+                        uring_job_finish(job, false);
+                        return false;
+                }
+                job->regular = S_ISREG(st.st_mode);
+                job->size    = job->regular ? (unsigned)st.st_size : 0;
+
+                /* One byte spare, so an exact size needs no second read. */
+                job->out = b_create((job->regular && st.st_size > 0)
+                                        ? (unsigned)st.st_size + 1U
+                                        : LOADER_INIT_READ);
+                uring_queue_read(ring, job, idx);
+                return true;
+        }
+
+        if (res == -EINTR || res == -EAGAIN) {
+                uring_queue_read(ring, job, idx);
+                return true;
+        }
+        if (res < 0) {
+                uring_job_finish(job, false);
+                return false;
+        }
+
+        bstring *out = job->out;
+        out->slen   += (unsigned)res;
+
+        /* Files in procfs and sysfs claim a size of 0 and return short reads
+         * long before EOF, so a short read only ends a file of known size. */
+        if (res == 0 || (job->size > 0 && out->slen >= job->size)) {
+                uring_job_finish(job, true);
+                return false;
+        }
+        if (out->mlen - out->slen - 1U == 0) {
+                const uint64_t want = (uint64_t)out->mlen * 2U;
+                if (want >= UINT32_MAX || b_alloc(out, (unsigned)want) != BSTR_OK) {
+                        uring_job_finish(job, false);
+                        return false;
+                }
+        }
+        uring_queue_read(ring, job, idx);
+        return true;
+}
+
+
+static bool
+load_uring(struct load_job *jobs, const unsigned qty)
+{
+        struct uring ring;
+        if (!uring_init(&ring, LOADER_QUEUE_DEPTH))
+                return false;
+
+        unsigned next     = 0;
+        unsigned inflight = 0;
+
+        while (next < qty || inflight > 0) {
+                for (; next < qty && inflight < LOADER_QUEUE_DEPTH; ++next) {
+                        if (!jobs[next].path) {
+                                jobs[next].done = true;
+                                continue;
+                        }
+                        uring_queue_open(&ring, &jobs[next], next);
+                        ++inflight;
+                }
+                if (inflight == 0)
+                        break;
+
+                if (uring_submit_wait(&ring) != BSTR_OK) {
+                        /* Requests still in flight may write to their buffers
+                         * until the kernel cancels them, so those are
+                         * abandoned rather than freed. */
+                        uring_exit(&ring);
+                        for (unsigned i = 0; i < qty; ++i) {
+                                if (jobs[i].done)
+                                        continue;
+                                if (jobs[i].fd >= 0)
+                                        close(jobs[i].fd);
+                                jobs[i].out = NULL;
+                                load_job_sync(&jobs[i]);
+                        }
+                        return true;
+                }
+
+                unsigned       head = *ring.cq_head;
+                const unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+                for (; head != tail; ++head) {
+                        const struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+                        const unsigned idx = (unsigned)cqe->user_data;
+
+                        if (!uring_job_step(&ring, &jobs[idx], idx, cqe->res)) {
+                                jobs[idx].done = true;
+                                --inflight;
+                        }
+                }
+                __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        }
+
+        uring_exit(&ring);
+        return true;
+}
+#endif /* LOADER_URING */
+
+
+/*============================================================================*/
+/* Thread pool */
+/*============================================================================*/
+
+struct load_pool {
+        struct load_job *jobs;
+        unsigned         qty;
+        unsigned         next;
+};
+
+
+static void *
+load_pool_worker(void *vdata)
+{
+        struct load_pool *pool = vdata;
+
+        for (;;) {
+                const unsigned i = __atomic_fetch_add(&pool->next, 1U, __ATOMIC_RELAXED);
+                if (i >= pool->qty)
+                        break;
+                load_job_sync(&pool->jobs[i]);
+        }
+
+        return NULL;
+}
+
+
+/*
+ * The threads share one counter rather than fixed slices, so a few large
+ * files don't hold up the rest of the batch.
+ */
+static void
+load_pool(struct load_job *jobs, const unsigned qty, unsigned nthreads)
+{
+        struct load_pool pool = {jobs, qty, 0};
+
+        if (nthreads == 0)
+                nthreads = MIN(BSTRING_ncpus() * 4U, 64U);
+        nthreads = MAX(MIN(nthreads, qty), 1U);
+
+        pthread_t *tids = nalloca(nthreads, sizeof(pthread_t));
+        bool      *live = nalloca(nthreads, sizeof(bool));
+
+        for (unsigned i = 1; i < nthreads; ++i)
+                live[i] = pthread_create(&tids[i], NULL, &load_pool_worker, &pool) == 0;
+        load_pool_worker(&pool);
+
+        for (unsigned i = 1; i < nthreads; ++i)
+                if (live[i])
+                        pthread_join(tids[i], NULL);
+}
+
+
+/*============================================================================*/
+
+
+b_list *
+b_load_files(const b_list *paths, const unsigned flags, const unsigned nthreads)
+{
+        if (!paths)
+                RETURN_NULL();
+
+        const unsigned qty = paths->qty;
+#ifdef BSTR_USE_TALLOC
+        struct load_job *jobs = talloc_array(NULL, struct load_job, MAX(qty, 1U));
+#else
+        struct load_job *jobs = nmalloc(MAX(qty, 1U), sizeof(struct load_job));
+#endif
+        for (unsigned i = 0; i < qty; ++i)
+                load_job_init(&jobs[i], paths->lst[i]);
+
+#ifdef LOADER_URING
+        if ((flags & B_LOAD_NO_URING) || !load_uring(jobs, qty))
+                load_pool(jobs, qty, nthreads);
+#else
+        (void)flags;
+        load_pool(jobs, qty, nthreads);
+#endif
+
+        b_list *ret = b_list_create_alloc(MAX(qty, 1U));
+        for (unsigned i = 0; i < qty; ++i) {
+                ret->lst[ret->qty++] = jobs[i].out;
+#ifdef BSTR_USE_TALLOC
+                if (jobs[i].out)
+                        talloc_steal(ret, jobs[i].out);
+#endif
+                if (jobs[i].copy)
+                        free(jobs[i].copy);
+        }
+        free(jobs);
+
+        return ret;
+}
+
+
+/*============================================================================*/
+/* Directory trees */
+/*============================================================================*/
+
+/*
+ * Every worker both scans directories and loads the matching files it finds
+ * in them, so the walk and the reads overlap without a separate queue of
+ * files. Subdirectories go on a shared stack. Each worker has at most one
+ * directory and one file open at a time, which bounds what is in flight to
+ * nthreads files regardless of the size of the tree.
+ */
+struct tree_walk {
+        pthread_mutex_t lock;
+        pthread_cond_t  cond;
+        bstring       **dirs;
+        unsigned        ndirs;
+        unsigned        mdirs;
+        unsigned        busy;
+        unsigned        rootlen;
+        unsigned        flags;
+        const char     *pattern;
+        bool            pathmatch;
+};
+
+struct tree_entry {
+        bstring *path;
+        bstring *data;
+};
+
+struct tree_worker {
+        struct tree_walk  *walk;
+        struct tree_entry *ents;
+        unsigned           qty;
+        unsigned           mlen;
+};
+
+
+static void
+tree_push_dir(struct tree_walk *walk, bstring *dir)
+{
+        pthread_mutex_lock(&walk->lock);
+        if (walk->ndirs >= walk->mdirs) {
+                walk->mdirs *= 2U;
+#ifdef BSTR_USE_TALLOC
+                walk->dirs = talloc_realloc(NULL, walk->dirs, bstring *, walk->mdirs);
+#else
+                walk->dirs = nrealloc(walk->dirs, walk->mdirs, sizeof(bstring *));
+#endif
+        }
+        walk->dirs[walk->ndirs++] = dir;
+        pthread_cond_signal(&walk->cond);
+        pthread_mutex_unlock(&walk->lock);
+}
+
+
+static void
+tree_add(struct tree_worker *wk, bstring *path, bstring *data)
+{
+        if (wk->qty >= wk->mlen) {
+                wk->mlen = wk->mlen ? wk->mlen * 2U : 64U;
+#ifdef BSTR_USE_TALLOC
+                wk->ents = talloc_realloc(NULL, wk->ents, struct tree_entry, wk->mlen);
+#else
+                wk->ents = nrealloc(wk->ents, wk->mlen, sizeof(struct tree_entry));
+#endif
+        }
+        wk->ents[wk->qty++] = (struct tree_entry){path, data};
+}
+
+
+/*
+ * Classify an entry as a directory ('d'), a regular file ('f') or something
+ * to skip (0), calling stat only when readdir doesn't say. Symbolic links are
+ * skipped unless B_TREE_FOLLOW is given, and even then only links to files
+ * are followed, so the walk can't loop.
+ */
+static int
+tree_type(const int dfd, const struct dirent *de, const unsigned flags)
+{
+        int type = DT_UNKNOWN;
+#ifdef _DIRENT_HAVE_D_TYPE
+        type = de->d_type;
+#endif
+        if (type == DT_DIR)
+                return 'd';
+        if (type == DT_REG)
+                return 'f';
+
+        struct stat st;
+        if (type == DT_UNKNOWN) {
+                if (fstatat(dfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                        return 0;
+                if (S_ISDIR(st.st_mode))
+                        return 'd';
+                if (S_ISREG(st.st_mode))
+                        return 'f';
+                if (!S_ISLNK(st.st_mode))
+                        return 0;
+                type = DT_LNK;
+        }
+        if (type == DT_LNK && (flags & B_TREE_FOLLOW))
+                if (fstatat(dfd, de->d_name, &st, 0) == 0 && S_ISREG(st.st_mode))
+                        return 'f';
+
+        return 0;
+}
+
+
+static bool
+tree_match(const struct tree_walk *walk, const bstring *path, const char *name)
+{
+        if (!walk->pattern)
+                return true;
+        if (walk->pathmatch)
+                return fnmatch(walk->pattern, (const char *)path->data + walk->rootlen,
+                               FNM_PATHNAME) == 0;
+        return fnmatch(walk->pattern, name, 0) == 0;
+}
+
+
+/*
+ * Mapping a small file wastes the rest of its last page and uses up one of
+ * the process's limited number of mappings, so only large files are mapped.
+ */
+static bool
+tree_mapped(const int fd, const unsigned flags)
+{
+        struct stat st;
+        return (flags & B_TREE_MMAP) && fstat(fd, &st) == 0 && st.st_size >= TREE_MMAP_MIN;
+}
+
+
+static void
+tree_scan(struct tree_worker *wk, bstring *dir)
+{
+        struct tree_walk *walk = wk->walk;
+        const int         dfd  = open((const char *)dir->data,
+                                      O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        DIR              *dp   = (dfd >= 0) ? fdopendir(dfd) : NULL;
+
+        if (!dp) {
+                if (dfd >= 0)
+                        close(dfd);
+                b_free(dir);
+                return;
+        }
+
+        const bool     slash = dir->slen > 0 && dir->data[dir->slen - 1] == '/';
+        struct dirent *de;
+
+        while ((de = readdir(dp))) {
+                const char *name = de->d_name;
+                if (name[0] == '.' && (!(walk->flags & B_TREE_HIDDEN) || name[1] == '\0' ||
+                                       (name[1] == '.' && name[2] == '\0')))
+                        continue;
+
+                const int type = tree_type(dfd, de, walk->flags);
+                if (!type)
+                        continue;
+
+                const unsigned nlen = (unsigned)strlen(name);
+                bstring       *path = b_create(dir->slen + nlen + 1U);
+                memcpy(path->data, dir->data, dir->slen);
+                path->slen = dir->slen;
+                if (!slash)
+                        path->data[path->slen++] = '/';
+                memcpy(path->data + path->slen, name, nlen + 1U);
+                path->slen += nlen;
+
+                if (type == 'd') {
+                        tree_push_dir(walk, path);
+                } else if (!tree_match(walk, path, name)) {
+                        b_free(path);
+                } else {
+                        const int fd   = openat(dfd, name, O_RDONLY | O_BINARY | O_CLOEXEC);
+                        bstring  *data = NULL;
+                        if (fd >= 0) {
+                                data = tree_mapped(fd, walk->flags) ? b_mmap_fd(fd, B_MMAP_NUL) : b_read_fd(fd);
+                                close(fd);
+                        }
+                        tree_add(wk, path, data);
+                }
+        }
+
+        closedir(dp);
+        b_free(dir);
+}
+
+
+static void *
+tree_worker(void *vdata)
+{
+        struct tree_worker *wk   = vdata;
+        struct tree_walk   *walk = wk->walk;
+
+        pthread_mutex_lock(&walk->lock);
+        for (;;) {
+                while (walk->ndirs == 0 && walk->busy > 0)
+                        pthread_cond_wait(&walk->cond, &walk->lock);
+                /* Nothing queued and nobody left to queue anything. */
+                if (walk->ndirs == 0)
+                        break;
+
+                bstring *dir = walk->dirs[--walk->ndirs];
+                ++walk->busy;
+                pthread_mutex_unlock(&walk->lock);
+
+                tree_scan(wk, dir);
+
+                pthread_mutex_lock(&walk->lock);
+                if (--walk->busy == 0 && walk->ndirs == 0)
+                        pthread_cond_broadcast(&walk->cond);
+        }
+        pthread_mutex_unlock(&walk->lock);
+
+        return NULL;
+}
+
+
+static int
+tree_entry_cmp(const void *va, const void *vb)
+{
+        const bstring *a = ((const struct tree_entry *)va)->path;
+        const bstring *b = ((const struct tree_entry *)vb)->path;
+        const int      r = memcmp(a->data, b->data, MIN(a->slen, b->slen));
+
+        return r ? r : (a->slen > b->slen) - (a->slen < b->slen);
+}
+
+
+/*
+ * The entries come out of the workers in no useful order, so they are sorted
+ * by path to make the result independent of scheduling.
+ */
+b_list *
+b_load_tree(const char *root, const char *pattern, const unsigned flags,
+            unsigned nthreads, b_list **contents)
+{
+        if (!root || !*root || !contents)
+                RETURN_NULL();
+
+        struct stat st;
+        if (stat(root, &st) != 0 || !S_ISDIR(st.st_mode))
+                RETURN_NULL();
+
+        struct tree_walk walk = {
+                .ndirs     = 1,
+                .mdirs     = 64,
+                .busy      = 0,
+                .rootlen   = (unsigned)strlen(root),
+                .flags     = flags,
+                .pattern   = pattern,
+                .pathmatch = pattern && strchr(pattern, '/'),
+        };
+#ifdef BSTR_USE_TALLOC
+        walk.dirs = talloc_array(NULL, bstring *, walk.mdirs);
+#else
+        walk.dirs = nmalloc(walk.mdirs, sizeof(bstring *));
+#endif
+        walk.dirs[0] = b_fromcstr(root);
+        /* Patterns with a '/' are matched against the path below root. */
+        if (root[walk.rootlen - 1] != '/')
+                ++walk.rootlen;
+        pthread_mutex_init(&walk.lock, NULL);
+        pthread_cond_init(&walk.cond, NULL);
+
+        if (nthreads == 0)
+                nthreads = BSTRING_ncpus();
+        nthreads = MAX(nthreads, 1U);
+
+        pthread_t          *tids = nalloca(nthreads, sizeof(pthread_t));
+        bool               *live = nalloca(nthreads, sizeof(bool));
+        struct tree_worker *wks  = nalloca(nthreads, sizeof(struct tree_worker));
+
+        for (unsigned i = 0; i < nthreads; ++i)
+                wks[i] = (struct tree_worker){&walk, NULL, 0, 0};
+        for (unsigned i = 1; i < nthreads; ++i)
+                live[i] = pthread_create(&tids[i], NULL, &tree_worker, &wks[i]) == 0;
+        tree_worker(&wks[0]);
+
+        unsigned total = 0;
+        for (unsigned i = 1; i < nthreads; ++i)
+                if (live[i])
+                        pthread_join(tids[i], NULL);
+        for (unsigned i = 0; i < nthreads; ++i)
+                total += wks[i].qty;
+
+        pthread_cond_destroy(&walk.cond);
+        pthread_mutex_destroy(&walk.lock);
+        free(walk.dirs);
+
+        /* Gather everything into one array to sort it. */
+#ifdef BSTR_USE_TALLOC
+        struct tree_entry *all = talloc_array(NULL, struct tree_entry, MAX(total, 1U));
+#else
+        struct tree_entry *all = nmalloc(MAX(total, 1U), sizeof(struct tree_entry));
+#endif
+        unsigned n = 0;
+        for (unsigned i = 0; i < nthreads; ++i) {
+                if (wks[i].qty)
+                        memcpy(all + n, wks[i].ents, wks[i].qty * sizeof(struct tree_entry));
+                n += wks[i].qty;
+                if (wks[i].ents)
+                        free(wks[i].ents);
+        }
+        qsort(all, total, sizeof(struct tree_entry), &tree_entry_cmp);
+
+        b_list *paths = b_list_create_alloc(MAX(total, 1U));
+        b_list *data  = b_list_create_alloc(MAX(total, 1U));
+        for (unsigned i = 0; i < total; ++i) {
+                b_list_append(paths, all[i].path);
+                b_list_append(data, all[i].data);
+        }
+        free(all);
+
+        *contents = data;
+        return paths;
+}
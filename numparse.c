@@ -0,0 +1,491 @@
+/*
+ * Length aware number parsing. Nothing here looks past the end of the input or
+ * depends on it being '\0' terminated, so fields from b_memsep, CSV records and
+ * static views can be parsed in place. The accepted syntax is always the C
+ * locale's, whatever the process locale is set to.
+ */
+
+#include "private.h"
+
+#include <math.h>
+#if defined(LC_ALL_MASK) || defined(__GLIBC__) || defined(__APPLE__) || defined(__FreeBSD__)
+#  include <locale.h>
+#  include <pthread.h>
+#  ifdef __APPLE__
+#    include <xlocale.h>
+#  endif
+#  define NUMPARSE_HAVE_STRTOD_L
+#endif
+
+#include "bstring.h"
+
+#ifdef BSTR_USE_TALLOC
+#  include <talloc.h>
+#  define free talloc_free
+#endif
+
+/* The slow path copies the text into a buffer this size before calling strtod;
+ * anything longer goes to the heap. */
+#define NUMPARSE_STACK (128U)
+
+#define IS_DIGIT(CH) ((unsigned)((CH) - '0') < 10U)
+
+static const double exact_pow10[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static const uint64_t int_pow10[] = {
+        1ULL,
+        10ULL,
+        100ULL,
+        1000ULL,
+        10000ULL,
+        100000ULL,
+        1000000ULL,
+        10000000ULL,
+        100000000ULL,
+        1000000000ULL,
+        10000000000ULL,
+        100000000000ULL,
+        1000000000000ULL,
+        10000000000000ULL,
+        100000000000000ULL,
+        1000000000000000ULL,
+};
+
+
+/*============================================================================*/
+/* Digit kernels */
+/*============================================================================*/
+
+/*
+ * Eight ASCII bytes are validated and converted at once as lanes of a 64 bit
+ * word. A number field is at most 19 or 20 digits long, so two of these cover
+ * nearly all of it and there is no vector setup to pay for. The byte order
+ * trick assumes a little endian load.
+ */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#  define NUMPARSE_SWAR
+
+static inline uint64_t
+load8(const uchar *ptr)
+{
+        uint64_t val;
+        memcpy(&val, ptr, sizeof val);
+        return val;
+}
+
+static inline bool
+swar_all_digits(const uint64_t val)
+{
+        return (((val & 0xF0F0F0F0F0F0F0F0ULL) |
+                 (((val + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4))
+                == 0x3333333333333333ULL);
+}
+
+static inline uint32_t
+swar_eight_digits(uint64_t val)
+{
+        val -= 0x3030303030303030ULL;
+        val  = (val * 10U) + (val >> 8);
+        val  = (((val & 0x000000FF000000FFULL) * (100U + (1000000ULL << 32))) +
+                (((val >> 16) & 0x000000FF000000FFULL) * (1U + (10000ULL << 32)))) >> 32;
+        return (uint32_t)val;
+}
+#endif
+
+
+/*
+ * Accumulate the run of digits at *pp into *acc, stopping at the first
+ * non-digit. Returns the number of digits consumed, or -1 if the value no
+ * longer fits in 64 bits. *acc is left undefined in that case.
+ */
+static int
+scan_uint(const uchar **pp, const uchar *const end, uint64_t *acc)
+{
+        const uchar *ptr = *pp;
+        uint64_t     val = *acc;
+        unsigned     n   = 0;
+
+#ifdef NUMPARSE_SWAR
+        /* A block of eight can't overflow while the value is below 10^11. */
+        while (end - ptr >= 8 && val < UINT64_C(100000000000)) {
+                const uint64_t word = load8(ptr);
+                if (!swar_all_digits(word))
+                        break;
+                val  = (val * 100000000U) + swar_eight_digits(word);
+                ptr += 8;
+                n   += 8;
+        }
+#endif
+        for (; ptr < end && IS_DIGIT(*ptr); ++ptr, ++n) {
+                const unsigned d = *ptr - '0';
+                if (val > (UINT64_MAX - d) / 10U) {
+                        /* Skip the rest so the caller can still find the end. */
+                        while (ptr < end && IS_DIGIT(*ptr))
+                                ++ptr;
+                        *pp = ptr;
+                        return -1;
+                }
+                val = (val * 10U) + d;
+        }
+
+        *pp  = ptr;
+        *acc = val;
+        return (int)MIN(n, (unsigned)INT_MAX);
+}
+
+
+/*
+ * Gather a run of digits into a mantissa of at most 19 significant digits.
+ * Digits past that are counted in *dropped and noted in *inexact if nonzero.
+ * *ndig bounds the number of digits held in *mant; leading zeros don't count,
+ * except that a whole block of eight may be taken at once, which only makes it
+ * an overestimate. Returns the number of digits consumed.
+ */
+static unsigned
+scan_mantissa(const uchar **pp, const uchar *const end, uint64_t *mant,
+              unsigned *ndig, unsigned *dropped, bool *inexact)
+{
+        const uchar *const start = *pp;
+        const uchar       *ptr   = start;
+        uint64_t           val   = *mant;
+        unsigned           n     = *ndig;
+
+#ifdef NUMPARSE_SWAR
+        while (end - ptr >= 8 && n <= 11) {
+                const uint64_t word = load8(ptr);
+                if (!swar_all_digits(word))
+                        break;
+                val  = (val * 100000000U) + swar_eight_digits(word);
+                n    = val ? n + 8U : 0U;
+                ptr += 8;
+        }
+#endif
+        for (; ptr < end && IS_DIGIT(*ptr); ++ptr) {
+                if (n < 19) {
+                        val = (val * 10U) + (unsigned)(*ptr - '0');
+                        n  += (val != 0);
+                } else {
+                        *inexact |= (*ptr != '0');
+                        ++*dropped;
+                }
+        }
+
+        *pp   = ptr;
+        *mant = val;
+        *ndig = n;
+        return (unsigned)(ptr - start);
+}
+
+
+/*============================================================================*/
+/* Integers */
+/*============================================================================*/
+
+/*
+ * The whole of [blk, blk + len) must be an optionally signed run of decimal
+ * digits; no whitespace is skipped. On overflow errno is ERANGE and *out is
+ * clamped to the nearest representable value, as with strtoll. Malformed
+ * input sets errno to EINVAL and leaves *out alone.
+ */
+int
+b_parse_int64_blk(const void *blk, const unsigned len, int64_t *out)
+{
+        if ((!blk && len > 0) || !out)
+                RUNTIME_ERROR();
+
+        const uchar *ptr = blk;
+        const uchar *end = ptr + len;
+        bool         neg = false;
+        uint64_t     val = 0;
+
+        if (ptr < end && (*ptr == '-' || *ptr == '+'))
+                neg = (*ptr++ == '-');
+
+        const uchar *digits = ptr;
+        const int    n      = scan_uint(&ptr, end, &val);
+        if (ptr == digits || ptr != end) {
+                errno = EINVAL;
+                return BSTR_ERR;
+        }
+
+        const uint64_t limit = neg ? (uint64_t)INT64_MAX + 1U : (uint64_t)INT64_MAX;
+        if (n < 0 || val > limit) {
+                *out  = neg ? INT64_MIN : INT64_MAX;
+                errno = ERANGE;
+                return BSTR_ERR;
+        }
+
+        *out = neg ? (int64_t)(0U - val) : (int64_t)val;
+        return BSTR_OK;
+}
+
+
+int
+b_parse_uint64_blk(const void *blk, const unsigned len, uint64_t *out)
+{
+        if ((!blk && len > 0) || !out)
+                RUNTIME_ERROR();
+
+        const uchar *ptr = blk;
+        const uchar *end = ptr + len;
+        uint64_t     val = 0;
+
+        if (ptr < end && *ptr == '+')
+                ++ptr;
+
+        const uchar *digits = ptr;
+        const int    n      = scan_uint(&ptr, end, &val);
+        if (ptr == digits || ptr != end) {
+                errno = EINVAL;
+                return BSTR_ERR;
+        }
+        if (n < 0) {
+                *out  = UINT64_MAX;
+                errno = ERANGE;
+                return BSTR_ERR;
+        }
+
+        *out = val;
+        return BSTR_OK;
+}
+
+
+int
+b_parse_int64(const bstring *str, int64_t *out)
+{
+        if (INVALID(str))
+                RUNTIME_ERROR();
+        return b_parse_int64_blk(str->data, str->slen, out);
+}
+
+
+int
+b_parse_uint64(const bstring *str, uint64_t *out)
+{
+        if (INVALID(str))
+                RUNTIME_ERROR();
+        return b_parse_uint64_blk(str->data, str->slen, out);
+}
+
+
+/*============================================================================*/
+/* Floating point */
+/*============================================================================*/
+
+#ifdef NUMPARSE_HAVE_STRTOD_L
+static locale_t       c_locale;
+static pthread_once_t c_locale_once = PTHREAD_ONCE_INIT;
+
+static void
+c_locale_init(void)
+{
+        c_locale = newlocale(LC_ALL_MASK, "C", (locale_t)0);
+}
+#endif
+
+
+/*
+ * Correctly rounded conversion of text the caller has already validated, for
+ * the cases the fast path can't do exactly. strtod is handed a terminated copy
+ * and, where available, the C locale so that '.' is always the radix point.
+ */
+static double
+parse_double_slow(const uchar *text, const unsigned len)
+{
+        char  stackbuf[NUMPARSE_STACK];
+        char *buf = stackbuf;
+
+        if (len >= sizeof stackbuf) {
+#ifdef BSTR_USE_TALLOC
+                buf = talloc_size(NULL, (size_t)len + 1U);
+#else
+                buf = malloc((size_t)len + 1U);
+#endif
+                if (!buf)
+                        FATAL_ERROR("Out of memory");
+        }
+        memcpy(buf, text, len);
+        buf[len] = '\0';
+
+#ifdef NUMPARSE_HAVE_STRTOD_L
+        pthread_once(&c_locale_once, c_locale_init);
+        const double ret = c_locale ? strtod_l(buf, NULL, c_locale) : strtod(buf, NULL);
+#else
+        const double ret = strtod(buf, NULL);
+#endif
+
+        if (buf != stackbuf)
+                free(buf);
+        return ret;
+}
+
+
+static bool
+match_word(const uchar *ptr, const uchar *end, const char *word)
+{
+        const size_t wlen = strlen(word);
+        if ((size_t)(end - ptr) != wlen)
+                return false;
+        for (size_t i = 0; i < wlen; ++i)
+                if ((ptr[i] | 0x20) != (uchar)word[i])
+                        return false;
+        return true;
+}
+
+
+/*
+ * Accepts [+-] followed by digits with an optional '.' and fraction (at least
+ * one digit on either side), an optional exponent, or one of "inf",
+ * "infinity" and "nan" in any case. Hex floats and surrounding whitespace are
+ * rejected. Up to 19 significant digits are gathered into an integer; when
+ * that integer and the power of ten are both exact doubles, one multiply or
+ * divide gives the correctly rounded result. Everything else (long mantissas,
+ * large exponents) goes through strtod.
+ *
+ * A result that overflows to infinity, or a nonzero input that underflows to
+ * zero, sets errno to ERANGE; *out is still set, to +-HUGE_VAL or +-0.0.
+ */
+int
+b_parse_double_blk(const void *blk, const unsigned len, double *out)
+{
+        if ((!blk && len > 0) || !out)
+                RUNTIME_ERROR();
+
+        const uchar *const start = blk;
+        const uchar *const end   = start + len;
+        const uchar       *ptr   = start;
+        bool               neg   = false;
+
+        if (ptr < end && (*ptr == '-' || *ptr == '+'))
+                neg = (*ptr++ == '-');
+
+        if (ptr < end && !IS_DIGIT(*ptr) && *ptr != '.') {
+                if (match_word(ptr, end, "inf") || match_word(ptr, end, "infinity")) {
+                        *out = neg ? -HUGE_VAL : HUGE_VAL;
+                        return BSTR_OK;
+                }
+                if (match_word(ptr, end, "nan")) {
+                        *out = neg ? -NAN : NAN;
+                        return BSTR_OK;
+                }
+                goto malformed;
+        }
+
+        uint64_t mant    = 0;
+        unsigned ndig    = 0;
+        unsigned dropped = 0;
+        bool     inexact = false;
+
+        /* Integer digits that don't fit scale the result up; fraction digits
+         * that do fit scale it down. */
+        const unsigned nint  = scan_mantissa(&ptr, end, &mant, &ndig, &dropped, &inexact);
+        int64_t        exp10 = dropped;
+        bool           have_digits = (nint > 0);
+
+        if (ptr < end && *ptr == '.') {
+                ++ptr;
+                dropped = 0;
+                const unsigned nfrac = scan_mantissa(&ptr, end, &mant, &ndig, &dropped, &inexact);
+                exp10      -= (int64_t)nfrac - dropped;
+                have_digits = have_digits || (nfrac > 0);
+        }
+        if (!have_digits)
+                goto malformed;
+        const bool nonzero = (mant != 0) || inexact;
+
+        if (ptr < end && (*ptr == 'e' || *ptr == 'E')) {
+                bool eneg = false;
+                ++ptr;
+                if (ptr < end && (*ptr == '-' || *ptr == '+'))
+                        eneg = (*ptr++ == '-');
+                if (ptr == end || !IS_DIGIT(*ptr))
+                        goto malformed;
+
+                int64_t e = 0;
+                for (; ptr < end && IS_DIGIT(*ptr); ++ptr)
+                        if (e < 100000)
+                                e = (e * 10) + (*ptr - '0');
+                exp10 += eneg ? -e : e;
+        }
+        if (ptr != end)
+                goto malformed;
+
+        double ret;
+        if (!nonzero) {
+                ret = 0.0;
+        } else if (!inexact && mant <= (UINT64_C(1) << 53) && exp10 >= -22 && exp10 <= 22) {
+                ret = (exp10 < 0) ? (double)mant / exact_pow10[-exp10]
+                                  : (double)mant * exact_pow10[exp10];
+        } else if (!inexact && mant <= (UINT64_C(1) << 53) && exp10 > 22 && exp10 <= 22 + 15 &&
+                   mant <= (UINT64_C(1) << 53) / int_pow10[exp10 - 22]) {
+                /* Shift the excess into the mantissa while it stays exact. */
+                ret = (double)(mant * int_pow10[exp10 - 22]) * 1e22;
+        } else {
+                ret = fabs(parse_double_slow(start, len));
+        }
+
+        *out = neg ? -ret : ret;
+        if (isinf(ret) || (ret == 0.0 && nonzero)) {
+                errno = ERANGE;
+                return BSTR_ERR;
+        }
+        return BSTR_OK;
+
+malformed:
+        errno = EINVAL;
+        return BSTR_ERR;
+}
+
+
+int
+b_parse_double(const bstring *str, double *out)
+{
+        if (INVALID(str))
+                RUNTIME_ERROR();
+        return b_parse_double_blk(str->data, str->slen, out);
+}
+
+
+/*============================================================================*/
+/* Whole columns */
+/*============================================================================*/
+
+/*
+ * Parse every entry of a list into out[0 .. qty). An entry that fails leaves
+ * 0 (or NaN for doubles) in its slot, except that overflow stores the clamped
+ * value. The return is the number of entries that failed, so 0 means the whole
+ * column parsed cleanly; if first_bad is not NULL it receives the index of the
+ * first failure, or -1.
+ */
+#define PARSE_COLUMN(FUNC, TYPE, BADVAL)                                          \
+        int64_t                                                                   \
+        b_list_##FUNC(const b_list *list, TYPE *out, int64_t *first_bad)          \
+        {                                                                         \
+                if (!list || (!out && list->qty > 0))                             \
+                        RUNTIME_ERROR();                                          \
+                                                                                  \
+                int64_t nbad = 0;                                                 \
+                if (first_bad)                                                    \
+                        *first_bad = -1;                                          \
+                                                                                  \
+                for (unsigned i = 0; i < list->qty; ++i) {                        \
+                        const bstring *str = list->lst[i];                        \
+                        out[i] = BADVAL;                                          \
+                        if (str && str->data &&                                   \
+                            b_##FUNC##_blk(str->data, str->slen, &out[i]) == BSTR_OK) \
+                                continue;                                         \
+                        if (nbad++ == 0 && first_bad)                             \
+                                *first_bad = i;                                   \
+                }                                                                 \
+                                                                                  \
+                return nbad;                                                      \
+        }
+
+PARSE_COLUMN(parse_int64,  int64_t,  0)
+PARSE_COLUMN(parse_uint64, uint64_t, 0)
+PARSE_COLUMN(parse_double, double,   NAN)
+
+#undef PARSE_COLUMN
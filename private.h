@@ -211,6 +211,37 @@ struct gen_b_list {
 /* bstrlib.c */
 __attribute__((__const__)) BSTR_PRIVATE uint snapUpSize(uint i);
 
+/* additions.c */
+
+/*
+ * Character class used by the multi-delimiter scanners. The two nibble tables
+ * drive the SSSE3 lookup (one row for high nibbles 0-7, one for 8-15), the map
+ * is the plain 256 bit fallback. Small sets (4 or fewer characters) are also
+ * kept verbatim so that the SSE2 path can just compare against each of them.
+ */
+struct b_charset {
+        uint8_t  nib_lo[16];
+        uint8_t  nib_hi[16];
+        uint32_t map[8];
+        uchar    ch[4];
+        unsigned n;
+};
+
+#define B_CHARSET_TEST(CS, CH) \
+        (((CS)->map[((uchar)(CH)) >> 5] >> (((uchar)(CH)) & 31U)) & 1U)
+
+BSTR_PRIVATE void         BSTRING_charset_init(struct b_charset *cs, const uchar *set, unsigned len);
+BSTR_PRIVATE const uchar *BSTRING_charset_find(const struct b_charset *cs, const uchar *ptr, const uchar *end) PURE;
+BSTR_PRIVATE const uchar *BSTRING_memmem(const uchar *hay, size_t hlen, const uchar *needle, size_t nlen) PURE;
+BSTR_PRIVATE unsigned     BSTRING_ncpus(void);
+
+struct iovec;
+BSTR_PRIVATE int64_t      BSTRING_writev(int fd, struct iovec *iov, int cnt);
+
+/* format.c */
+BSTR_PRIVATE unsigned     BSTRING_udigits(uint64_t val) __attribute__((__const__));
+BSTR_PRIVATE void         BSTRING_utoa(uchar *out, uint64_t val, unsigned ndigits);
+
 
 /*============================================================================*/
 
@@ -223,6 +254,7 @@ __attribute__((__const__)) BSTR_PRIVATE uint snapUpSize(uint i);
 #define IS_NULL(BSTR)   (!(BSTR) || !(BSTR)->data)
 #define INVALID(BSTR)   (IS_NULL(BSTR))
 #define IS_CLONE(BSTR)  ((BSTR)->flags & BSTR_CLONE)
+#define IS_MAPPED(BSTR) ((BSTR)->flags & BSTR_MAPPED)
 #define NO_WRITE(BSTR)  (!((BSTR)->flags & BSTR_WRITE_ALLOWED) || IS_CLONE(BSTR))
 #define NO_ALLOC(BSTR)  (!((BSTR)->flags & BSTR_DATA_FREEABLE))
 #define IS_STATIC(BSTR) (NO_WRITE(BSTR) && NO_ALLOC(BSTR))
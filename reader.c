@@ -0,0 +1,292 @@
+/*
+ * Block buffered line reader. Input is read in large blocks and terminators
+ * are found with memchr (or memmem for multi-byte terminators) over the whole
+ * buffer, instead of one indirect getc call and one capacity check per byte as
+ * with b_gets. Lines are handed out as views into the buffer or appended to a
+ * caller's bstring.
+ */
+
+#include "private.h"
+
+#include "bstring.h"
+
+#ifdef BSTR_USE_TALLOC
+#  include <talloc.h>
+#  define free talloc_free
+#endif
+
+#define READER_INIT_READ (65536U)
+
+struct b_reader {
+        bstring  *buf;
+        unsigned  pos;
+        unsigned  len;
+        unsigned  scan;
+        int       fd;
+        FILE     *fp;
+        bool      eof;
+        unsigned  flags;
+        uint64_t  lineno;
+        unsigned  tlen;
+        uchar     term[];
+};
+
+
+static b_reader *
+reader_new(const bstring *term, const unsigned flags)
+{
+        static const bstring newline = bt_init("\n");
+
+        if (!term)
+                term = &newline;
+        if (INVALID(term) || term->slen == 0)
+                RETURN_NULL();
+
+#ifdef BSTR_USE_TALLOC
+        b_reader *rd = talloc_size(NULL, sizeof(b_reader) + term->slen);
+#else
+        b_reader *rd = malloc(sizeof(b_reader) + term->slen);
+#endif
+        rd->buf    = b_create(READER_INIT_READ);
+        rd->pos    = rd->len = rd->scan = 0;
+        rd->fd     = (-1);
+        rd->fp     = NULL;
+        rd->eof    = false;
+        rd->flags  = flags;
+        rd->lineno = 0;
+        rd->tlen   = term->slen;
+        memcpy(rd->term, term->data, term->slen);
+
+        return rd;
+}
+
+
+b_reader *
+b_reader_open_fd(const int fd, const bstring *term, const unsigned flags)
+{
+        if (fd < 0)
+                RETURN_NULL();
+
+        b_reader *rd = reader_new(term, flags);
+        if (rd)
+                rd->fd = fd;
+        return rd;
+}
+
+
+b_reader *
+b_reader_open_fp(FILE *fp, const bstring *term, const unsigned flags)
+{
+        if (!fp)
+                RETURN_NULL();
+
+        b_reader *rd = reader_new(term, flags);
+        if (rd)
+                rd->fp = fp;
+        return rd;
+}
+
+
+void
+b_reader_close(b_reader *rd)
+{
+        if (!rd)
+                return;
+        b_free(rd->buf);
+        free(rd);
+}
+
+
+uint64_t
+b_reader_lineno(const b_reader *rd)
+{
+        return rd ? rd->lineno : 0;
+}
+
+
+/*
+ * Discard the lines already returned and read more data behind the rest, in
+ * the same way as the CSV reader: the buffer doubles whenever less than a
+ * quarter of it is free, so one huge line costs O(log n) copies.
+ */
+static int
+reader_fill(b_reader *rd)
+{
+        bstring *buf = rd->buf;
+
+        if (rd->pos > 0) {
+                memmove(buf->data, buf->data + rd->pos, rd->len - rd->pos);
+                rd->len  -= rd->pos;
+                rd->scan -= rd->pos;
+                rd->pos   = 0;
+        }
+        if ((buf->mlen - 1U) - rd->len < buf->mlen / 4U) {
+                if ((uint64_t)buf->mlen * 2U >= UINT32_MAX)
+                        RUNTIME_ERROR();
+                buf->slen = rd->len;
+                if (b_alloc(buf, buf->mlen * 2U) != BSTR_OK)
+                        RUNTIME_ERROR();
+        }
+
+        const size_t room = (buf->mlen - 1U) - rd->len;
+        ssize_t      nread;
+
+        if (rd->fp) {
+                nread = (ssize_t)fread(buf->data + rd->len, 1, room, rd->fp);
+                if (nread == 0 && ferror(rd->fp))
+                        RUNTIME_ERROR();
+        } else {
+                do
+                        nread = read(rd->fd, buf->data + rd->len, room);
+                while (nread < 0 && errno == EINTR);
+                if (nread < 0)
+                        RUNTIME_ERROR();
+        }
+
+        if (nread == 0)
+                rd->eof = true;
+        rd->len  += (unsigned)nread;
+        buf->slen = rd->len;
+
+        return BSTR_OK;
+}
+
+
+/*
+ * Find the next line, reading more input as needed. On success *start and
+ * *len describe the line (with its terminator only if B_READER_KEEP_TERM is
+ * set) and the line is consumed. Returns 1, 0 at EOF or BSTR_ERR.
+ */
+static int
+reader_line(b_reader *rd, const uchar **start, unsigned *len)
+{
+        const uchar *hit;
+
+        for (;;) {
+                const uchar   *data  = rd->buf->data;
+                const unsigned avail = rd->len - rd->scan;
+
+                if (rd->tlen == 1)
+                        hit = memchr(data + rd->scan, rd->term[0], avail);
+                else
+                        hit = avail >= rd->tlen
+                            ? BSTRING_memmem(data + rd->scan, avail, rd->term, rd->tlen)
+                            : NULL;
+                if (hit)
+                        break;
+
+                /* A terminator may straddle the end of the buffer. */
+                rd->scan = (avail >= rd->tlen) ? rd->len - (rd->tlen - 1U) : rd->scan;
+
+                if (rd->eof) {
+                        if (rd->pos == rd->len)
+                                return 0;
+                        /* The last line needn't be terminated. */
+                        *start   = data + rd->pos;
+                        *len     = rd->len - rd->pos;
+                        rd->pos  = rd->scan = rd->len;
+                        ++rd->lineno;
+                        return 1;
+                }
+                if (reader_fill(rd) != BSTR_OK)
+                        RUNTIME_ERROR();
+        }
+
+        const uchar   *data = rd->buf->data;
+        const unsigned end  = (unsigned)PTRSUB(hit, data);
+        unsigned       n    = end - rd->pos;
+
+        if (rd->flags & B_READER_KEEP_TERM)
+                n += rd->tlen;
+        else if ((rd->flags & B_READER_CRLF) && n > 0 && data[rd->pos + n - 1U] == '\r')
+                --n;
+
+        *start   = data + rd->pos;
+        *len     = n;
+        rd->pos  = rd->scan = end + rd->tlen;
+        ++rd->lineno;
+
+        return 1;
+}
+
+
+int
+b_reader_next(b_reader *rd, bstring *line)
+{
+        if (!rd || !line)
+                RUNTIME_ERROR();
+
+        const uchar *start;
+        unsigned     len;
+        const int    ret = reader_line(rd, &start, &len);
+
+        if (ret == 1)
+                *line = bt_fromblk(start, len);
+        return ret;
+}
+
+
+int
+b_reader_geta(b_reader *rd, bstring *dest)
+{
+        if (!rd || INVALID(dest) || NO_WRITE(dest))
+                RUNTIME_ERROR();
+
+        const uchar *start;
+        unsigned     len;
+        const int    ret = reader_line(rd, &start, &len);
+
+        if (ret == 1 && b_catblk(dest, start, len) != BSTR_OK)
+                RUNTIME_ERROR();
+        return ret;
+}
+
+
+/*
+ * Pass the next len bytes (UINT64_MAX for the rest of the input) through to
+ * out_fd untouched. Whatever the reader has already buffered goes first; the
+ * remainder bypasses the buffer entirely with b_fd_transfer. A FILE * may hold
+ * read-ahead of its own, so that case is pumped through the reader's buffer.
+ */
+int64_t
+b_reader_transfer(b_reader *rd, const int out_fd, const uint64_t len)
+{
+        if (!rd || out_fd < 0)
+                RUNTIME_ERROR();
+
+        uint64_t left  = len;
+        int64_t  total = 0;
+
+        while (left > 0) {
+                const unsigned have = (unsigned)MIN((uint64_t)(rd->len - rd->pos), left);
+
+                if (have > 0) {
+                        bstring view = bt_fromblk(rd->buf->data + rd->pos, have);
+                        if (b_write(out_fd, &view) != BSTR_OK)
+                                RUNTIME_ERROR();
+                        rd->pos  += have;
+                        rd->scan  = MAX(rd->scan, rd->pos);
+                        total    += have;
+                        left     -= have;
+                        continue;
+                }
+                if (rd->eof)
+                        break;
+
+                if (rd->fp) {
+                        if (reader_fill(rd) != BSTR_OK)
+                                RUNTIME_ERROR();
+                        continue;
+                }
+
+                const int64_t n = b_fd_transfer(out_fd, rd->fd, left);
+                if (n < 0)
+                        RUNTIME_ERROR();
+                if ((uint64_t)n < left)
+                        rd->eof = true;
+                total += n;
+                left  -= (uint64_t)n;
+        }
+
+        return total;
+}
@@ -0,0 +1,570 @@
+/*
+ * Ropes: immutable, reference counted AVL trees whose leaves are slices of
+ * bstrings. Subtrees are shared freely between ropes, so concatenation,
+ * insertion, deletion and substring extraction are all O(log n) and never
+ * copy more than a single small leaf.
+ *
+ * Ownership convention for the node helpers below: every function consumes
+ * one reference to each node passed in and returns a new reference.
+ */
+
+#include "private.h"
+
+#include "bstring.h"
+
+#ifdef BSTR_USE_TALLOC
+#  include <talloc.h>
+#  define free talloc_free
+#endif
+
+/* Adjacent leaves whose combined size is at most this are merged. */
+#define ROPE_LEAF_MAX (1024U)
+
+struct rope_buf {
+        bstring *str;
+        unsigned refs;
+};
+
+struct b_rope_node {
+        struct b_rope_node *left;
+        struct b_rope_node *right;
+        struct rope_buf    *buf;
+        uint64_t            len;
+        unsigned            off;
+        unsigned            refs;
+        uint8_t             height;
+};
+
+struct b_rope {
+        struct b_rope_node *root;
+};
+
+typedef struct b_rope_node node;
+
+#define IS_LEAF(N)   ((N)->buf != NULL)
+#define LEAF_DATA(N) ((N)->buf->str->data + (N)->off)
+
+
+/*============================================================================*/
+/* Node management */
+/*============================================================================*/
+
+
+static node *
+node_alloc(void)
+{
+#ifdef BSTR_USE_TALLOC
+        node *n = talloc(NULL, node);
+#else
+        node *n = malloc(sizeof(node));
+#endif
+        if (!n)
+                FATAL_ERROR("Out of memory");
+        n->refs = 1;
+        return n;
+}
+
+
+static inline node *
+node_ref(node *n)
+{
+        if (n)
+                ++n->refs;
+        return n;
+}
+
+
+static void
+buf_unref(struct rope_buf *buf)
+{
+        if (--buf->refs > 0)
+                return;
+        b_free(buf->str);
+        free(buf);
+}
+
+
+static void
+node_unref(node *n)
+{
+        if (!n || --n->refs > 0)
+                return;
+        if (IS_LEAF(n)) {
+                buf_unref(n->buf);
+        } else {
+                node_unref(n->left);
+                node_unref(n->right);
+        }
+        free(n);
+}
+
+
+/* Takes over one reference to buf. */
+static node *
+leaf_new(struct rope_buf *buf, const unsigned off, const unsigned len)
+{
+        node *n   = node_alloc();
+        n->left   = n->right = NULL;
+        n->buf    = buf;
+        n->off    = off;
+        n->len    = len;
+        n->height = 0;
+        return n;
+}
+
+
+/* Takes over ownership of str. */
+static node *
+leaf_from_bstr(bstring *str)
+{
+#ifdef BSTR_USE_TALLOC
+        struct rope_buf *buf = talloc(NULL, struct rope_buf);
+#else
+        struct rope_buf *buf = malloc(sizeof(struct rope_buf));
+#endif
+        buf->str  = str;
+        buf->refs = 1;
+        return leaf_new(buf, 0, str->slen);
+}
+
+
+static node *
+leaf_from_blk(const void *blk, const unsigned len)
+{
+        bstring *str = b_create(MAX(len, ROPE_LEAF_MAX / 4U));
+        memcpy(str->data, blk, len);
+        str->data[(str->slen = len)] = (uchar)'\0';
+        return leaf_from_bstr(str);
+}
+
+
+static node *
+node_join(node *l, node *r)
+{
+        node *n   = node_alloc();
+        n->left   = l;
+        n->right  = r;
+        n->buf    = NULL;
+        n->off    = 0;
+        n->len    = l->len + r->len;
+        n->height = (uint8_t)(MAX(l->height, r->height) + 1U);
+        return n;
+}
+
+
+/*
+ * Two adjacent small leaves become one. If the left leaf is the only user of a
+ * buffer it reaches the end of, the right one is simply appended to it.
+ */
+static node *
+leaf_merge(node *l, node *r)
+{
+        bstring *str = l->buf->str;
+
+        if (l->refs == 1 && l->buf->refs == 1 && l->off + l->len == str->slen &&
+            b_catblk(str, LEAF_DATA(r), (unsigned)r->len) == BSTR_OK) {
+                l->len += r->len;
+                node_unref(r);
+                return l;
+        }
+
+        const unsigned total = (unsigned)(l->len + r->len);
+        str = b_create(MAX(total, ROPE_LEAF_MAX / 2U));
+        memcpy(str->data, LEAF_DATA(l), l->len);
+        memcpy(str->data + l->len, LEAF_DATA(r), r->len);
+        str->data[(str->slen = total)] = (uchar)'\0';
+
+        node_unref(l);
+        node_unref(r);
+        return leaf_from_bstr(str);
+}
+
+
+/*============================================================================*/
+/* Balancing, concatenation and splitting */
+/*============================================================================*/
+
+
+/* Join two trees whose heights differ by at most 2, rotating if needed. */
+static node *
+rope_balance(node *l, node *r)
+{
+        if (l->height > r->height + 1) {
+                node *ll = node_ref(l->left);
+                node *lr = node_ref(l->right);
+                node_unref(l);
+                if (ll->height >= lr->height)
+                        return node_join(ll, node_join(lr, r));
+
+                node *lrl = node_ref(lr->left);
+                node *lrr = node_ref(lr->right);
+                node_unref(lr);
+                return node_join(node_join(ll, lrl), node_join(lrr, r));
+        }
+
+        if (r->height > l->height + 1) {
+                node *rl = node_ref(r->left);
+                node *rr = node_ref(r->right);
+                node_unref(r);
+                if (rr->height >= rl->height)
+                        return node_join(node_join(l, rl), rr);
+
+                node *rll = node_ref(rl->left);
+                node *rlr = node_ref(rl->right);
+                node_unref(rl);
+                return node_join(node_join(l, rll), node_join(rlr, rr));
+        }
+
+        return node_join(l, r);
+}
+
+
+static node *
+rope_concat(node *l, node *r)
+{
+        if (!l || l->len == 0) {
+                node_unref(l);
+                return r;
+        }
+        if (!r || r->len == 0) {
+                node_unref(r);
+                return l;
+        }
+        if (IS_LEAF(l) && IS_LEAF(r) && l->len + r->len <= ROPE_LEAF_MAX)
+                return leaf_merge(l, r);
+
+        /* Descend the spine of the taller tree. A small leaf is always pushed
+         * down to its neighbouring leaf so that runs of tiny appends coalesce
+         * instead of each getting a node of their own. */
+        if (!IS_LEAF(l) && (l->height > r->height + 1 || (IS_LEAF(r) && r->len < ROPE_LEAF_MAX))) {
+                node *ll = node_ref(l->left);
+                node *lr = node_ref(l->right);
+                node_unref(l);
+                return rope_balance(ll, rope_concat(lr, r));
+        }
+        if (!IS_LEAF(r) && (r->height > l->height + 1 || (IS_LEAF(l) && l->len < ROPE_LEAF_MAX))) {
+                node *rl = node_ref(r->left);
+                node *rr = node_ref(r->right);
+                node_unref(r);
+                return rope_balance(rope_concat(l, rl), rr);
+        }
+
+        return node_join(l, r);
+}
+
+
+static void
+rope_split(node *n, const uint64_t pos, node **lp, node **rp)
+{
+        if (!n || pos == 0) {
+                *lp = NULL;
+                *rp = n;
+                return;
+        }
+        if (pos >= n->len) {
+                *lp = n;
+                *rp = NULL;
+                return;
+        }
+
+        if (IS_LEAF(n)) {
+                n->buf->refs += 2;
+                *lp = leaf_new(n->buf, n->off, (unsigned)pos);
+                *rp = leaf_new(n->buf, n->off + (unsigned)pos, (unsigned)(n->len - pos));
+                node_unref(n);
+                return;
+        }
+
+        node *l = node_ref(n->left);
+        node *r = node_ref(n->right);
+        node *a, *b;
+        node_unref(n);
+
+        if (pos < l->len) {
+                rope_split(l, pos, &a, &b);
+                *lp = a;
+                *rp = rope_concat(b, r);
+        } else {
+                rope_split(r, pos - l->len, &a, &b);
+                *lp = rope_concat(l, a);
+                *rp = b;
+        }
+}
+
+
+/*============================================================================*/
+/* Public interface */
+/*============================================================================*/
+
+
+b_rope *
+b_rope_create(void)
+{
+#ifdef BSTR_USE_TALLOC
+        b_rope *rope = talloc(NULL, b_rope);
+#else
+        b_rope *rope = malloc(sizeof(b_rope));
+#endif
+        rope->root = NULL;
+        return rope;
+}
+
+
+b_rope *
+b_rope_from_bstr(const bstring *bstr)
+{
+        if (INVALID(bstr))
+                RETURN_NULL();
+
+        b_rope *rope = b_rope_create();
+        b_rope_append(rope, bstr);
+        return rope;
+}
+
+
+b_rope *
+b_rope_copy(const b_rope *rope)
+{
+        if (!rope)
+                RETURN_NULL();
+
+        b_rope *ret = b_rope_create();
+        ret->root   = node_ref(rope->root);
+        return ret;
+}
+
+
+void
+b_rope_destroy(b_rope *rope)
+{
+        if (!rope)
+                return;
+        node_unref(rope->root);
+        free(rope);
+}
+
+
+uint64_t
+b_rope_len(const b_rope *rope)
+{
+        return (rope && rope->root) ? rope->root->len : 0;
+}
+
+
+int
+b_rope_append_blk(b_rope *rope, const void *blk, const unsigned len)
+{
+        if (!rope || (!blk && len > 0))
+                RUNTIME_ERROR();
+        if (len > 0)
+                rope->root = rope_concat(rope->root, leaf_from_blk(blk, len));
+
+        return BSTR_OK;
+}
+
+
+int
+b_rope_append(b_rope *rope, const bstring *bstr)
+{
+        if (!rope || INVALID(bstr))
+                RUNTIME_ERROR();
+
+        return b_rope_append_blk(rope, bstr->data, bstr->slen);
+}
+
+
+int
+b_rope_append_steal(b_rope *rope, bstring *bstr)
+{
+        if (!rope || INVALID(bstr) || NO_WRITE(bstr) || NO_ALLOC(bstr) ||
+            !(bstr->flags & BSTR_FREEABLE))
+                RUNTIME_ERROR();
+
+        if (bstr->slen == 0)
+                b_free(bstr);
+        else
+                rope->root = rope_concat(rope->root, leaf_from_bstr(bstr));
+
+        return BSTR_OK;
+}
+
+
+int
+b_rope_concat(b_rope *dest, const b_rope *src)
+{
+        if (!dest || !src)
+                RUNTIME_ERROR();
+
+        dest->root = rope_concat(dest->root, node_ref(src->root));
+        return BSTR_OK;
+}
+
+
+int
+b_rope_insert_rope(b_rope *rope, const uint64_t pos, const b_rope *src)
+{
+        if (!rope || !src || pos > b_rope_len(rope))
+                RUNTIME_ERROR();
+
+        /* Take the reference first: the split releases the old root, which
+         * is also src's when a rope is inserted into itself. */
+        node *ins = node_ref(src->root);
+        node *l, *r;
+        rope_split(rope->root, pos, &l, &r);
+        rope->root = rope_concat(rope_concat(l, ins), r);
+
+        return BSTR_OK;
+}
+
+
+int
+b_rope_insert(b_rope *rope, const uint64_t pos, const bstring *bstr)
+{
+        if (!rope || INVALID(bstr) || pos > b_rope_len(rope))
+                RUNTIME_ERROR();
+        if (bstr->slen == 0)
+                return BSTR_OK;
+
+        node *l, *r;
+        rope_split(rope->root, pos, &l, &r);
+        rope->root = rope_concat(rope_concat(l, leaf_from_blk(bstr->data, bstr->slen)), r);
+
+        return BSTR_OK;
+}
+
+
+int
+b_rope_delete(b_rope *rope, const uint64_t pos, uint64_t len)
+{
+        if (!rope || pos > b_rope_len(rope))
+                RUNTIME_ERROR();
+        if (len > b_rope_len(rope) - pos)
+                len = b_rope_len(rope) - pos;
+        if (len == 0)
+                return BSTR_OK;
+
+        node *l, *mid, *r;
+        rope_split(rope->root, pos, &l, &r);
+        rope_split(r, len, &mid, &r);
+        node_unref(mid);
+        rope->root = rope_concat(l, r);
+
+        return BSTR_OK;
+}
+
+
+b_rope *
+b_rope_substr(const b_rope *rope, const uint64_t pos, uint64_t len)
+{
+        if (!rope || pos > b_rope_len(rope))
+                RETURN_NULL();
+        if (len > b_rope_len(rope) - pos)
+                len = b_rope_len(rope) - pos;
+
+        node *l, *mid, *r;
+        rope_split(node_ref(rope->root), pos, &l, &r);
+        rope_split(r, len, &mid, &r);
+        node_unref(l);
+        node_unref(r);
+
+        b_rope *ret = b_rope_create();
+        ret->root   = mid;
+        return ret;
+}
+
+
+int
+b_rope_index(const b_rope *rope, uint64_t pos)
+{
+        if (!rope || pos >= b_rope_len(rope))
+                RUNTIME_ERROR();
+
+        const node *n = rope->root;
+        while (!IS_LEAF(n)) {
+                if (pos < n->left->len) {
+                        n = n->left;
+                } else {
+                        pos -= n->left->len;
+                        n = n->right;
+                }
+        }
+
+        return LEAF_DATA(n)[pos];
+}
+
+
+int
+b_rope_flatten_append(bstring *dest, const b_rope *rope)
+{
+        if (INVALID(dest) || NO_WRITE(dest) || !rope)
+                RUNTIME_ERROR();
+
+        const uint64_t total = (uint64_t)dest->slen + b_rope_len(rope);
+        if (total >= UINT32_MAX)
+                RUNTIME_ERROR();
+        if (dest->mlen <= total && b_alloc(dest, (unsigned)total + 1U) != BSTR_OK)
+                RUNTIME_ERROR();
+
+        b_rope_iter it;
+        bstring     chunk;
+
+        b_rope_iter_init(&it, rope);
+        while (b_rope_iter_next(&it, &chunk)) {
+                memcpy(dest->data + dest->slen, chunk.data, chunk.slen);
+                dest->slen += chunk.slen;
+        }
+        dest->data[dest->slen] = (uchar)'\0';
+
+        return BSTR_OK;
+}
+
+
+bstring *
+b_rope_flatten(const b_rope *rope)
+{
+        if (!rope || b_rope_len(rope) >= UINT32_MAX)
+                RETURN_NULL();
+
+        bstring *ret = b_create((unsigned)b_rope_len(rope));
+        if (b_rope_flatten_append(ret, rope) != BSTR_OK) {
+                b_free(ret);
+                RETURN_NULL();
+        }
+
+        return ret;
+}
+
+
+/*============================================================================*/
+/* Iteration */
+/*============================================================================*/
+
+
+void
+b_rope_iter_init(b_rope_iter *it, const b_rope *rope)
+{
+        it->depth = 0;
+        if (rope && rope->root)
+                it->stack[it->depth++] = rope->root;
+}
+
+
+bool
+b_rope_iter_next(b_rope_iter *it, bstring *chunk)
+{
+        while (it->depth > 0) {
+                const node *n = it->stack[--it->depth];
+
+                /* AVL height bounds the stack far below B_ROPE_MAX_DEPTH. */
+                while (!IS_LEAF(n)) {
+                        it->stack[it->depth++] = n->right;
+                        n = n->left;
+                }
+                if (n->len > 0) {
+                        *chunk = bt_fromblk(LEAF_DATA(n), (unsigned)n->len);
+                        return true;
+                }
+        }
+
+        return false;
+}
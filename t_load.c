@@ -0,0 +1,19 @@
+#include "bstring.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+int main(int argc, char **argv){
+  b_list *paths = b_list_create_alloc(16);
+  const char *files[] = {"/proc/self/status","/proc/cpuinfo","/etc/passwd","/nonexistent","/root/repo/format.c","/proc/self/maps", "/dev/null"};
+  for (unsigned i=0;i<sizeof files/sizeof*files;++i) b_list_append(paths, b_fromcstr(files[i]));
+  for (int mode=0; mode<2; ++mode){
+    b_list *r = b_load_files(paths, mode ? 0x1 : 0, 0);
+    for (unsigned i=0;i<r->qty;++i){
+      int fd = open(files[i], O_RDONLY); bstring *ref = fd>=0 ? b_read_fd(fd) : NULL; if(fd>=0) close(fd);
+      printf("mode%d %-22s got=%d ref=%d %s\n", mode, files[i], r->lst[i]? (int)r->lst[i]->slen : -1, ref?(int)ref->slen:-1,
+        (r->lst[i] && ref && r->lst[i]->slen==ref->slen)?"":"  <-- DIFF");
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,51 @@
+/*
+ * Regression test: growing the string for a double with a precision used to
+ * drop the room reserved for the arguments after it, so they were written
+ * past the end of the buffer whenever the double landed just below one of
+ * b_alloc's size steps. Build against the library sources and run under ASan:
+ *
+ *   cc -std=gnu11 -fsanitize=address -I.. sprint_prec.c ../*.c -ltalloc -lpthread -lm
+ */
+#include "bstring.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LL(x) ((long long)(x))
+
+static int failures;
+
+static void
+check(const bstring *got, const char *want, const char *what, const int prec)
+{
+        if (!got || got->slen != strlen(want) || memcmp(got->data, want, got->slen) != 0) {
+                fprintf(stderr, "FAIL %s (prec %d): got \"%s\"\n", what, prec,
+                        got ? (const char *)got->data : "(null)");
+                ++failures;
+        }
+}
+
+int
+main(void)
+{
+        const int64_t m = INT64_MIN;
+        char          want[1024];
+
+        for (int prec = 0; prec <= 400; ++prec) {
+                snprintf(want, sizeof want, "%.*f%lld%lld%lld%lld%lld%lld%lld%lld", prec, 1e30,
+                         LL(m), LL(m), LL(m), LL(m), LL(m), LL(m), LL(m), LL(m));
+
+                bstring *str = b_sprint(b_arg_fixed(1e30, prec), m, m, m, m, m, m, m, m);
+                check(str, want, "b_sprint", prec);
+                b_free(str);
+
+                str = b_fromlit("");
+                b_sprinta(str, b_arg_fixed(1e30, prec), m, m, m, m, m, m, m, m);
+                check(str, want, "b_sprinta", prec);
+                b_free(str);
+        }
+
+        return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
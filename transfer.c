@@ -0,0 +1,181 @@
+/*
+ * Descriptor to descriptor transfers. Data that passes through unchanged
+ * needn't be read into a bstring and written back out: the kernel can move it
+ * directly with copy_file_range, sendfile or splice, depending on what the two
+ * descriptors are. Where none of those apply the data goes through one
+ * per-thread buffer, which is still one copy fewer than a bstring round trip
+ * and allocates nothing.
+ */
+
+#include "private.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#  include <sys/sendfile.h>
+#  define TRANSFER_SENDFILE
+#  define TRANSFER_SPLICE
+#  if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#    define TRANSFER_COPY_RANGE
+#  endif
+#endif
+
+#include "bstring.h"
+
+#define TRANSFER_BUFSIZ (65536U)
+
+/* The most handed to the kernel in one call; Linux stops at 2 GB anyway. */
+#define TRANSFER_CHUNK  ((size_t)1 << 30)
+
+static _Thread_local uchar transfer_buf[TRANSFER_BUFSIZ];
+
+enum transfer_method {
+        XFER_COPY_RANGE,
+        XFER_SENDFILE,
+        XFER_SPLICE,
+        XFER_BUFFER,
+};
+
+
+/*
+ * errno values meaning "this method can't handle these descriptors", as
+ * opposed to an actual I/O error.
+ */
+static bool
+transfer_unsupported(const int e)
+{
+        return e == EINVAL || e == ENOSYS || e == EXDEV || e == EBADF ||
+#ifdef EOPNOTSUPP
+               e == EOPNOTSUPP ||
+#endif
+               e == ENOTSUP;
+}
+
+
+/*
+ * One step of the plain copy: a single read, written out in full. Returns
+ * the number of bytes moved, 0 at EOF or BSTR_ERR.
+ */
+static int64_t
+transfer_buffered(const int out_fd, const int in_fd, const size_t want)
+{
+        ssize_t nread;
+        do
+                nread = read(in_fd, transfer_buf, MIN(want, sizeof transfer_buf));
+        while (nread < 0 && errno == EINTR);
+        if (nread <= 0)
+                return nread;
+
+        for (ssize_t off = 0; off < nread; ) {
+                const ssize_t n = write(out_fd, transfer_buf + off, (size_t)(nread - off));
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n < 0)
+                        return BSTR_ERR;
+                off += n;
+        }
+
+        return nread;
+}
+
+
+/*
+ * Move up to len bytes (UINT64_MAX for everything up to EOF) from the current
+ * position of in_fd to out_fd. The fastest method the descriptors allow is
+ * tried first, and a method that turns out not to apply is dropped before it
+ * has moved anything, so the data is never split between methods wrongly.
+ */
+int64_t
+b_fd_transfer(const int out_fd, const int in_fd, const uint64_t len)
+{
+        if (out_fd < 0 || in_fd < 0)
+                RUNTIME_ERROR();
+
+        enum transfer_method method = XFER_BUFFER;
+        struct stat          ist, ost;
+
+        if (fstat(in_fd, &ist) == 0 && fstat(out_fd, &ost) == 0) {
+                if (S_ISREG(ist.st_mode) && S_ISREG(ost.st_mode))
+                        method = XFER_COPY_RANGE;
+                else if (S_ISREG(ist.st_mode))
+                        method = XFER_SENDFILE;
+                else if (S_ISFIFO(ist.st_mode) || S_ISFIFO(ost.st_mode))
+                        method = XFER_SPLICE;
+        }
+
+        uint64_t left  = len;
+        int64_t  total = 0;
+        bool     moved = false;
+
+        while (left > 0) {
+                const size_t want = (size_t)MIN(left, (uint64_t)TRANSFER_CHUNK);
+                int64_t      n;
+
+                switch (method) {
+#ifdef TRANSFER_COPY_RANGE
+                case XFER_COPY_RANGE:
+                        n = copy_file_range(in_fd, NULL, out_fd, NULL, want, 0);
+                        break;
+#endif
+#ifdef TRANSFER_SENDFILE
+                case XFER_SENDFILE:
+                        n = sendfile(out_fd, in_fd, NULL, want);
+                        break;
+#endif
+#ifdef TRANSFER_SPLICE
+                case XFER_SPLICE:
+                        n = splice(in_fd, NULL, out_fd, NULL, want, SPLICE_F_MOVE);
+                        break;
+#endif
+                default:
+                        method = XFER_BUFFER;
+                        n      = transfer_buffered(out_fd, in_fd, want);
+                        break;
+                }
+
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        /* Demote only before the method has moved anything. */
+                        if (method != XFER_BUFFER && !moved && transfer_unsupported(errno)) {
+                                method = (method == XFER_COPY_RANGE)
+                                             ? XFER_SENDFILE
+                                             : XFER_BUFFER;
+                                continue;
+                        }
+                        RUNTIME_ERROR();
+                }
+                if (n == 0)
+                        break;
+
+                moved  = true;
+                total += n;
+                left  -= (uint64_t)n;
+        }
+
+        return total;
+}
+
+
+/*
+ * Convenience wrapper for whole files: the output is appended at out_fd's
+ * current position.
+ */
+int64_t
+b_file_transfer(const int out_fd, const char *path)
+{
+        if (out_fd < 0 || !path)
+                RUNTIME_ERROR();
+
+        const int in_fd = open(path, O_RDONLY);
+        if (in_fd < 0)
+                RUNTIME_ERROR();
+
+        const int64_t ret = b_fd_transfer(out_fd, in_fd, UINT64_MAX);
+        const int     e   = errno;
+        close(in_fd);
+        errno = e;
+
+        return ret;
+}
@@ -0,0 +1,424 @@
+/*
+ * Buffered output object. Appends go into a large bstring buffer and reach the
+ * descriptor in a few big writes, instead of one locked stdio call (or one
+ * write system call) per line. Every writer is thread safe. By default all
+ * threads share one buffer; with B_WRITER_PER_THREAD each thread gets a buffer
+ * of its own, so threads only meet on the descriptor lock when a buffer is
+ * written out.
+ */
+
+#include "private.h"
+
+#include "bstring.h"
+
+#ifdef BSTR_USE_TALLOC
+#  include <talloc.h>
+#  define free talloc_free
+#endif
+
+#define WRITER_BUFSIZ (65536U)
+
+struct writer_buf {
+        struct writer_buf *next;
+        struct writer_buf *prev;
+        b_writer          *wr;
+        bstring           *data;
+        pthread_mutex_t    lock;
+};
+
+/*
+ * Lock order is list_lock, then a buffer's lock, then io_lock. A thread
+ * appending to its own buffer takes only the last two.
+ */
+struct b_writer {
+        struct writer_buf *bufs;
+        pthread_mutex_t    list_lock;
+        pthread_mutex_t    io_lock;
+        pthread_key_t      key;
+        int                fd;
+        unsigned           flags;
+        unsigned           bufsize;
+};
+
+
+static struct writer_buf *
+writer_buf_new(b_writer *wr)
+{
+#ifdef BSTR_USE_TALLOC
+        struct writer_buf *buf = talloc(NULL, struct writer_buf);
+#else
+        struct writer_buf *buf = malloc(sizeof(struct writer_buf));
+#endif
+        if (!buf)
+                FATAL_ERROR("Out of memory");
+
+        buf->next = buf->prev = NULL;
+        buf->wr   = wr;
+        buf->data = b_create(wr->bufsize);
+        pthread_mutex_init(&buf->lock, NULL);
+
+        return buf;
+}
+
+
+static void
+writer_buf_free(struct writer_buf *buf)
+{
+        b_free(buf->data);
+        pthread_mutex_destroy(&buf->lock);
+        free(buf);
+}
+
+
+static void
+writer_link(b_writer *wr, struct writer_buf *buf)
+{
+        buf->prev = NULL;
+        buf->next = wr->bufs;
+        if (wr->bufs)
+                wr->bufs->prev = buf;
+        wr->bufs = buf;
+}
+
+
+static void
+writer_unlink(b_writer *wr, struct writer_buf *buf)
+{
+        if (buf->prev)
+                buf->prev->next = buf->next;
+        else
+                wr->bufs = buf->next;
+        if (buf->next)
+                buf->next->prev = buf->prev;
+}
+
+
+static int
+writer_write_all(const int fd, const uchar *data, size_t len)
+{
+        while (len > 0) {
+                const ssize_t n = write(fd, data, len);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n < 0)
+                        return BSTR_ERR;
+                data += n;
+                len  -= (size_t)n;
+        }
+
+        return BSTR_OK;
+}
+
+
+/*
+ * Write out a buffer, whose lock the caller holds. Unless everything is asked
+ * for, a trailing incomplete line is held back so that lines from different
+ * threads are never interleaved mid-line. Whatever couldn't be written stays
+ * in the buffer.
+ */
+static int
+writer_emit(b_writer *wr, struct writer_buf *buf, const bool everything)
+{
+        bstring *data = buf->data;
+        unsigned n    = data->slen;
+
+        if (!everything) {
+                const uchar *nl = memrchr(data->data, '\n', n);
+                if (nl)
+                        n = (unsigned)PTRSUB(nl, data->data) + 1U;
+        }
+        if (n == 0)
+                return BSTR_OK;
+
+        pthread_mutex_lock(&wr->io_lock);
+        const int ret = writer_write_all(wr->fd, data->data, n);
+        pthread_mutex_unlock(&wr->io_lock);
+        if (ret != BSTR_OK)
+                RUNTIME_ERROR();
+
+        memmove(data->data, data->data + n, data->slen - n);
+        data->slen -= n;
+        data->data[data->slen] = (uchar)'\0';
+
+        return BSTR_OK;
+}
+
+
+/*
+ * Runs when a thread that has written through a per-thread writer exits: its
+ * buffer is written out and discarded.
+ */
+static void
+writer_thread_exit(void *arg)
+{
+        struct writer_buf *buf = arg;
+        b_writer          *wr  = buf->wr;
+
+        pthread_mutex_lock(&wr->list_lock);
+        writer_unlink(wr, buf);
+        pthread_mutex_unlock(&wr->list_lock);
+
+        pthread_mutex_lock(&buf->lock);
+        writer_emit(wr, buf, true);
+        pthread_mutex_unlock(&buf->lock);
+        writer_buf_free(buf);
+}
+
+
+/*
+ * Find and lock the calling thread's buffer, creating it on first use.
+ */
+static struct writer_buf *
+writer_acquire(b_writer *wr)
+{
+        struct writer_buf *buf;
+
+        if (wr->flags & B_WRITER_PER_THREAD) {
+                buf = pthread_getspecific(wr->key);
+                if (!buf) {
+                        buf = writer_buf_new(wr);
+                        pthread_setspecific(wr->key, buf);
+                        pthread_mutex_lock(&wr->list_lock);
+                        writer_link(wr, buf);
+                        pthread_mutex_unlock(&wr->list_lock);
+                }
+        } else {
+                buf = wr->bufs;
+        }
+
+        pthread_mutex_lock(&buf->lock);
+        return buf;
+}
+
+
+static int
+writer_release(b_writer *wr, struct writer_buf *buf, int ret)
+{
+        if (ret == BSTR_OK && buf->data->slen >= wr->bufsize)
+                ret = writer_emit(wr, buf, false);
+        pthread_mutex_unlock(&buf->lock);
+
+        return ret;
+}
+
+
+/*============================================================================*/
+/* Creation and destruction */
+/*============================================================================*/
+
+
+b_writer *
+b_writer_open(const int fd, const unsigned bufsize, const unsigned flags)
+{
+        if (fd < 0)
+                RETURN_NULL();
+
+#ifdef BSTR_USE_TALLOC
+        b_writer *wr = talloc(NULL, b_writer);
+#else
+        b_writer *wr = malloc(sizeof(b_writer));
+#endif
+        wr->bufs    = NULL;
+        wr->fd      = fd;
+        wr->flags   = flags;
+        wr->bufsize = bufsize ? bufsize : WRITER_BUFSIZ;
+
+        if (flags & B_WRITER_PER_THREAD) {
+                if (pthread_key_create(&wr->key, &writer_thread_exit) != 0) {
+                        free(wr);
+                        RETURN_NULL();
+                }
+        } else {
+                wr->bufs = writer_buf_new(wr);
+        }
+
+        pthread_mutex_init(&wr->list_lock, NULL);
+        pthread_mutex_init(&wr->io_lock, NULL);
+
+        return wr;
+}
+
+
+/*
+ * Write out every buffer, merging whatever the threads have accumulated. The
+ * held back partial lines go too.
+ */
+int
+b_writer_flush(b_writer *wr)
+{
+        if (!wr)
+                RUNTIME_ERROR();
+
+        int ret = BSTR_OK;
+
+        pthread_mutex_lock(&wr->list_lock);
+        for (struct writer_buf *buf = wr->bufs; buf; buf = buf->next) {
+                pthread_mutex_lock(&buf->lock);
+                if (writer_emit(wr, buf, true) != BSTR_OK)
+                        ret = BSTR_ERR;
+                pthread_mutex_unlock(&buf->lock);
+        }
+        pthread_mutex_unlock(&wr->list_lock);
+
+        return ret;
+}
+
+
+int
+b_writer_close(b_writer *wr)
+{
+        if (!wr)
+                return BSTR_OK;
+
+        const int ret = b_writer_flush(wr);
+
+        /* Buffers of threads still running are freed here instead. */
+        if (wr->flags & B_WRITER_PER_THREAD)
+                pthread_key_delete(wr->key);
+
+        struct writer_buf *buf = wr->bufs;
+        while (buf) {
+                struct writer_buf *next = buf->next;
+                writer_buf_free(buf);
+                buf = next;
+        }
+
+        pthread_mutex_destroy(&wr->list_lock);
+        pthread_mutex_destroy(&wr->io_lock);
+        free(wr);
+
+        return ret;
+}
+
+
+/*============================================================================*/
+/* Appending */
+/*============================================================================*/
+
+
+int
+b_writer_put_blk(b_writer *wr, const void *blk, const unsigned len)
+{
+        if (!wr || (!blk && len > 0))
+                RUNTIME_ERROR();
+
+        struct writer_buf *buf = writer_acquire(wr);
+        int                ret;
+
+        /* Anything at least a buffer long goes straight out after what's
+         * already queued. */
+        if (len >= wr->bufsize) {
+                ret = writer_emit(wr, buf, true);
+                if (ret == BSTR_OK) {
+                        pthread_mutex_lock(&wr->io_lock);
+                        ret = writer_write_all(wr->fd, blk, len);
+                        pthread_mutex_unlock(&wr->io_lock);
+                }
+        } else {
+                ret = b_catblk(buf->data, blk, len);
+        }
+
+        return writer_release(wr, buf, ret);
+}
+
+
+int
+b_writer_put(b_writer *wr, const bstring *bstr)
+{
+        if (INVALID(bstr))
+                RUNTIME_ERROR();
+
+        return b_writer_put_blk(wr, bstr->data, bstr->slen);
+}
+
+
+int
+b_writer_put_char(b_writer *wr, const int ch)
+{
+        if (!wr)
+                RUNTIME_ERROR();
+
+        struct writer_buf *buf = writer_acquire(wr);
+        return writer_release(wr, buf, b_catchar(buf->data, (char)ch));
+}
+
+
+int
+b_writer_put_int(b_writer *wr, const int64_t val)
+{
+        if (!wr)
+                RUNTIME_ERROR();
+
+        struct writer_buf *buf = writer_acquire(wr);
+        return writer_release(wr, buf, b_cat_int(buf->data, val));
+}
+
+
+int
+b_writer_put_uint(b_writer *wr, const uint64_t val)
+{
+        if (!wr)
+                RUNTIME_ERROR();
+
+        struct writer_buf *buf = writer_acquire(wr);
+        return writer_release(wr, buf, b_cat_uint(buf->data, val));
+}
+
+
+int
+_b_writer_vprintf(b_writer *wr, const bstring *fmt, va_list args)
+{
+        if (!wr || INVALID(fmt))
+                RUNTIME_ERROR();
+
+        struct writer_buf *buf = writer_acquire(wr);
+        return writer_release(wr, buf, _b_vsprintfa(buf->data, fmt, args));
+}
+
+
+int
+_b_writer_printf(b_writer *wr, const bstring *fmt, ...)
+{
+        va_list va;
+        va_start(va, fmt);
+        const int ret = _b_writer_vprintf(wr, fmt, va);
+        va_end(va);
+
+        return ret;
+}
+
+
+int
+_b_writer_print(b_writer *wr, const b_arg *argv, const unsigned argc)
+{
+        if (!wr || (!argv && argc > 0))
+                RUNTIME_ERROR();
+
+        struct writer_buf *buf = writer_acquire(wr);
+        return writer_release(wr, buf, _b_sprinta(buf->data, argv, argc));
+}
+
+
+/*
+ * Pass input through without copying it into the buffer. The calling thread's
+ * buffer is written first so the output stays in order, and the descriptor
+ * stays locked for the whole transfer.
+ */
+int64_t
+b_writer_transfer(b_writer *wr, const int in_fd, const uint64_t len)
+{
+        if (!wr || in_fd < 0)
+                RUNTIME_ERROR();
+
+        struct writer_buf *buf = writer_acquire(wr);
+        int64_t            ret = writer_emit(wr, buf, true);
+
+        if (ret == BSTR_OK) {
+                pthread_mutex_lock(&wr->io_lock);
+                ret = b_fd_transfer(wr->fd, in_fd, len);
+                pthread_mutex_unlock(&wr->io_lock);
+        }
+        pthread_mutex_unlock(&buf->lock);
+
+        return ret;
+}